@@ -0,0 +1,1747 @@
+#pragma once
+#include "kit.h"
+#include "journal.h"
+#include "metrics.h"
+#ifndef _WIN32
+#include "../network/async_http.h"
+#endif
+
+BEGIN_NAMESPACE_MCD
+
+struct AppTaskParam
+{
+	typedef DownloadJournal::Spans Spans;
+
+	enum class Engine {
+		Threads, // a thread blocked on each connection
+		Reactor // a few event loops drive all connections, POSIX only
+	};
+
+	std::string url; // also what the journal knows the download by
+	std::vector<std::string> mirrors; // more urls of the same file
+	std::string filePath;
+	HttpConfig config;
+	int64_t totalSize = 0;
+	int64_t granularity = 0;
+	int connNum = 0; // workers to start with
+	int maxConnNum = 0; // the limit of auto mode, 0 keeps connNum fixed
+	size_t bufferSize = KB(256); // bytes per read, see BufferPool
+	int64_t endGameSize = MB(4); // see raceTask(), 0 turns it off
+	double stragglerWindow = 8.0; // see AppStragglerDetector, 0 turns it off
+	double stragglerRatio = 0.2; // of the median speed
+	Engine engine = Engine::Threads;
+	ParallelFileWriter::Options writerOptions;
+
+	// paces the reads of all workers, owned by the caller so that the
+	// rate can be changed while running and shared by several downloads
+	RateLimiter* rateLimiter = nullptr;
+
+	// the root of TreeHash in hex, checked at the end when set
+	std::string treeHash;
+
+	// see AppMetrics::save(), written every metricsInterval seconds
+	// and at the end when set
+	std::string metricsPath;
+	double metricsInterval = 1.0;
+
+	DownloadJournal::Validator validator;
+	Spans doneRanges; // loaded from the journal when resuming
+};
+
+class AppTaskList
+{
+public:
+	typedef Range<int64_t> Task;
+	typedef HttpProxyWriter::RacePtr RacePtr;
+	typedef std::function<bool(Task*)> StealFn;
+	typedef std::function<bool(Task*, RacePtr*)> RaceFn;
+
+	// splitting a range smaller than this costs more than it saves
+	static const int64_t kMinSplitSize = KB(64);
+
+	// called when the queue runs dry, to cut a task from a busy worker
+	void onExhausted(StealFn fn)
+	{
+		m_steal = fn;
+	}
+
+	// called when there is nothing left to steal either, to race
+	// a busy worker for the rest of its range
+	void onEndGame(RaceFn fn)
+	{
+		m_race = fn;
+	}
+
+	void spawn(const AppTaskParam& param)
+	{
+		auto missing = DownloadJournal::missingSpans(
+			param.doneRanges, param.totalSize);
+
+		for (auto& i : missing)
+			spawn(i, param.granularity);
+	}
+
+	bool get(Task* task)
+	{
+		if (pop(task))
+			return true;
+
+		return m_steal && m_steal(task);
+	}
+
+	bool race(Task* task, RacePtr* race)
+	{
+		return m_race && m_race(task, race);
+	}
+
+	// for ranges handed back by retired workers
+	void put(Task task)
+	{
+		Guard::Mutex lock(&m_mutex);
+		m_tasks.push(task);
+	}
+
+	bool pop(Task* task)
+	{
+		Guard::Mutex lock(&m_mutex);
+		if (m_tasks.empty())
+			return false;
+
+		*task = m_tasks.front();
+		m_tasks.pop();
+		return true;
+	}
+
+	size_t size()
+	{
+		Guard::Mutex lock(&m_mutex);
+		return m_tasks.size();
+	}
+
+private:
+	void spawn(Task span, int64_t step)
+	{
+		for (int64_t i = span.first; i < span.second; i += step) {
+			int64_t begin = i;
+			int64_t end = i + step;
+			if (end > span.second)
+				end = span.second;
+
+			m_tasks.push(Range<int64_t>(begin, end));
+		}
+	}
+
+	std::queue<Task> m_tasks;
+	std::mutex m_mutex;
+	StealFn m_steal;
+	RaceFn m_race;
+};
+
+// The urls a download is fetched from, AppTaskParam::url first. Each
+// request goes to the mirror with the fewest requests in flight for its
+// speed, so the faster mirrors get more of the ranges. A mirror that
+// keeps failing, or fails in a way no retry fixes, is dropped as long
+// as another one is left.
+class AppMirrorSet
+{
+public:
+	static const int kMaxFailures = 3; // in a row
+	static constexpr double kSpeedWeight = 0.3; // of a new sample
+
+	void init(const AppTaskParam& param)
+	{
+		m_mirrors.clear();
+		add(param.url);
+		for (auto& i : param.mirrors)
+			add(i);
+	}
+
+	size_t size() const
+	{
+		return m_mirrors.size();
+	}
+
+	int alive() const
+	{
+		Guard::Mutex lock(&m_mutex);
+		return aliveImpl();
+	}
+
+	// the urls do not change after init()
+	ConStrRef url(int index) const
+	{
+		return m_mirrors[index].url;
+	}
+
+	const StringParser::HttpUrl& parsedUrl(int index) const
+	{
+		return m_mirrors[index].parsedUrl;
+	}
+
+	// for the next request, which is in flight until done()
+	int pick()
+	{
+		Guard::Mutex lock(&m_mutex);
+		double fastest = 1;
+		for (auto& i : m_mirrors)
+			fastest = std::max(fastest, i.speed);
+
+		int best = -1;
+		double bestLoad = 0;
+		for (int i = 0; i < (int)m_mirrors.size(); ++i) {
+			const Mirror& m = m_mirrors[i];
+			if (m.dropped)
+				continue;
+
+			// one not measured yet is taken for the fastest
+			double speed = m.speed > 0 ? m.speed : fastest;
+			double load = (m.inFlight + 1) / speed;
+			if (best < 0 || load < bestLoad) {
+				best = i;
+				bestLoad = load;
+			}
+		}
+
+		assert(best >= 0);
+		++m_mirrors[best].inFlight;
+		return best;
+	}
+
+	// `size` bytes came in `seconds`; returns true when the mirror is
+	// dropped, the retry of the failed request then goes to another one
+	bool done(int index, Result r, int64_t size, double seconds)
+	{
+		Guard::Mutex lock(&m_mutex);
+		Mirror& m = m_mirrors[index];
+		--m.inFlight;
+
+		if (r.ok()) {
+			m.failures = 0;
+			if (size > 0 && seconds > 0) {
+				double sample = size / seconds;
+				m.speed = m.speed > 0
+					? m.speed + kSpeedWeight * (sample - m.speed) : sample;
+			}
+
+			return false;
+		}
+
+		if (m.dropped)
+			return true;
+
+		if (r.is(InternalError::userAbort))
+			return false;
+
+		++m.failures;
+		bool busy = r.space() == "http" && inArray(r.code(), {429, 503});
+		bool hopeless = !(http_api::transientError(r) || busy)
+			|| m.failures >= kMaxFailures;
+
+		if (!hopeless || aliveImpl() <= 1)
+			return false;
+
+		_should(false, m.url, r.space(), r.code());
+		m.dropped = true;
+		return true;
+	}
+
+private:
+	struct Mirror
+	{
+		std::string url;
+		StringParser::HttpUrl parsedUrl;
+		double speed = 0; // bytes per second of a request
+		int inFlight = 0;
+		int failures = 0;
+		bool dropped = false;
+	};
+
+	void add(ConStrRef url)
+	{
+		Mirror m;
+		m.url = url;
+		m.parsedUrl = StringParser::HttpUrl(url);
+		m_mirrors.push_back(m);
+	}
+
+	// requires m_mutex
+	int aliveImpl() const
+	{
+		int n = 0;
+		for (auto& i : m_mirrors)
+			n += !i.dropped;
+
+		return n;
+	}
+
+	std::vector<Mirror> m_mirrors;
+	mutable std::mutex m_mutex;
+};
+
+// What the contractor sees of a worker, whatever drives its connection:
+// the range being downloaded, the ranges done before and the retry wait.
+class AppWorker : public InterfaceClass
+{
+public:
+	typedef std::chrono::steady_clock Clock;
+
+	// the failure, and whether its mirror has been dropped for it
+	typedef std::function<bool(Result, bool)> AskRetry;
+	typedef std::vector<Range<int64_t>> Ranges;
+
+	AppWorker(
+		const AppTaskParam& param,
+		AppTaskList* list,
+		ParallelFileWriter* writer,
+		AppMirrorSet* mirrors,
+		AskRetry askRetry) :
+		m_taskParam(param),
+		m_taskList(list),
+		m_writer(writer),
+		m_mirrors(mirrors),
+		m_askRetry(askRetry)
+	{
+		assert(m_askRetry);
+	}
+
+	virtual void abort() = 0;
+
+	// returns once the worker has left
+	virtual void join() = 0;
+
+	// hands the unfinished part of the range back to the task list,
+	// the worker leaves once its current request is cancelled
+	void retire()
+	{
+		m_retired = true;
+		giveBack();
+		abort();
+	}
+
+	// gives the unfinished part of the range back and drops the
+	// connection, the worker goes on with a new one
+	void reconnect()
+	{
+		m_speed.reset();
+		giveBack();
+	}
+
+	bool active() const
+	{
+		return !m_retired && !m_finished;
+	}
+
+	int64_t sizeDone() const
+	{
+		return m_preSizeDone + m_writer.sizeDone();
+	}
+
+	const AppConnMetrics& metrics() const
+	{
+		return m_metrics;
+	}
+
+	int64_t received() const
+	{
+		return m_writer.received();
+	}
+
+	// from the heartbeat of the contractor
+	void sampleSpeed()
+	{
+		m_speed.update(sizeDone());
+	}
+
+	const SpeedMeter& speed() const
+	{
+		return m_speed;
+	}
+
+	int64_t remaining() const
+	{
+		return m_writer.remaining();
+	}
+
+	bool split(int64_t minSize, AppTaskList::Task* tail)
+	{
+		return m_writer.split(minSize, tail);
+	}
+
+	// opens the rest of the range to a duplicate request
+	HttpProxyWriter::RacePtr race(AppTaskList::Task* rest)
+	{
+		return m_writer.startRace(rest);
+	}
+
+	// to finish the range at the speed of the worker
+	double timeLeft() const
+	{
+		return m_speed.eta(m_writer.end() - m_writer.pos());
+	}
+
+	Range<int64_t> curRange() const
+	{
+		Guard::Mutex lock(&m_rangesMutex);
+		int64_t left = m_range.first;
+		int64_t right = left + m_writer.sizeDone();
+		return Range<int64_t>(left, right);
+	}
+
+	Ranges preRanges() const
+	{
+		Guard::Mutex lock(&m_rangesMutex);
+		return m_preRanges;
+	}
+
+	int waitingTimes() const
+	{
+		return m_waitingTimes;
+	}
+
+	void resetWaitingTimes()
+	{
+		m_waitingTimes = 0;
+	}
+
+protected:
+	static const int kMaxTimesTried = 8;
+
+	// false when there is nothing left for this worker
+	bool nextTask()
+	{
+		if (m_retired)
+			return false;
+
+		AppTaskList::Task task;
+		AppTaskList::RacePtr race;
+		if (!m_taskList->get(&task) && !m_taskList->race(&task, &race))
+			return false;
+
+		setRange(task);
+		m_writer.init(task, race);
+
+		// retired between taking the task and owning it
+		if (m_retired) {
+			giveBack();
+			return false;
+		}
+
+		return true;
+	}
+
+	// 2^n seconds before the n-th retry, counted in half seconds
+	void startWaiting(int timesTried)
+	{
+		int seconds = (int)pow(2, timesTried);
+		m_waitingTimes = seconds * 2;
+	}
+
+	// the rest of the range, from the mirror picked for it
+	void beginRequest()
+	{
+		rebuildRange();
+		m_mirror = m_mirrors->pick();
+		m_requestStart = Clock::now();
+		++m_metrics.requests;
+		m_requestSizeDone = m_writer.sizeDone();
+	}
+
+	// the range is done when the request succeeded, when the range
+	// has been split down to what is already written, or when another
+	// request has won the race for it; returns whether it is done
+	bool endRequest(Result r)
+	{
+		bool done = r.ok() || m_writer.completed();
+		double seconds = std::chrono::duration<double>(
+			Clock::now() - m_requestStart).count();
+		m_mirrorDropped = m_mirrors->done(m_mirror, done ? Result() : r,
+			m_writer.sizeDone() - m_requestSizeDone, seconds);
+
+		if (done)
+			finishRange();
+		else
+			m_metrics.addFailure(r);
+
+		return done;
+	}
+
+	void finishRange()
+	{
+		Guard::Mutex lock(&m_rangesMutex);
+		m_range.second = m_writer.end();
+		m_preRanges.push_back(m_range);
+		m_preSizeDone += m_writer.sizeDone();
+		m_writer.clear();
+	}
+
+	// the head of a response has arrived
+	void responded(const ConnTimings& timings)
+	{
+		m_metrics.addTimings(timings);
+		m_metrics.firstByte.record(std::chrono::duration<double>(
+			Clock::now() - m_requestStart).count());
+	}
+
+	void giveBack()
+	{
+		AppTaskList::Task tail;
+		if (m_writer.release(&tail))
+			m_taskList->put(tail);
+	}
+
+	void setRange(Range<int64_t> range)
+	{
+		Guard::Mutex lock(&m_rangesMutex);
+		m_range = range;
+	}
+
+	// a request in a race goes on from where the race has got to,
+	// the bytes before are written by one or another
+	void rebuildRange()
+	{
+		m_writer.catchUp();
+		m_curRange.first = m_writer.pos();
+		m_curRange.second = m_writer.end() - 1;
+		assert(m_curRange.second >= m_curRange.first);
+	}
+
+	std::string rangeHeader() const
+	{
+		std::stringstream ss;
+		ss << "Range: bytes=" << m_curRange.first
+			<< "-" << (m_curRange.second);
+
+		return ss.str();
+	}
+
+	Result ckeckContentRange(std::string_view contentRange)
+	{
+		auto invalidInput = InternalError::invalidInput;
+		_must_or_return(invalidInput, contentRange.size());
+
+		std::array<int64_t, 3> range;
+		_call(parseHttpRange(contentRange, &range));
+		if (m_curRange.first != range[0] || m_curRange.second != range[1])
+			++m_metrics.rangeMismatches;
+
+		_must_or_return(invalidInput, m_curRange.first == range[0]);
+		_must_or_return(invalidInput, m_curRange.second == range[1]);
+
+		return {};
+	}
+
+	Range<int64_t> m_range; // [a, b), b may shrink when split
+	Range<int64_t> m_curRange; // [a, b]
+
+	const AppTaskParam& m_taskParam; // owned by the contractor
+	AppTaskList* m_taskList;
+	HttpProxyWriter m_writer;
+
+	AppMirrorSet* m_mirrors;
+	int m_mirror = 0; // of the current request
+	bool m_mirrorDropped = false; // for the failure of the last one
+	Clock::time_point m_requestStart;
+	int64_t m_requestSizeDone = 0;
+
+	AppConnMetrics m_metrics;
+	AskRetry m_askRetry;
+	std::atomic_int m_waitingTimes = 0;
+	std::atomic_bool m_retired = false;
+	std::atomic_bool m_finished = false;
+
+	std::atomic_int64_t m_preSizeDone = 0;
+	SpeedMeter m_speed;
+	Ranges m_preRanges;
+	mutable std::mutex m_rangesMutex;
+};
+
+// A thread per connection, blocked in the calls of HttpGetRequest.
+class AppDownloadWorker : public AppWorker
+{
+public:
+	AppDownloadWorker(
+		const AppTaskParam& param,
+		AppTaskList* list,
+		ParallelFileWriter* writer,
+		AppMirrorSet* mirrors,
+		BufferPool* bufferPool,
+		AskRetry askRetry) :
+		AppWorker(param, list, writer, mirrors, askRetry),
+		m_bufferPool(bufferPool)
+	{
+		m_writer.onLost([this]() {
+			m_requestSignal.trigger();
+		});
+
+		m_thread = std::thread(std::bind(&AppDownloadWorker::run, this));
+	}
+
+	void abort() override
+	{
+		m_signal.trigger();
+	}
+
+	void join() override
+	{
+		m_thread.join();
+	}
+
+private:
+	void run()
+	{
+		BufferPool::Lease lease = m_bufferPool->acquire();
+		m_buffer = lease.data();
+
+		runImpl();
+		m_finished = true;
+	}
+
+	void runImpl()
+	{
+		for (;;) {
+			// the previous range is done with, so is what cancelled it
+			m_requestSignal.clear();
+			if (!nextTask())
+				return;
+
+			Result r = work();
+
+			if (r.failed()) {
+				if (!doRetry(r))
+					return;
+			}
+		}
+	}
+
+	bool wait(int times)
+	{
+		startWaiting(times);
+
+		for (; m_waitingTimes > 0 && !m_writer.completed(); --m_waitingTimes) {
+			if (m_signal.didAborted())
+				return false;
+
+			sleep(0.5);
+		}
+
+		return true;
+	}
+
+	bool doRetry(Result r)
+	{
+		int timesTried = 0;
+		for (;;) {
+			if (timesTried < kMaxTimesTried)
+				++timesTried;
+
+			if (!wait(timesTried))
+				return false;
+
+			if (m_askRetry(r, m_mirrorDropped)) {
+				r = work();
+				if (r.ok())
+					return true;
+			}
+			else {
+				return false;
+			}
+		}
+	}
+
+	Result work()
+	{
+		// taken over by another request before this one went out
+		if (m_writer.completed()) {
+			finishRange();
+			return {};
+		}
+
+		Result r = workImpl();
+		return endRequest(r) ? Result() : r;
+	}
+
+	Result workImpl()
+	{
+		beginRequest();
+		Result r;
+		{
+			AbortSignal::Guard asg(&m_signal, [&]() {
+				m_http.abort();
+			});
+
+			AbortSignal::Guard rsg(&m_requestSignal, [&]() {
+				m_http.abort();
+			});
+
+			r = request();
+		}
+
+		// no other thread aborts it once the guards are gone
+		if (r.failed())
+			m_http.reset(); // reconnect on the next try
+
+		return r;
+	}
+
+	// the session outlives the task, so keep-alive connections
+	// are reused by the following ranges
+	Result request()
+	{
+		if (!m_http.initialized()) {
+			_call(m_http.init(m_taskParam.config));
+			m_http.setRateLimiter(m_taskParam.rateLimiter);
+		}
+
+		_call(m_http.open(m_mirrors->parsedUrl(m_mirror), {rangeHeader()}));
+		responded(m_http.timings());
+		_equal_or_return_http_error(m_http, 206);
+		_call(ckeckContentRange(m_http.headers().firstValue("Content-Range")));
+
+		return m_http.saveResponse(&m_writer, &m_buffer);
+	}
+
+	std::thread m_thread;
+	HttpGetRequest m_http;
+	BufferPool* m_bufferPool;
+	BinaryData m_buffer;
+	AbortSignal m_signal;
+	AbortSignal m_requestSignal; // cancels the request, not the worker
+};
+
+#ifndef _WIN32
+// A worker without a thread of its own: its connection is driven by an
+// event loop of the reactor, and every step below runs on that loop.
+// The body is written from the read buffer of the loop, so a connection
+// costs a socket and a few small strings.
+class AppReactorWorker : public AppWorker,
+	private AsyncHttpConnection::Listener
+{
+public:
+	AppReactorWorker(
+		const AppTaskParam& param,
+		AppTaskList* list,
+		ParallelFileWriter* writer,
+		AppMirrorSet* mirrors,
+		EventLoop* loop,
+		AskRetry askRetry) :
+		AppWorker(param, list, writer, mirrors, askRetry),
+		m_connection(loop, param.config.connectTimeout())
+	{
+		m_connection.setRateLimiter(param.rateLimiter);
+		m_writer.onLost([this]() {
+			m_connection.loop()->post([this]() {
+				cancelRequest();
+			});
+		});
+
+		loop->post([this]() {
+			next();
+		});
+	}
+
+	void abort() override
+	{
+		m_aborted = true;
+		m_connection.loop()->post([this]() {
+			if (m_finished)
+				return;
+
+			// in the middle of a request unless waiting to retry
+			if (!m_timer)
+				endRequest(InternalError::userAbort());
+
+			finish();
+		});
+	}
+
+	void join() override
+	{
+		std::unique_lock<std::mutex> lock(m_finishMutex);
+		m_finishCondition.wait(lock, [this]() {
+			return m_finished.load();
+		});
+	}
+
+private:
+	void next()
+	{
+		if (m_aborted || !nextTask())
+			return finish();
+
+		m_timesTried = 0;
+		request();
+	}
+
+	void request()
+	{
+		beginRequest();
+		RequestHeaders headers = m_taskParam.config.headers();
+		headers.push_back(rangeHeader());
+		m_connection.request(m_mirrors->parsedUrl(m_mirror), headers, this);
+	}
+
+	Result onResponse(int statusCode, std::string_view rawHeaders) override
+	{
+		responded(m_connection.timings());
+		if (!_eval_error(statusCode == 206)
+			.setContext(m_mirrors->url(m_mirror)))
+			return Result("http", statusCode);
+
+		return ckeckContentRange(
+			http1::headerValue(rawHeaders, "Content-Range"));
+	}
+
+	Result onBody(const BinaryData& data, bool* enough) override
+	{
+		_call(m_writer.write(data));
+		*enough = m_writer.completed();
+		return {};
+	}
+
+	void onDone(Result r) override
+	{
+		if (endRequest(r))
+			return next();
+
+		if (m_aborted)
+			return finish();
+
+		if (m_timesTried < kMaxTimesTried)
+			++m_timesTried;
+
+		startWaiting(m_timesTried);
+		waitToRetry(r);
+	}
+
+	// ticks every half second, so that resetWaitingTimes() cuts it short
+	void waitToRetry(Result r)
+	{
+		m_timer = 0;
+		if (m_aborted)
+			return finish();
+
+		if (m_waitingTimes > 0) {
+			--m_waitingTimes;
+			m_timer = m_connection.loop()->after(0.5, [this, r]() {
+				waitToRetry(r);
+			});
+			return;
+		}
+
+		if (m_askRetry(r, m_mirrorDropped))
+			request();
+		else
+			finish();
+	}
+
+	// another request has taken over the rest of the range, the
+	// worker may have gone on to the next one since
+	void cancelRequest()
+	{
+		if (m_finished || !m_writer.completed())
+			return;
+
+		m_connection.close();
+		if (!m_timer)
+			return onDone(InternalError::userAbort());
+
+		m_connection.loop()->cancel(m_timer);
+		m_timer = 0;
+		finishRange();
+		next();
+	}
+
+	void finish()
+	{
+		m_connection.close();
+		if (m_timer) {
+			m_connection.loop()->cancel(m_timer);
+			m_timer = 0;
+		}
+
+		Guard::Mutex lock(&m_finishMutex);
+		m_finished = true;
+		m_finishCondition.notify_all();
+	}
+
+	AsyncHttpConnection m_connection;
+	EventLoop::TimerId m_timer = 0;
+	int m_timesTried = 0;
+	std::atomic_bool m_aborted = false;
+
+	std::mutex m_finishMutex;
+	std::condition_variable m_finishCondition;
+};
+#endif
+
+// Picks the number of connections from the measured throughput (AIMD):
+// a few more while the aggregate speed keeps rising, a quarter less when
+// it drops well below the best seen or the server starts refusing.
+class AppConnTuner
+{
+public:
+	typedef std::chrono::steady_clock Clock;
+
+	static constexpr int kInitialConn = 4;
+	static const int kStep = 2;
+	static constexpr double kWindow = 3.0; // seconds between decisions
+
+	void init(int maxConn)
+	{
+		m_maxConn = maxConn;
+		m_target = std::min(kInitialConn, maxConn);
+		m_lastTime = Clock::now();
+	}
+
+	int target() const
+	{
+		return m_target;
+	}
+
+	// the target comes down at once when above the new limit
+	void setMaxConn(int maxConn)
+	{
+		m_maxConn = std::max(1, maxConn);
+		m_target = std::min(m_target, m_maxConn);
+	}
+
+	void onRefused()
+	{
+		++m_refusals;
+	}
+
+	// with the smoothed speed of all workers, returns true when the
+	// target changed
+	bool update(double speed)
+	{
+		auto now = Clock::now();
+		double elapsed = std::chrono::duration<double>(
+			now - m_lastTime).count();
+		if (elapsed < kWindow)
+			return false;
+
+		m_lastTime = now;
+
+		int target = m_target;
+		if (m_refusals > 0 || speed < m_bestSpeed * 0.7) {
+			target = std::max(1, m_target * 3 / 4);
+			m_bestSpeed = speed;
+		}
+		else if (speed > m_bestSpeed * 1.1) {
+			target = std::min(m_maxConn, m_target + kStep);
+			m_bestSpeed = speed;
+		}
+		else {
+			// plateau, let the mark sink to probe again later
+			m_bestSpeed *= 0.98;
+		}
+
+		m_refusals = 0;
+		bool changed = (target != m_target);
+		m_target = target;
+		return changed;
+	}
+
+private:
+	int m_maxConn = 1;
+	int m_target = 1;
+	std::atomic_int m_refusals = 0;
+	double m_bestSpeed = 0;
+	Clock::time_point m_lastTime;
+};
+
+// Finds the connections that crawl. Servers behind one name are not all
+// as fast, and a new connection often lands on a better one: a worker
+// below `ratio` of the median speed of the others for a whole window
+// gives its range back and reconnects. Checked on each heartbeat.
+class AppStragglerDetector
+{
+public:
+	typedef std::chrono::steady_clock Clock;
+
+	static const int kMinWorkers = 3; // for a median of any meaning
+
+	void init(double window, double ratio)
+	{
+		m_window = window;
+		m_ratio = ratio;
+	}
+
+	// the workers downloading at the moment, returns the ones to reset
+	std::vector<AppWorker*> update(const std::vector<AppWorker*>& workers)
+	{
+		std::vector<AppWorker*> measured;
+		std::vector<double> speeds;
+		for (auto w : workers) {
+			if (w->speed().measured()) {
+				measured.push_back(w);
+				speeds.push_back(w->speed().speed());
+			}
+		}
+
+		// a worker missing for a check starts over
+		auto now = Clock::now();
+		std::map<AppWorker*, Clock::time_point> slowSince;
+		std::vector<AppWorker*> stragglers;
+
+		if (m_window <= 0 || (int)speeds.size() < kMinWorkers) {
+			m_slowSince.clear();
+			return stragglers;
+		}
+
+		auto middle = speeds.begin() + speeds.size() / 2;
+		std::nth_element(speeds.begin(), middle, speeds.end());
+		double threshold = *middle * m_ratio;
+
+		for (auto w : measured) {
+			if (w->speed().speed() >= threshold)
+				continue;
+
+			auto it = m_slowSince.find(w);
+			auto since = (it != m_slowSince.end()) ? it->second : now;
+			double slowFor = std::chrono::duration<double>(now - since).count();
+
+			if (slowFor >= m_window)
+				stragglers.push_back(w); // measured afresh after the reset
+			else
+				slowSince[w] = since;
+		}
+
+		m_slowSince.swap(slowSince);
+		return stragglers;
+	}
+
+private:
+	double m_window = 0;
+	double m_ratio = 0;
+	std::map<AppWorker*, Clock::time_point> m_slowSince;
+};
+
+class AppDownloadContractor
+{
+public:
+	typedef AppDownloadContractor Self;
+	typedef std::function<void()> HeartbeatFn;
+
+	static constexpr double kMaxEta = 86400.0 * 100; // shown below it
+
+	// each save waits for the disk, see saveJournal()
+	static constexpr double kJournalInterval = 5.0;
+
+	void onHeartbeat(HeartbeatFn fn)
+	{
+		m_heartbeat = fn;
+	}
+
+	Result start(const AppTaskParam& param)
+	{
+		_call(init(param));
+
+		m_uiAlive = true;
+		std::thread ui(std::bind(&Self::updateUi, this));
+
+		joinWorkers();
+#ifndef _WIN32
+		m_reactor.stop();
+#endif
+
+		// wakes it at once, not at its next tick
+		{
+			Guard::Mutex lock(&m_uiMutex);
+			m_uiAlive = false;
+			m_uiCondition.notify_all();
+		}
+		ui.join();
+		exportMetrics();
+
+		if (m_userAborted) {
+			saveJournal();
+			return InternalError::userAbort();
+		}
+
+		// data may still be queued behind the write-behind thread
+		Result flushed = m_writer.flush();
+		if (m_result.ok())
+			m_result = flushed;
+
+		if (m_result.ok() && m_taskParam.treeHash.size()) {
+			// nothing to resume from when the content is wrong
+			m_result = checkTreeHash();
+			if (m_result.failed()) {
+				m_journal.remove();
+				return m_result;
+			}
+		}
+
+		if (m_result.failed())
+			saveJournal();
+		else
+			m_journal.remove();
+
+		return m_result;
+	}
+
+	void abort()
+	{
+		m_userAborted = true;
+		abortAllWorkers();
+	}
+
+	// caps the connections from any thread, for a share of a budget
+	// split with other downloads; 0 lifts the cap
+	void setConnLimit(int limit)
+	{
+		m_connLimit = limit;
+	}
+
+	// of a granularity each, from the queue and the ranges the
+	// workers are on; -1 until it has started
+	int64_t tasksLeft()
+	{
+		if (!m_started)
+			return -1;
+
+		int64_t g = std::max<int64_t>(m_taskParam.granularity, 1);
+		int64_t left = m_taskList.size();
+
+		Guard::Mutex lock(&m_workersMutex);
+		for (auto& i : m_workers) {
+			int64_t remaining = i->active() ? i->remaining() : 0;
+			if (remaining > 0)
+				left += (remaining + g - 1) / g;
+		}
+
+		return left;
+	}
+
+	std::string statusText()
+	{
+		double speed = m_speed.speed();
+		int64_t done = sizeDone();
+		double progress = done / totalSize();
+		std::string speedData = formattedDataSize((int64_t)speed, false);
+
+		size_t speedDataLen = speedData.size();
+		if (speedDataLen > m_speedDataMaxLen)
+			m_speedDataMaxLen = speedDataLen;
+
+		std::stringstream ss;
+		ss.precision(2);
+		ss << std::fixed;
+		ss << formattedDataSize(m_taskParam.totalSize, true);
+		ss << " (" << (progress * 100) << "%), ";
+
+		size_t filledWidth = m_speedDataMaxLen - speedDataLen;
+		if (filledWidth > 100) {
+			assert(0);
+			return {};
+		}
+
+		ss << std::string(filledWidth, ' ');
+		ss << speedData << "/s.";
+
+		double eta = m_speed.eta(m_taskParam.totalSize - done);
+		if (m_speed.measured() && eta < kMaxEta)
+			ss << " " << formattedDuration(eta) << " left.";
+
+		if (autoConnNum())
+			ss << " " << activeWorkers() << " conn.";
+
+		if (m_mirrors.size() > 1)
+			ss << " " << m_mirrors.alive() << " mirrors.";
+
+		return ss.str();
+	}
+
+	// may be called from any thread while running
+	AppMetrics metrics()
+	{
+		AppMetrics m;
+		m.elapsed = std::chrono::duration<double>(
+			AppWorker::Clock::now() - m_startTime).count();
+		m.totalSize = m_taskParam.totalSize;
+		m.speed = m_speed.speed();
+		m.writeLatency = m_writer.writeLatency().counts();
+
+		Guard::Mutex lock(&m_workersMutex);
+		m.bytesDone = sizeDone();
+		for (auto& i : m_workers) {
+			AppMetrics::Worker w;
+			w.bytesReceived = i->received();
+			w.requests = i->metrics().requests;
+			w.connections = i->metrics().connections;
+			w.speed = i->speed().speed();
+			w.active = i->active();
+			m.add(i->metrics(), w);
+		}
+
+		return m;
+	}
+
+	void getRanges(std::vector<Range<int>> *range, int scaleTo)
+	{
+		range->clear();
+		double rate = scaleTo / totalSize();
+
+		auto addRange = [=](Range<int64_t> r) {
+			int left = (int)(r.first * rate);
+			int right = (int)(r.second * rate);
+			range->emplace_back(left, right);
+		};
+
+		for (auto& dr : m_taskParam.doneRanges)
+			addRange(dr);
+
+		for (auto& w : m_workers) {
+			for (auto& pr : w->preRanges())
+				addRange(pr);
+
+			addRange(w->curRange());
+		}
+	}
+
+	bool hasWorkerWait() const
+	{
+		for (auto& i : m_workers)
+			if (i->waitingTimes() > 0)
+				return true;
+
+		return false;
+	}
+
+	void resetWorkerWait()
+	{
+		for (auto& i : m_workers)
+			i->resetWaitingTimes();
+	}
+
+private:
+	Result init(const AppTaskParam& param)
+	{
+		_must(m_heartbeat);
+
+		m_taskParam = param;
+		m_startTime = AppWorker::Clock::now();
+		m_mirrors.init(param);
+		m_taskList.spawn(param);
+		m_taskList.onExhausted(std::bind(&Self::stealTask, this, _1));
+		m_taskList.onEndGame(std::bind(&Self::raceTask, this, _1, _2));
+
+		bool resume = param.doneRanges.size();
+		_call(m_writer.init(param.filePath,
+			param.totalSize, resume, param.writerOptions));
+
+		if (param.treeHash.size()) {
+			m_treeHash.init(param.totalSize);
+			m_writer.hashWith(&m_treeHash);
+		}
+		m_bufferPool.init(param.bufferSize);
+		m_journal.init(param.filePath, param.url, param.validator);
+
+#ifndef _WIN32
+		// one read buffer per loop instead of one per connection
+		if (reactorEngine()) {
+			_call(m_reactor.start(Reactor::defaultLoops(),
+				m_bufferPool.bufferSize()));
+		}
+#endif
+
+		for (auto& i : param.doneRanges)
+			m_resumedSize += i.second - i.first;
+
+		if (autoConnNum()) {
+			m_tuner.init(m_taskParam.maxConnNum);
+			limitTuner();
+		}
+
+		m_stragglers.init(param.stragglerWindow, param.stragglerRatio);
+
+		int connNum = targetConnNum();
+		m_appliedTarget = connNum;
+
+		Guard::Mutex lock(&m_workersMutex);
+		for (auto i : range(connNum)) {
+			UNUSED(i);
+			addWorker();
+		}
+
+		m_started = true;
+		return {};
+	}
+
+	bool autoConnNum() const
+	{
+		return m_taskParam.maxConnNum > 0;
+	}
+
+	int targetConnNum() const
+	{
+		int target = autoConnNum() ? m_tuner.target() : m_taskParam.connNum;
+		int limit = m_connLimit;
+		return limit > 0 ? std::min(target, limit) : target;
+	}
+
+	void limitTuner()
+	{
+		int maxConn = m_taskParam.maxConnNum;
+		int limit = m_connLimit;
+		if (limit > 0)
+			maxConn = std::min(maxConn, limit);
+
+		m_tuner.setMaxConn(maxConn);
+	}
+
+	// the event-driven connections go direct, a proxy needs threads
+	bool reactorEngine() const
+	{
+#ifdef _WIN32
+		return false;
+#else
+		return m_taskParam.engine == AppTaskParam::Engine::Reactor
+			&& m_taskParam.config.httpProxy().empty();
+#endif
+	}
+
+	// requires m_workersMutex
+	void addWorker()
+	{
+		if (m_workersClosed)
+			return;
+
+		auto askRetry = std::bind(&Self::askRetry, this, _1, _2);
+#ifndef _WIN32
+		if (reactorEngine()) {
+			m_workers.emplace_back(
+				new AppReactorWorker(
+					m_taskParam, &m_taskList, &m_writer, &m_mirrors,
+					m_reactor.next(), askRetry
+				)
+			);
+			return;
+		}
+#endif
+
+		m_workers.emplace_back(
+			new AppDownloadWorker(
+				m_taskParam, &m_taskList, &m_writer, &m_mirrors,
+				&m_bufferPool, askRetry
+			)
+		);
+	}
+
+	// workers may be added while waiting, retired ones stay in the list
+	// so that their finished ranges keep counting
+	void joinWorkers()
+	{
+		for (size_t i = 0; ; ++i) {
+			AppWorker* worker = nullptr;
+			{
+				Guard::Mutex lock(&m_workersMutex);
+				if (i >= m_workers.size()) {
+					m_workersClosed = true;
+					return;
+				}
+
+				worker = m_workers[i].get();
+			}
+
+			worker->join();
+		}
+	}
+
+	int activeWorkers()
+	{
+		int n = 0;
+		for (auto& i : m_workers)
+			if (i->active())
+				++n;
+
+		return n;
+	}
+
+	// follows the tuner and the limit, workers that ran out of
+	// tasks are not replaced while the target stays the same
+	void tuneConnections()
+	{
+		if (m_userAborted || m_result.failed())
+			return;
+
+		if (autoConnNum()) {
+			limitTuner();
+			m_tuner.update(m_speed.speed());
+		}
+
+		int target = targetConnNum();
+		if (target == m_appliedTarget)
+			return;
+
+		m_appliedTarget = target;
+		Guard::Mutex lock(&m_workersMutex);
+		int active = activeWorkers();
+
+		for (; active < target; ++active)
+			addWorker();
+
+		// the ones waiting to retry go first
+		for (int waiting = 1; waiting >= 0 && active > target; --waiting) {
+			for (auto& i : m_workers) {
+				if (active <= target)
+					break;
+
+				if (i->active() && (i->waitingTimes() > 0) == !!waiting) {
+					i->retire();
+					--active;
+				}
+			}
+		}
+	}
+
+	// a range too small to split is left to the end game
+	void resetStragglers()
+	{
+		if (m_userAborted || m_result.failed())
+			return;
+
+		Guard::Mutex lock(&m_workersMutex);
+		std::vector<AppWorker*> downloading;
+		for (auto& i : m_workers) {
+			if (i->active() && i->waitingTimes() == 0
+				&& i->remaining() >= AppTaskList::kMinSplitSize * 2)
+				downloading.push_back(i.get());
+		}
+
+		for (auto w : m_stragglers.update(downloading))
+			w->reconnect();
+	}
+
+	// takes the back half of the largest range still in flight
+	bool stealTask(AppTaskList::Task* task)
+	{
+		Guard::Mutex lock(&m_workersMutex);
+
+		// a retired worker may have handed its range back meanwhile
+		if (m_taskList.pop(task))
+			return true;
+
+		AppWorker* victim = nullptr;
+		int64_t maxRemaining = 0;
+
+		for (auto& i : m_workers) {
+			int64_t remaining = i->remaining();
+			if (remaining > maxRemaining) {
+				maxRemaining = remaining;
+				victim = i.get();
+			}
+		}
+
+		if (!victim)
+			return false;
+
+		return victim->split(AppTaskList::kMinSplitSize, task);
+	}
+
+	// The end game: once the ranges left in flight are too small to
+	// split and add up to little, an idle worker sends a duplicate
+	// request for the one that would take longest to finish. A stalled
+	// connection then no longer holds up the end of the download.
+	bool raceTask(AppTaskList::Task* task, AppTaskList::RacePtr* race)
+	{
+		if (m_taskParam.endGameSize <= 0)
+			return false;
+
+		Guard::Mutex lock(&m_workersMutex);
+		if (m_userAborted)
+			return false;
+
+		int64_t left = 0;
+		AppWorker* slowest = nullptr;
+		double longest = 0;
+
+		for (auto& i : m_workers) {
+			int64_t remaining = i->active() ? i->remaining() : 0;
+			if (remaining <= 0)
+				continue;
+
+			left += remaining;
+			double timeLeft = i->timeLeft();
+			if (!slowest || timeLeft > longest) {
+				slowest = i.get();
+				longest = timeLeft;
+			}
+		}
+
+		if (!slowest || left > m_taskParam.endGameSize)
+			return false;
+
+		*race = slowest->race(task);
+		return *race != nullptr;
+	}
+
+	void abortAllWorkers()
+	{
+		m_writer.abort();
+		Guard::Mutex lock(&m_workersMutex);
+		for (auto& i : m_workers)
+			i->abort();
+	}
+
+	bool askRetry(Result r, bool mirrorDropped)
+	{
+		Guard::Mutex lock(&m_mutex);
+
+		if (m_userAborted)
+			return false;
+
+		// the other mirrors take over
+		if (mirrorDropped)
+			return true;
+
+		if (http_api::cannotConnect(r))
+			m_tuner.onRefused();
+
+		if (http_api::transientError(r))
+			return true;
+
+		// too many connections, back off instead of failing
+		if (autoConnNum() && r.space() == "http"
+			&& inArray(r.code(), {429, 503})) {
+			m_tuner.onRefused();
+			return true;
+		}
+
+		if (m_result.ok())
+			m_result = r;
+
+		abortAllWorkers();
+		return false;
+	}
+
+	// the blocks written by an earlier run are read back
+	Result checkTreeHash()
+	{
+		std::string hex;
+		_call(m_treeHash.finish(m_taskParam.filePath, &hex));
+		_must_or_return(RequireError::digestMismatch,
+			iEquals(hex, m_taskParam.treeHash), hex, m_taskParam.treeHash);
+
+		return {};
+	}
+
+	double totalSize()
+	{
+		return (double)m_taskParam.totalSize;
+	}
+
+	// ticks until start() clears m_uiAlive
+	void updateUi()
+	{
+		const double kCheckInteval = 0.2;
+		const double kUiInteval = 0.8;
+
+		const int max = (int)round(kUiInteval / kCheckInteval);
+		int n = 0;
+		auto lastExport = AppWorker::Clock::now();
+		auto lastJournal = lastExport;
+		for (;;) {
+			{
+				std::unique_lock<std::mutex> lock(m_uiMutex);
+				m_uiCondition.wait_for(lock,
+					std::chrono::duration<double>(kCheckInteval),
+					[this]() { return !m_uiAlive; });
+
+				if (!m_uiAlive)
+					return;
+			}
+
+			sampleSpeeds();
+
+			auto now = AppWorker::Clock::now();
+			if (now - lastExport >= std::chrono::duration<double>(
+				m_taskParam.metricsInterval)) {
+				lastExport = now;
+				exportMetrics();
+			}
+
+			++n;
+			n %= max;
+
+			if (n == (max - 1)) {
+				m_heartbeat();
+				if (now - lastJournal >= std::chrono::duration<double>(
+					kJournalInterval)) {
+					lastJournal = now;
+					saveJournal();
+				}
+
+				tuneConnections();
+				resetStragglers();
+			}
+		}
+	}
+
+	void exportMetrics()
+	{
+		if (m_taskParam.metricsPath.size()) {
+			Result r = metrics().save(m_taskParam.metricsPath);
+			_should(r.ok(), r.space(), r.code());
+		}
+	}
+
+	// ranges are collected before syncing, so everything recorded
+	// as done is on the disk when the journal is replaced
+	void saveJournal()
+	{
+		DownloadJournal::Spans done = m_taskParam.doneRanges;
+		for (auto& w : m_workers) {
+			for (auto& pr : w->preRanges())
+				done.push_back(pr);
+
+			done.push_back(w->curRange());
+		}
+
+		Result r = m_writer.sync();
+		if (r.ok())
+			r = m_journal.save(done);
+
+		_should(r.ok(), r.space(), r.code());
+	}
+
+	int64_t sizeDone()
+	{
+		int64_t done = m_resumedSize;
+		for (auto& i : m_workers)
+			done += i->sizeDone();
+
+		return done;
+	}
+
+	// of the whole and of each worker, for the decisions as much
+	// as for the status
+	void sampleSpeeds()
+	{
+		Guard::Mutex lock(&m_workersMutex);
+		m_speed.update(sizeDone());
+		for (auto& i : m_workers)
+			i->sampleSpeed();
+	}
+
+	Result m_result;
+	bool m_userAborted = false;
+	std::atomic_bool m_started = false; // m_taskParam is set
+	std::mutex m_mutex;
+
+	AppTaskParam m_taskParam;
+	AppTaskList m_taskList;
+	AppMirrorSet m_mirrors;
+	Guard::PtrSet<AppWorker> m_workers;
+	std::mutex m_workersMutex;
+	bool m_workersClosed = false;
+
+	bool m_uiAlive = false; // guarded by m_uiMutex
+	std::mutex m_uiMutex;
+	std::condition_variable m_uiCondition;
+	AppConnTuner m_tuner;
+	AppStragglerDetector m_stragglers;
+	std::atomic_int m_connLimit = 0;
+	int m_appliedTarget = 0;
+
+	size_t m_speedDataMaxLen = 0;
+	SpeedMeter m_speed;
+	AppWorker::Clock::time_point m_startTime;
+
+	ParallelFileWriter m_writer;
+	TreeHash m_treeHash;
+	BufferPool m_bufferPool;
+	DownloadJournal m_journal;
+	int64_t m_resumedSize = 0;
+	HeartbeatFn m_heartbeat;
+
+#ifndef _WIN32
+	// stopped before the workers go, which its loops call into
+	Reactor m_reactor;
+#endif
+};
+
+// the server must answer a "Range: bytes=0-" probe with 206, the
+// validator takes the total size and what identifies the content
+inline Result checkUrlSupportRange(
+	DownloadJournal::Validator* validator, ConStrRef url,
+	const HttpConfig& config, AbortSignal* abort)
+{
+	HttpConfig config_(config);
+	config_.addHeader("Range: bytes=0-");
+
+	HttpGetRequest http;
+	AbortSignal::Guard asg(abort, [&]() {
+		http.abort();
+	});
+
+	_call(http.init(config_));
+	_call(http.open(url));
+
+	_must_or_return(RequireError::httpSupportRange,
+		http.statusCode() == 206, url);
+
+	_must_or_return(InternalError::invalidInput,
+		http.headers().has("Content-Range"), url);
+
+	std::array<int64_t, 3> range;
+	_call(parseHttpRange(http.headers()
+		.firstValue("Content-Range"), &range));
+
+	validator->size = range[2];
+	validator->etag = http.headers().firstValue("ETag");
+	validator->lastModified = http.headers().firstValue("Last-Modified");
+	return {};
+}
+
+// mirrors that fail the probe or disagree on the size are left out
+inline std::vector<std::string> checkMirrors(
+	const DownloadJournal::Validator& validator,
+	const std::vector<std::string>& mirrors,
+	const HttpConfig& config, AbortSignal* abort)
+{
+	std::vector<std::string> usable;
+	for (auto& url : mirrors) {
+		if (abort->didAborted())
+			break;
+
+		DownloadJournal::Validator v;
+		Result r = checkUrlSupportRange(&v, url, config, abort);
+		if (_should(r.ok() && v.size == validator.size, url, r.code(), v.size))
+			usable.push_back(url);
+	}
+
+	return usable;
+}
+
+// about `parts` tasks of the same size, at least 1KB each
+inline int64_t taskGranularity(int64_t totalSize, int64_t parts)
+{
+	int64_t g = totalSize / parts;
+
+	g += 1; // for round
+	if (g < KB(1))
+		g = std::min<int64_t>(KB(1), totalSize);
+
+	if (g > totalSize)
+		g = totalSize;
+
+	return g;
+}
+
+// an existing file is reused when its journal matches the task
+inline bool resumeFromJournal(ConStrRef path, AppTaskParam* param)
+{
+	DownloadJournal journal;
+	if (journal.load(path).failed())
+		return false;
+
+	if (!journal.resumable(param->url, param->validator))
+		return false;
+
+	param->doneRanges = journal.done();
+	return true;
+}
+
+END_NAMESPACE_MCD
@@ -0,0 +1,233 @@
+#pragma once
+#include "../infra/file.h"
+
+BEGIN_NAMESPACE_MCD
+
+// Remembers which bytes of a partial download are already on the disk,
+// so that a later run of the same url can fetch only the missing parts.
+//
+// The journal sits next to the target file ("<file>.mcd") as plain text:
+//
+//     mcd-journal 1
+//     url https://example.com/a.iso
+//     size 4294967296
+//     etag "5e8f-1a2b"
+//     last-modified Tue, 03 Mar 2020 08:00:00 GMT
+//     done 0-1048576
+//     done 2097152-3145728
+//
+// It is rewritten through a temporary file and a rename, so a crash in
+// the middle of saving leaves the previous version intact. Both the
+// data it lists and the new version are synced to the disk first, a
+// power loss cannot leave it listing bytes the file never got.
+class DownloadJournal
+{
+public:
+	typedef Range<int64_t> Span; // [a, b)
+	typedef std::vector<Span> Spans;
+
+	struct Validator : public IMetaViewer
+	{
+		bool matches(const Validator& other) const
+		{
+			if (size != other.size)
+				return false;
+
+			if (etag.size() || other.etag.size())
+				return etag == other.etag;
+
+			return lastModified == other.lastModified;
+		}
+
+		MetaViewerFunc
+		{
+			return VarDumper()
+				<< size
+				<< etag
+				<< lastModified
+			;
+		}
+
+		int64_t size = 0;
+		std::string etag;
+		std::string lastModified;
+	};
+
+	static std::string pathFor(ConStrRef filePath)
+	{
+		return filePath + ".mcd";
+	}
+
+	void init(ConStrRef filePath, ConStrRef url, const Validator& v)
+	{
+		m_path = pathFor(filePath);
+		m_url = url;
+		m_validator = v;
+		m_done.clear();
+	}
+
+	Result load(ConStrRef filePath)
+	{
+		m_path = pathFor(filePath);
+		m_done.clear();
+
+		std::ifstream file(nativePath(m_path));
+		_must_or_return(InternalError::ioError, file.good(), m_path);
+
+		std::string line;
+		std::getline(file, line);
+		_must_or_return(InternalError::invalidInput,
+			line == magic(), m_path);
+
+		StringParser::KeyValue parser(" ");
+		while (std::getline(file, line)) {
+			if (line.empty())
+				continue;
+
+			parser.parse(line);
+			_call(parseLine(parser.key(), parser.value()));
+		}
+
+		mergeSpans(&m_done);
+		return {};
+	}
+
+	// the caller syncs the data of `done` before, see
+	// ParallelFileWriter::sync()
+	Result save(const Spans& done)
+	{
+		m_done = done;
+		mergeSpans(&m_done);
+
+		std::string tmpPath = m_path + ".tmp";
+		std::ofstream file(nativePath(tmpPath), std::ios::trunc);
+		_must_or_return(InternalError::ioError, file.good(), tmpPath);
+
+		file << magic() << "\n";
+		file << "url " << m_url << "\n";
+		file << "size " << m_validator.size << "\n";
+		if (m_validator.etag.size())
+			file << "etag " << m_validator.etag << "\n";
+		if (m_validator.lastModified.size())
+			file << "last-modified " << m_validator.lastModified << "\n";
+
+		for (auto& i : m_done)
+			file << "done " << i.first << "-" << i.second << "\n";
+
+		file.close();
+		_must_or_return(InternalError::ioError, file.good(), tmpPath);
+		_call(syncFile(tmpPath));
+		_call(replaceFile(tmpPath, m_path));
+
+#ifndef _WIN32
+		// MoveFileEx writes through, rename() leaves it to the directory
+		_call(syncFile(parentDirectory(m_path)));
+#endif
+		return {};
+	}
+
+	void remove()
+	{
+		if (m_path.size())
+			removeFile(m_path);
+	}
+
+	bool resumable(ConStrRef url, const Validator& v) const
+	{
+		return m_url == url && m_validator.matches(v);
+	}
+
+	const Spans& done() const
+	{
+		return m_done;
+	}
+
+	static void mergeSpans(Spans* spans)
+	{
+		Spans& s = *spans;
+		std::sort(s.begin(), s.end());
+
+		Spans merged;
+		for (auto& i : s) {
+			if (i.second <= i.first)
+				continue;
+
+			if (merged.size() && i.first <= merged.back().second) {
+				auto& last = merged.back();
+				last.second = std::max(last.second, i.second);
+				continue;
+			}
+
+			merged.push_back(i);
+		}
+
+		s.swap(merged);
+	}
+
+	// the parts of [0, total) not covered by `done` (merged)
+	static Spans missingSpans(const Spans& done, int64_t total)
+	{
+		Spans missing;
+		int64_t pos = 0;
+		for (auto& i : done) {
+			if (i.first > pos)
+				missing.emplace_back(pos, std::min(i.first, total));
+
+			pos = std::max(pos, i.second);
+			if (pos >= total)
+				break;
+		}
+
+		if (pos < total)
+			missing.emplace_back(pos, total);
+
+		return missing;
+	}
+
+private:
+	Result parseLine(ConStrRef key, ConStrRef value)
+	{
+		auto invalidInput = InternalError::invalidInput;
+
+		if (key == "url") {
+			m_url = value;
+		}
+		else if (key == "size") {
+			_must_or_return(invalidInput,
+				toNumber(value, &m_validator.size), value);
+		}
+		else if (key == "etag") {
+			m_validator.etag = value;
+		}
+		else if (key == "last-modified") {
+			m_validator.lastModified = value;
+		}
+		else if (key == "done") {
+			auto r = split(value, "-");
+			Span span;
+			_must_or_return(invalidInput, r.size() == 2, value);
+			_must_or_return(invalidInput,
+				toNumber(r[0], &span.first), value);
+			_must_or_return(invalidInput,
+				toNumber(r[1], &span.second), value);
+			_must_or_return(invalidInput,
+				span.first >= 0 && span.first <= span.second
+				&& span.second <= m_validator.size, value);
+			m_done.push_back(span);
+		}
+
+		return {};
+	}
+
+	static const char* magic()
+	{
+		return "mcd-journal 1";
+	}
+
+	std::string m_path;
+	std::string m_url;
+	Validator m_validator;
+	Spans m_done;
+};
+
+END_NAMESPACE_MCD
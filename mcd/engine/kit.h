@@ -0,0 +1,362 @@
+#pragma once
+#include "../network/http.h"
+
+BEGIN_NAMESPACE_MCD
+
+#ifdef _WIN32
+inline std::string errorString(DWORD code, PCWSTR module = L"")
+{
+	if (code == 0)
+		return {};
+
+	const bool fromSystem = (module[0] == '\0');
+	DWORD flag = fromSystem
+		? FORMAT_MESSAGE_FROM_SYSTEM : FORMAT_MESSAGE_FROM_HMODULE;
+
+	LPCVOID source = fromSystem ? NULL : GetModuleHandle(module);
+	if (!fromSystem && !source) {
+		assert(0);
+		return {};
+	}
+
+	flag |= FORMAT_MESSAGE_ALLOCATE_BUFFER;
+	flag |= FORMAT_MESSAGE_IGNORE_INSERTS;
+
+	PWSTR message = NULL;
+	DWORD size = FormatMessage(flag, source,
+		code, NULL, (PWSTR)&message, 0, NULL);
+
+	if (size == 0)
+		return {};
+
+	std::string result = u16to8(message);
+	LocalFree(message);
+
+	trimRight(&result);
+	if (result.size() && *result.rbegin() == '.')
+		result.pop_back();
+
+	return result;
+}
+
+inline std::string resultString(Result r)
+{
+	std::stringstream ss;
+	ss << r.space() << "." << r.code();
+
+	if (r.space() == http_api::resultSpace()) {
+		PCWSTR module = (inRange(r.code(), 12000, 13000)
+			? L"winhttp.dll" : L"");
+
+		std::string msg = errorString(r.code(), module);
+		if (msg.size())
+			ss << " (" << msg << ")";
+	}
+	else if (r.is(RequireError::diskSpace)) {
+		ss << " (" << errorString(ERROR_DISK_FULL) << ")";
+	}
+	else if (r.is(RequireError::digestMismatch)) {
+		ss << " (content does not match its digest)";
+	}
+	else if (r.is(RequireError::targetExists)) {
+		ss << " (file exists and has no journal to resume from)";
+	}
+
+	return ss.str();
+}
+
+inline bool fileExists(ConStrRef path) {
+	struct _stat s;
+	return (_wstat(u8to16(path), &s) == 0);
+}
+#else
+inline std::string resultString(Result r)
+{
+	std::stringstream ss;
+	ss << r.space() << "." << r.code();
+
+	std::string msg = http_api::errorString(r);
+	if (r.is(RequireError::diskSpace))
+		msg = strerror(ENOSPC);
+	else if (r.is(RequireError::digestMismatch))
+		msg = "content does not match its digest";
+	else if (r.is(RequireError::targetExists))
+		msg = "file exists and has no journal to resume from";
+
+	if (msg.size())
+		ss << " (" << msg << ")";
+
+	return ss.str();
+}
+
+inline bool fileExists(ConStrRef path) {
+	struct stat s;
+	return (stat(path.c_str(), &s) == 0);
+}
+#endif
+
+class AbortSignal
+{
+public:
+	typedef std::function<void()> AbortFn;
+
+	class Guard
+	{
+	public:
+		Guard(AbortSignal* signal, AbortFn fn) :
+			m_signal(signal)
+		{
+			*m_signal = fn;
+		}
+
+		~Guard()
+		{
+			*m_signal = AbortFn();
+		}
+
+	private:
+		AbortSignal* m_signal;
+	};
+
+	void trigger()
+	{
+		mcd::Guard::Mutex g(&m_mutex);
+		m_didAborted = true;
+		if (m_abortFn)
+			m_abortFn();
+	}
+
+	bool didAborted() const { return m_didAborted; }
+
+	void clear()
+	{
+		mcd::Guard::Mutex g(&m_mutex);
+		m_didAborted = false;
+		m_abortFn = {};
+	}
+
+private:
+	void operator= (AbortFn fn)
+	{
+		mcd::Guard::Mutex g(&m_mutex);
+		m_abortFn = fn;
+		if (fn && m_didAborted)
+			fn();
+	}
+
+	AbortFn m_abortFn;
+	std::atomic_bool m_didAborted = false;
+	std::mutex m_mutex;
+};
+
+inline void _formatDataSizeImpl(int64_t num, double* v, int* m, int* p)
+{
+	constexpr int kilo = 1024;
+	double& value = *v;
+	int& magnitude = *m;
+	int& precision = *p;
+
+	while (num >= (kilo * kilo)) {
+		num /= kilo;
+		++magnitude;
+	}
+
+	if (num >= kilo || !magnitude) {
+		value = (double)num / kilo;
+	}
+	else {
+		value = (double)num;
+		--magnitude;
+	}
+
+	if (value > 1000) { // 1001MB -> 1GB
+		value = 1.0;
+		precision = 0;
+		++magnitude;
+	}
+}
+
+inline void _formatDataSizeStream(int64_t num, std::stringstream* ss)
+{
+	if (num < 1000) {
+		*ss << num << "bytes";
+		return;
+	}
+
+	double value = 0;
+	int magnitude = 0;
+	int precision = 2;
+	_formatDataSizeImpl(num, &value,
+		&magnitude, &precision);
+
+	char units[] = "KMGTPEZ";
+	const int kMaxMagnitude = ARRAYSIZE(units) - 1;
+	if (magnitude > kMaxMagnitude)
+		return;
+
+	ss->precision(precision);
+	*ss << std::fixed << value;
+	*ss << units[magnitude] << "iB";
+}
+
+inline std::string formattedDataSize(int64_t num, bool toRound)
+{
+	std::stringstream ss;
+	_formatDataSizeStream(num, &ss);
+	std::string str = ss.str();
+
+	if (toRound)
+		str.resize(str.find_last_not_of("0.") + 1);
+
+	return str;
+}
+
+// "1h05m", "3m20s" or "42s"
+inline std::string formattedDuration(double seconds)
+{
+	int64_t total = (int64_t)ceil(std::max(seconds, 0.0));
+	int64_t hours = total / 3600;
+	int64_t minutes = total / 60 % 60;
+	int64_t secs = total % 60;
+
+	char buffer[32] = {};
+	if (hours > 0)
+		snprintf(buffer, sizeof(buffer), "%lldh%02lldm",
+			(long long)hours, (long long)minutes);
+	else if (minutes > 0)
+		snprintf(buffer, sizeof(buffer), "%lldm%02llds",
+			(long long)minutes, (long long)secs);
+	else
+		snprintf(buffer, sizeof(buffer), "%llds", (long long)secs);
+
+	return buffer;
+}
+
+inline std::string safeFileNameFromUri(ConStrRef uri)
+{
+	std::string name = baseName(uri);
+
+	[](std::string* s) {
+		auto pos = s->find('?');
+		if (pos != std::string::npos)
+			s->resize(pos);
+	}(&name);
+
+	std::replace_if(name.begin(), name.end(), [](char c) {
+		return inArray(c,
+			{ '<', '>', ':', '"', '/', '\\', '|', '?', '*' });
+	}, '_');
+
+	return name;
+}
+
+// Bytes per second, smoothed. Each sample moves the estimate toward the
+// speed since the one before by 1 - e^(-dt/tau), so the result is the
+// same however often it is sampled, and a burst fades out over a few
+// time constants instead of dropping off a fixed window all at once.
+class SpeedMeter
+{
+public:
+	typedef std::chrono::steady_clock Clock;
+
+	static constexpr double kTimeConstant = 3.0; // seconds
+
+	// a running total, e.g. of the bytes done
+	void update(int64_t total, Clock::time_point now = Clock::now())
+	{
+		Guard::Mutex lock(&m_mutex);
+		if (m_samples > 0) {
+			double seconds = std::chrono::duration<double>(now - m_time).count();
+			if (seconds <= 0)
+				return;
+
+			double speed = (total - m_total) / seconds;
+			double weight = 1 - exp(-seconds / kTimeConstant);
+			m_speed = (m_samples == 1) ? speed : m_speed + weight * (speed - m_speed);
+		}
+
+		m_total = total;
+		m_time = now;
+		++m_samples;
+	}
+
+	// starts over, e.g. on a new connection
+	void reset()
+	{
+		Guard::Mutex lock(&m_mutex);
+		m_samples = 0;
+		m_speed = 0;
+	}
+
+	// false until two samples have been taken
+	bool measured() const
+	{
+		Guard::Mutex lock(&m_mutex);
+		return m_samples > 1;
+	}
+
+	double speed() const
+	{
+		Guard::Mutex lock(&m_mutex);
+		return std::max(m_speed, 0.0);
+	}
+
+	// seconds to go through `remaining` bytes, HUGE_VAL when nothing
+	// is moving or nothing is known yet
+	double eta(int64_t remaining) const
+	{
+		double speed = this->speed();
+		return speed > 0 ? remaining / speed : HUGE_VAL;
+	}
+
+private:
+	int64_t m_total = 0;
+	Clock::time_point m_time;
+	double m_speed = 0;
+	int m_samples = 0;
+	mutable std::mutex m_mutex;
+};
+
+class TimePassed
+{
+public:
+	TimePassed()
+	{
+		m_start = time(nullptr);
+	}
+
+	time_t get() const
+	{
+		return time(nullptr) - m_start;
+	}
+
+private:
+	time_t m_start;
+};
+
+// "bytes a-b/total", all of them 64-bit
+inline Result parseHttpRange(std::string_view str,
+	std::array<int64_t, 3>* result)
+{
+	size_t pos = str.find_first_of("0123456789");
+	_must_or_return(InternalError::invalidInput, pos != str.npos, str);
+
+	const char* p = str.data() + pos;
+	const char* end = str.data() + str.size();
+	const char separators[] = { '-', '/' };
+
+	auto& r = *result;
+	for (int i : range(3)) {
+		auto parsed = std::from_chars(p, end, r[i]);
+		bool valid = parsed.ec == std::errc() && (i == 2
+			|| (parsed.ptr < end && *parsed.ptr == separators[i]));
+		_must_or_return(InternalError::invalidInput, valid, str);
+		p = parsed.ptr + 1;
+	}
+
+	_must_or_return(InternalError::invalidInput,
+		0 <= r[0] && r[0] <= r[1] && r[1] < r[2], str);
+	return {};
+}
+
+END_NAMESPACE_MCD
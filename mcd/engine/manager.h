@@ -0,0 +1,419 @@
+#pragma once
+#include "download.h"
+
+BEGIN_NAMESPACE_MCD
+
+struct DownloadJob
+{
+	std::string url;
+	std::vector<std::string> mirrors; // more urls of the same file
+	std::string filePath;
+	bool overwrite = false; // an existing file with no journal to resume
+	HttpConfig config;
+	int connNum = 0; // 0 tunes itself
+	int maxConnNum = 100; // the limit of auto mode
+	int parts = 3; // tasks per connection
+	int64_t rateLimit = 0; // bytes per second, 0 for no limit
+	std::string treeHash; // see TreeHash, checked when set
+	double stragglerWindow = 8.0; // see AppStragglerDetector, 0 for never
+	std::string metricsPath; // see AppMetrics::save()
+	double metricsInterval = 1.0; // seconds
+	AppTaskParam::Engine engine = AppTaskParam::Engine::Threads;
+};
+
+// Runs a queue of downloads, a few at a time. The connections of the
+// running ones come out of a single budget: each gets an even share
+// capped by what it can use, and the shares are worked out again
+// whenever a download starts or finishes. The bandwidth is capped the
+// same way, for each download and for all of them together. Only
+// mcd_cli uses it, the window runs one AppDownloadContractor at a time.
+class DownloadManager
+{
+public:
+	typedef size_t JobId;
+	typedef std::function<void()> HeartbeatFn;
+	typedef std::function<void(JobId, Result)> FinishFn;
+
+	static const int kAutoConnGuess = 16; // for the granularity only
+	static constexpr double kHeartbeatInterval = 0.8;
+
+	struct JobStatus
+	{
+		std::string filePath;
+		std::string text; // from the contractor, empty until it runs
+		int connLimit = 0;
+		bool resumed = false; // from its journal
+		bool active = false;
+		bool finished = false;
+	};
+
+	DownloadManager() {}
+	DownloadManager(const DownloadManager&) = delete;
+	DownloadManager& operator =(const DownloadManager&) = delete;
+
+	void setMaxActive(int maxActive)
+	{
+		m_maxActive = std::max(1, maxActive);
+	}
+
+	void setConnBudget(int budget)
+	{
+		Guard::Mutex lock(&m_mutex);
+		m_connBudget = std::max(1, budget);
+	}
+
+	// bytes per second of all downloads, 0 lifts it; may be
+	// called while running
+	void setRateLimit(int64_t rate)
+	{
+		m_rateLimiter.setRate(rate);
+	}
+
+	void setJobRateLimit(JobId id, int64_t rate)
+	{
+		Guard::Mutex lock(&m_mutex);
+		if (_should(id < m_jobs.size(), id))
+			m_jobs[id]->rateLimiter.setRate(rate);
+	}
+
+	void onHeartbeat(HeartbeatFn fn)
+	{
+		m_heartbeat = fn;
+	}
+
+	// called on the thread of run() as each download ends
+	void onFinish(FinishFn fn)
+	{
+		m_finish = fn;
+	}
+
+	// may be called while running
+	JobId add(const DownloadJob& spec)
+	{
+		Guard::Mutex lock(&m_mutex);
+		m_jobs.emplace_back(new Job());
+		m_jobs.back()->spec = spec;
+		m_jobs.back()->rateLimiter.setParent(&m_rateLimiter);
+		m_jobs.back()->rateLimiter.setRate(spec.rateLimit);
+		m_queue.push(m_jobs.size() - 1);
+		m_condition.notify_all();
+		return m_jobs.size() - 1;
+	}
+
+	// returns once every download has ended, with the first failure
+	Result run()
+	{
+		for (;;) {
+			reapFinished();
+			{
+				Guard::Mutex lock(&m_mutex);
+				startQueued();
+				if (m_activeJobs == 0 && (m_queue.empty() || m_aborted))
+					break;
+
+				rebalance();
+			}
+
+			if (m_heartbeat)
+				m_heartbeat();
+
+			std::unique_lock<std::mutex> lock(m_mutex);
+			m_condition.wait_for(lock, std::chrono::milliseconds(
+				(int)(kHeartbeatInterval * 1000)));
+		}
+
+		if (m_aborted)
+			return InternalError::userAbort();
+
+		for (auto& i : m_jobs) {
+			if (i->result.failed())
+				return i->result;
+		}
+
+		return {};
+	}
+
+	// may be called from any thread, queued downloads do not start
+	void abort()
+	{
+		Guard::Mutex lock(&m_mutex);
+		m_aborted = true;
+		for (auto& i : m_jobs) {
+			if (i->state == State::Active)
+				i->abort.trigger();
+		}
+
+		m_condition.notify_all();
+	}
+
+	std::vector<JobStatus> status()
+	{
+		Guard::Mutex lock(&m_mutex);
+		std::vector<JobStatus> result;
+		for (auto& i : m_jobs) {
+			JobStatus s;
+			s.filePath = i->spec.filePath;
+			s.text = i->statusText;
+			s.connLimit = i->share;
+			s.resumed = i->resumed;
+			s.active = (i->state == State::Active);
+			s.finished = (i->state >= State::Finished);
+			result.push_back(s);
+		}
+
+		return result;
+	}
+
+	// even shares, a job never gets more than it asks for and what
+	// it leaves goes to the others; each job has one at least, which
+	// is within the budget as startQueued() keeps to it
+	static std::vector<int> shareBudget(
+		int budget, const std::vector<int>& demands)
+	{
+		std::vector<int> shares(demands.size(), 0);
+		int left = budget;
+
+		for (;;) {
+			int open = 0;
+			for (size_t i = 0; i < demands.size(); ++i)
+				open += (shares[i] < demands[i]);
+
+			if (open == 0 || left <= 0)
+				break;
+
+			int each = std::max(1, left / open);
+			for (size_t i = 0; i < demands.size() && left > 0; ++i) {
+				int give = std::min(each, demands[i] - shares[i]);
+				give = std::min(give, left);
+				if (give > 0) {
+					shares[i] += give;
+					left -= give;
+				}
+			}
+		}
+
+		for (auto& i : shares)
+			i = std::max(1, i);
+
+		return shares;
+	}
+
+private:
+	enum class State {
+		Queued,
+		Active,
+		Finished, // joined by reapFinished()
+		Reaped
+	};
+
+	struct Job
+	{
+		DownloadJob spec;
+		State state = State::Queued;
+		Result result;
+		std::thread thread;
+		AbortSignal abort;
+		RateLimiter rateLimiter; // under the one of the manager
+
+		// guarded by m_mutex of the manager
+		AppDownloadContractor* contractor = nullptr;
+		int64_t tasksLeft = 1; // the probe takes one connection
+		int share = 0;
+		bool resumed = false;
+		std::string statusText;
+	};
+
+	// no more jobs than connections in the budget, each needs one
+	// requires m_mutex
+	void startQueued()
+	{
+		int maxActive = std::min(m_maxActive, m_connBudget);
+		while (!m_aborted && m_queue.size() && m_activeJobs < maxActive) {
+			Job* job = m_jobs[m_queue.front()].get();
+			m_queue.pop();
+
+			job->state = State::Active;
+			++m_activeJobs;
+			job->thread = std::thread(
+				std::bind(&DownloadManager::runJob, this, job));
+		}
+	}
+
+	// the jobs are taken out under the lock, add() may grow m_jobs
+	// meanwhile
+	void reapFinished()
+	{
+		std::vector<std::pair<JobId, Job*>> finished;
+		{
+			Guard::Mutex lock(&m_mutex);
+			for (JobId i = 0; i < m_jobs.size(); ++i) {
+				if (m_jobs[i]->state == State::Finished) {
+					m_jobs[i]->state = State::Reaped;
+					finished.emplace_back(i, m_jobs[i].get());
+				}
+			}
+		}
+
+		for (auto& i : finished) {
+			Job* job = i.second;
+			job->thread.join();
+			if (m_finish)
+				m_finish(i.first, job->result);
+		}
+	}
+
+	// requires m_mutex
+	void rebalance()
+	{
+		std::vector<Job*> active;
+		std::vector<int> demands;
+		for (auto& i : m_jobs) {
+			if (i->state != State::Active)
+				continue;
+
+			// a job near its end hands its connections back
+			if (i->contractor) {
+				int64_t left = i->contractor->tasksLeft();
+				if (left >= 0)
+					i->tasksLeft = left;
+			}
+
+			active.push_back(i.get());
+			demands.push_back(demand(*i));
+		}
+
+		auto shares = shareBudget(m_connBudget, demands);
+		for (size_t i = 0; i < active.size(); ++i) {
+			active[i]->share = shares[i];
+			if (active[i]->contractor)
+				active[i]->contractor->setConnLimit(shares[i]);
+		}
+	}
+
+	// requires m_mutex
+	static int demand(const Job& job)
+	{
+		int64_t wanted = job.spec.connNum > 0
+			? job.spec.connNum : job.spec.maxConnNum;
+
+		return (int)std::max<int64_t>(1, std::min(wanted, job.tasksLeft));
+	}
+
+	void runJob(Job* job)
+	{
+		Result r = download(job);
+
+		Guard::Mutex lock(&m_mutex);
+		job->result = r;
+		job->state = State::Finished;
+		--m_activeJobs;
+		m_condition.notify_all();
+	}
+
+	Result download(Job* job)
+	{
+		const DownloadJob& spec = job->spec;
+		_must_not(spec.config.hasHeader("Range"), spec.url);
+
+		DownloadJournal::Validator validator;
+		_call(checkUrlSupportRange(&validator,
+			spec.url, spec.config, &job->abort));
+
+		AppTaskParam param;
+		makeTaskParam(spec, validator, &param);
+		param.mirrors = checkMirrors(validator,
+			spec.mirrors, spec.config, &job->abort);
+		param.rateLimiter = &job->rateLimiter;
+		bool exists = fileExists(spec.filePath);
+		bool resumed = exists && resumeFromJournal(spec.filePath, &param);
+
+		// left alone, the preallocation would truncate it
+		_must_or_return(RequireError::targetExists,
+			!exists || resumed || spec.overwrite, spec.filePath);
+
+		AppDownloadContractor contractor;
+		AbortSignal::Guard g(&job->abort, [&]() {
+			contractor.abort();
+		});
+
+		if (job->abort.didAborted())
+			return InternalError::userAbort();
+
+		contractor.onHeartbeat([&]() {
+			std::string text = contractor.statusText();
+			Guard::Mutex lock(&m_mutex);
+			job->statusText = text;
+		});
+
+		{
+			Guard::Mutex lock(&m_mutex);
+			job->contractor = &contractor;
+			job->tasksLeft = tasksLeft(param);
+			job->resumed = resumed;
+			rebalance();
+		}
+
+		Result r = contractor.start(param);
+		{
+			Guard::Mutex lock(&m_mutex);
+			job->contractor = nullptr;
+		}
+
+		// keep the partial file if its journal allows resuming
+		std::string journal = DownloadJournal::pathFor(spec.filePath);
+		if (r.failed() && !fileExists(journal))
+			remove(spec.filePath.c_str());
+
+		return r;
+	}
+
+	static void makeTaskParam(const DownloadJob& spec,
+		const DownloadJournal::Validator& validator, AppTaskParam* param)
+	{
+		int64_t totalSize = validator.size;
+		bool autoConn = (spec.connNum == 0);
+		int connNum = autoConn ? kAutoConnGuess : spec.connNum;
+		if (totalSize < KB(1))
+			connNum = 1;
+
+		param->url = spec.url;
+		param->filePath = spec.filePath;
+		param->config = spec.config;
+		param->validator = validator;
+		param->totalSize = totalSize;
+		param->granularity = taskGranularity(totalSize, connNum * spec.parts);
+		param->connNum = autoConn ? AppConnTuner::kInitialConn : connNum;
+		param->maxConnNum = autoConn ? spec.maxConnNum : 0;
+		param->engine = spec.engine;
+		param->treeHash = spec.treeHash;
+		param->stragglerWindow = spec.stragglerWindow;
+		param->metricsPath = spec.metricsPath;
+		param->metricsInterval = spec.metricsInterval;
+	}
+
+	// no more connections than tasks are of any use
+	static int64_t tasksLeft(const AppTaskParam& param)
+	{
+		int64_t left = param.totalSize;
+		for (auto& i : param.doneRanges)
+			left -= i.second - i.first;
+
+		int64_t g = std::max<int64_t>(param.granularity, 1);
+		return (left + g - 1) / g;
+	}
+
+	Guard::PtrSet<Job> m_jobs;
+	std::queue<JobId> m_queue;
+	int m_activeJobs = 0;
+	int m_maxActive = 3;
+	int m_connBudget = 100;
+	std::atomic_bool m_aborted = false;
+	RateLimiter m_rateLimiter;
+
+	HeartbeatFn m_heartbeat;
+	FinishFn m_finish;
+	std::mutex m_mutex;
+	std::condition_variable m_condition;
+};
+
+END_NAMESPACE_MCD
@@ -0,0 +1,249 @@
+#pragma once
+#include "kit.h"
+
+BEGIN_NAMESPACE_MCD
+
+// What a worker records as it goes. The counters and histograms are
+// atomics, so the read loop never waits for the thread collecting them;
+// only the failures, which are off the read loop, are kept behind a lock.
+struct AppConnMetrics
+{
+	std::atomic_int64_t requests = 0;
+	std::atomic_int64_t connections = 0; // opened, the others were reused
+	std::atomic_int64_t rangeMismatches = 0; // Content-Range not as asked
+	LatencyHistogram connectTime;
+	LatencyHistogram tlsTime;
+	LatencyHistogram firstByte; // from the request to the response head
+
+	void addTimings(const ConnTimings& timings)
+	{
+		if (timings.connect >= 0) {
+			++connections;
+			connectTime.record(timings.connect);
+		}
+
+		if (timings.tls >= 0)
+			tlsTime.record(timings.tls);
+	}
+
+	// a failed request, retried or not
+	void addFailure(Result r)
+	{
+		std::stringstream ss;
+		ss << r.space() << "." << r.code();
+
+		Guard::Mutex lock(&m_mutex);
+		++m_failures[ss.str()];
+	}
+
+	// by "space.code"
+	std::map<std::string, int64_t> failures() const
+	{
+		Guard::Mutex lock(&m_mutex);
+		return m_failures;
+	}
+
+private:
+	std::map<std::string, int64_t> m_failures;
+	mutable std::mutex m_mutex;
+};
+
+// A download at one moment, the workers summed up. Written out as JSON,
+// or as Prometheus text for the node exporter's textfile collector.
+struct AppMetrics
+{
+	typedef LatencyHistogram::Counts Histogram;
+
+	struct Worker
+	{
+		int64_t bytesReceived = 0;
+		int64_t requests = 0;
+		int64_t connections = 0;
+		double speed = 0;
+		bool active = false;
+	};
+
+	double elapsed = 0; // seconds since the start
+	int64_t totalSize = 0;
+	int64_t bytesDone = 0; // written, resumed ones included
+	int64_t bytesReceived = 0; // duplicates of the end game included
+	int64_t requests = 0;
+	int64_t connections = 0;
+	int64_t rangeMismatches = 0;
+	double speed = 0;
+	int activeWorkers = 0;
+	std::map<std::string, int64_t> failures;
+	Histogram connectTime;
+	Histogram tlsTime;
+	Histogram firstByte;
+	Histogram writeLatency;
+	std::vector<Worker> workers;
+
+	void add(const AppConnMetrics& m, Worker worker)
+	{
+		requests += m.requests;
+		connections += m.connections;
+		rangeMismatches += m.rangeMismatches;
+		bytesReceived += worker.bytesReceived;
+
+		for (auto& i : m.failures())
+			failures[i.first] += i.second;
+
+		connectTime.add(m.connectTime.counts());
+		tlsTime.add(m.tlsTime.counts());
+		firstByte.add(m.firstByte.counts());
+
+		if (worker.active)
+			++activeWorkers;
+
+		workers.push_back(worker);
+	}
+
+	std::string toJson() const
+	{
+		std::stringstream ss;
+		ss << "{\n";
+		ss << "  \"elapsed\": " << elapsed << ",\n";
+		ss << "  \"totalSize\": " << totalSize << ",\n";
+		ss << "  \"bytesDone\": " << bytesDone << ",\n";
+		ss << "  \"bytesReceived\": " << bytesReceived << ",\n";
+		ss << "  \"speed\": " << (int64_t)speed << ",\n";
+		ss << "  \"requests\": " << requests << ",\n";
+		ss << "  \"connections\": " << connections << ",\n";
+		ss << "  \"rangeMismatches\": " << rangeMismatches << ",\n";
+		ss << "  \"activeWorkers\": " << activeWorkers << ",\n";
+
+		// the keys are "space.code", nothing to escape
+		ss << "  \"failures\": {";
+		const char* separator = "";
+		for (auto& i : failures) {
+			ss << separator << "\"" << i.first << "\": " << i.second;
+			separator = ", ";
+		}
+		ss << "},\n";
+
+		jsonHistogram(ss, "connectTime", connectTime);
+		jsonHistogram(ss, "tlsTime", tlsTime);
+		jsonHistogram(ss, "firstByte", firstByte);
+		jsonHistogram(ss, "writeLatency", writeLatency);
+
+		ss << "  \"workers\": [";
+		for (size_t i = 0; i < workers.size(); ++i) {
+			const Worker& w = workers[i];
+			ss << (i ? ",\n" : "\n") << "    {\"bytesReceived\": "
+				<< w.bytesReceived << ", \"requests\": " << w.requests
+				<< ", \"connections\": " << w.connections
+				<< ", \"speed\": " << (int64_t)w.speed
+				<< ", \"active\": " << (w.active ? "true" : "false") << "}";
+		}
+		ss << "\n  ]\n}\n";
+		return ss.str();
+	}
+
+	std::string toPrometheus() const
+	{
+		std::stringstream ss;
+		promValue(ss, "mcd_elapsed_seconds", "gauge", elapsed);
+		promValue(ss, "mcd_total_bytes", "gauge", totalSize);
+		promValue(ss, "mcd_done_bytes", "gauge", bytesDone);
+		promValue(ss, "mcd_received_bytes_total", "counter", bytesReceived);
+		promValue(ss, "mcd_speed_bytes_per_second", "gauge", speed);
+		promValue(ss, "mcd_requests_total", "counter", requests);
+		promValue(ss, "mcd_connections_total", "counter", connections);
+		promValue(ss, "mcd_range_mismatches_total", "counter", rangeMismatches);
+		promValue(ss, "mcd_active_workers", "gauge", activeWorkers);
+
+		ss << "# TYPE mcd_request_failures_total counter\n";
+		for (auto& i : failures) {
+			ss << "mcd_request_failures_total{error=\"" << i.first
+				<< "\"} " << i.second << "\n";
+		}
+
+		promHistogram(ss, "mcd_connect_seconds", connectTime);
+		promHistogram(ss, "mcd_tls_handshake_seconds", tlsTime);
+		promHistogram(ss, "mcd_first_byte_seconds", firstByte);
+		promHistogram(ss, "mcd_write_seconds", writeLatency);
+
+		ss << "# TYPE mcd_worker_received_bytes_total counter\n";
+		for (size_t i = 0; i < workers.size(); ++i) {
+			ss << "mcd_worker_received_bytes_total{worker=\"" << i
+				<< "\"} " << workers[i].bytesReceived << "\n";
+		}
+
+		return ss.str();
+	}
+
+	// JSON for a path ending in ".json", Prometheus text otherwise;
+	// replaced in one step, a reader never sees half a file
+	Result save(ConStrRef path) const
+	{
+		bool json = path.size() >= 5
+			&& iEquals(path.substr(path.size() - 5), ".json");
+
+		std::string tmpPath = path + ".tmp";
+		std::ofstream file(nativePath(tmpPath), std::ios::trunc);
+		_must_or_return(InternalError::ioError, file.good(), tmpPath);
+
+		file << (json ? toJson() : toPrometheus());
+		file.close();
+		_must_or_return(InternalError::ioError, file.good(), tmpPath);
+
+		return replaceFile(tmpPath, path);
+	}
+
+private:
+	// the buckets that hold anything, each with its upper bound
+	static void jsonHistogram(std::stringstream& ss,
+		const char* name, const Histogram& h)
+	{
+		ss << "  \"" << name << "\": {\"count\": " << h.count
+			<< ", \"sum\": " << h.sumMicros / 1e6 << ", \"buckets\": [";
+
+		const char* separator = "";
+		for (int i = 0; i < LatencyHistogram::kBuckets; ++i) {
+			if (h.buckets[i] == 0)
+				continue;
+
+			double le = LatencyHistogram::upperBound(i);
+			ss << separator << "[";
+			if (le == HUGE_VAL)
+				ss << "null";
+			else
+				ss << le;
+			ss << ", " << h.buckets[i] << "]";
+			separator = ", ";
+		}
+		ss << "]},\n";
+	}
+
+	template <class T>
+	static void promValue(std::stringstream& ss,
+		const char* name, const char* type, T value)
+	{
+		ss << "# TYPE " << name << " " << type << "\n";
+		ss << name << " " << value << "\n";
+	}
+
+	// cumulative, as Prometheus has them
+	static void promHistogram(std::stringstream& ss,
+		const char* name, const Histogram& h)
+	{
+		ss << "# TYPE " << name << " histogram\n";
+		int64_t cumulative = 0;
+		for (int i = 0; i < LatencyHistogram::kBuckets; ++i) {
+			cumulative += h.buckets[i];
+			double le = LatencyHistogram::upperBound(i);
+			ss << name << "_bucket{le=\"";
+			if (le == HUGE_VAL)
+				ss << "+Inf";
+			else
+				ss << le;
+			ss << "\"} " << cumulative << "\n";
+		}
+
+		ss << name << "_sum " << h.sumMicros / 1e6 << "\n";
+		ss << name << "_count " << h.count << "\n";
+	}
+};
+
+END_NAMESPACE_MCD
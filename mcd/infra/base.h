@@ -1,12 +1,19 @@
 #pragma once
 #define NOMINMAX
 
+#ifdef _WIN32
 // void error C2760 with release build
 struct IUnknown;
 #include <Windows.h>
 #include <shlwapi.h>
+#else
+#include "posix.h"
+#endif
 
+#include <cmath>
 #include <string>
+#include <string_view>
+#include <charconv>
 #include <sstream>
 #include <memory>
 #include <vector>
@@ -20,6 +27,8 @@ struct IUnknown;
 #include <atomic>
 #include <fstream>
 #include <queue>
+#include <deque>
+#include <condition_variable>
 
 #define KB(value) ((value) * 1024)
 #define MB(value) (KB(value) * 1024)
@@ -112,6 +121,19 @@ inline stringx u16to8(ConWStrRef u16)
 		: utf8_16_cvt().to_bytes(u16.c_str());
 }
 
+// paths are utf-8 everywhere but on the wide windows api
+#ifdef _WIN32
+inline wstringx nativePath(ConStrRef path)
+{
+	return u8to16(path);
+}
+#else
+inline stringx nativePath(ConStrRef path)
+{
+	return path;
+}
+#endif
+
 inline std::vector<std::string> split(
 	const std::string& str,
 	const std::string& delimiter,
@@ -200,7 +222,7 @@ inline bool equals(ConStrRef a, const char* b)
 	return b && a.compare(b) == 0;
 }
 
-inline bool iEquals(ConStrRef a, ConStrRef b)
+inline bool iEquals(std::string_view a, std::string_view b)
 {
 	return std::equal(a.begin(), a.end(), b.begin(), b.end(),
 		[](char x, char y) { return ::tolower(x) == ::tolower(y); });
@@ -290,130 +312,245 @@ inline std::string baseName(const std::string& path)
 
 namespace StringParser {
 
+// Splits "scheme://userinfo@host:port/path?query#fragment" into views
+// of the text given, which must outlive them; nothing is copied. The
+// scheme may be left out, the host is a name or a bracketed IPv6
+// literal, the path keeps the query and drops the fragment.
 class URI
 {
 public:
 	URI() {}
 
-	URI(ConStrRef uri)
+	URI(std::string_view uri)
 	{
 		parse(uri);
 	}
 
-	bool parse(ConStrRef uri)
+	bool parse(std::string_view uri)
 	{
 		clear();
-		std::cmatch result;
-		std::regex rule(
-			R"((?:([\da-zA-Z-]+)://)?)" // scheme
-			R"(([\da-zA-Z\.-]+))" // host
-			R"((?::(\d{1,5}))?)" // port
-			R"((/(.*))?)" // path
-		);
-		
-		m_valid = std::regex_match(uri.c_str(), result, rule);
-		if (m_valid) {
-			m_scheme = result[1].str();
-			m_host = result[2].str();
-			m_port = result[3].str();
-			m_path = result[4].str();
+		std::string_view rest = uri;
+
+		// a "://" in the query is no scheme
+		size_t schemeEnd = rest.find("://");
+		if (schemeEnd != rest.npos && schemeEnd < rest.find_first_of("/?#")) {
+			m_scheme = rest.substr(0, schemeEnd);
+			if (!validScheme(m_scheme))
+				return false;
+
+			rest.remove_prefix(schemeEnd + 3);
+		}
+
+		size_t authorityEnd = std::min(rest.find_first_of("/?#"), rest.size());
+		std::string_view authority = rest.substr(0, authorityEnd);
+		rest.remove_prefix(authorityEnd);
+
+		size_t at = authority.rfind('@');
+		if (at != authority.npos) {
+			m_userinfo = authority.substr(0, at);
+			authority.remove_prefix(at + 1);
+		}
+
+		if (authority.size() && authority[0] == '[') {
+			size_t close = authority.find(']');
+			if (close == authority.npos)
+				return false;
+
+			m_host = authority.substr(1, close - 1);
+			m_ipv6 = true;
+			authority.remove_prefix(close + 1);
+			if (!validIpv6(m_host))
+				return false;
+		}
+		else {
+			size_t colon = std::min(authority.find(':'), authority.size());
+			m_host = authority.substr(0, colon);
+			authority.remove_prefix(colon);
+			if (!validHost(m_host))
+				return false;
+		}
+
+		if (authority.size()) {
+			if (authority[0] != ':')
+				return false;
+
+			m_port = authority.substr(1);
+			if (m_port.empty() || m_port.size() > 5 || !allOf(m_port, isDigit))
+				return false;
 		}
 
+		m_path = rest.substr(0, rest.find('#'));
+		m_valid = true;
 		return m_valid;
 	}
 
 	bool valid() const { return m_valid; }
-	const std::string& scheme() const { return m_scheme; }
-	const std::string& host() const { return m_host; }
-	const std::string& port() const { return m_port; }
-	const std::string& path() const { return m_path; }
+	bool ipv6() const { return m_ipv6; }
+	std::string_view scheme() const { return m_scheme; }
+	std::string_view userinfo() const { return m_userinfo; }
+	std::string_view host() const { return m_host; } // no brackets
+	std::string_view port() const { return m_port; }
+	std::string_view path() const { return m_path; }
 
 private:
+	static bool isDigit(char ch)
+	{
+		return ch >= '0' && ch <= '9';
+	}
+
+	static bool isAlpha(char ch)
+	{
+		return (ch >= 'a' && ch <= 'z') || (ch >= 'A' && ch <= 'Z');
+	}
+
+	template <class Fn>
+	static bool allOf(std::string_view s, Fn fn)
+	{
+		return std::all_of(s.begin(), s.end(), fn);
+	}
+
+	static bool validScheme(std::string_view s)
+	{
+		return s.size() && allOf(s, [](char ch) {
+			return isAlpha(ch) || isDigit(ch) || ch == '+' || ch == '-' || ch == '.';
+		});
+	}
+
+	static bool validHost(std::string_view s)
+	{
+		return s.size() && allOf(s, [](char ch) {
+			return isAlpha(ch) || isDigit(ch) || ch == '-' || ch == '.' || ch == '_';
+		});
+	}
+
+	// hex groups, maybe an IPv4 tail, and a "%25" zone of any name
+	static bool validIpv6(std::string_view s)
+	{
+		size_t zone = std::min(s.find('%'), s.size());
+		return s.find(':') < zone && allOf(s.substr(0, zone), [](char ch) {
+			return isDigit(ch) || ch == ':' || ch == '.'
+				|| (ch >= 'a' && ch <= 'f') || (ch >= 'A' && ch <= 'F');
+		});
+	}
+
 	void clear()
 	{
 		m_valid = false;
-		m_scheme.clear();
-		m_host.clear();
-		m_port.clear();
-		m_path.clear();
+		m_ipv6 = false;
+		m_scheme = {};
+		m_userinfo = {};
+		m_host = {};
+		m_port = {};
+		m_path = {};
 	}
 
 	bool m_valid = false;
-	std::string m_scheme;
-	std::string m_host;
-	std::string m_port;
-	std::string m_path;
+	bool m_ipv6 = false;
+	std::string_view m_scheme;
+	std::string_view m_userinfo;
+	std::string_view m_host;
+	std::string_view m_port;
+	std::string_view m_path;
 };
 
+// An http or https URI, with the defaults filled in. The text is kept
+// once, shared by the copies, and the parts are views into it; so that
+// a url parsed when a download starts is handed to every request of it
+// without being parsed or copied again.
 class HttpUrl
 {
 public:
 	HttpUrl() {}
 
-	HttpUrl(ConStrRef url)
+	HttpUrl(std::string_view url)
 	{
 		parse(url);
 	}
 
-	bool parse(ConStrRef url)
+	bool parse(std::string_view url)
 	{
 		clear();
 		URI uri(url);
 		if (!uri.valid())
 			return false;
 
-		if (uri.host().empty())
+		std::string_view scheme = uri.scheme();
+		bool https = StringUtil::iEquals(scheme, "https");
+		unless (scheme.empty() || https || StringUtil::iEquals(scheme, "http"))
 			return false;
 
-		auto& scheme = uri.scheme();
-		bool validScheme = (scheme.empty()
-			|| scheme == "http" || scheme == "https");
-		if (!validScheme)
-			return false;
+		int port = https ? 443 : 80;
+		if (uri.port().size()) {
+			port = 0;
+			for (char ch : uri.port())
+				port = port * 10 + (ch - '0');
 
-		m_valid = true;
-		setDefault(uri);
+			if (port < 1 || port > 65535)
+				return false;
+		}
 
+		// the path starts with a slash, the fragment stays behind
+		std::string_view path = uri.path();
+		size_t pathAt = path.data() - url.data();
+		auto text = std::make_shared<std::string>();
+		text->reserve(pathAt + path.size() + 1);
+		text->append(url.data(), pathAt);
+		if (path.empty() || path[0] != '/')
+			text->push_back('/');
+		text->append(path.data(), path.size());
+
+		uri.parse(*text);
+		m_text = text;
+		m_valid = true;
+		m_overSSL = https;
+		m_ipv6 = uri.ipv6();
+		m_scheme = https ? "https" : "http";
+		m_userinfo = uri.userinfo();
+		m_host = uri.host();
+		m_port = port;
+		m_path = uri.path();
 		return m_valid;
 	}
 
 	bool valid() const { return m_valid; }
 	bool overSSL() const { return m_overSSL; }
-	const std::string& scheme() const { return m_scheme; }
-	const std::string& host() const { return m_host; }
+	bool ipv6() const { return m_ipv6; }
+	std::string_view scheme() const { return m_scheme; }
+	std::string_view userinfo() const { return m_userinfo; }
+	std::string_view host() const { return m_host; } // no brackets
 	int port() const { return m_port; }
-	const std::string& path() const { return m_path; }
+	std::string_view path() const { return m_path; } // with the query
 
-private:
-	void setDefault(const URI& uri)
+	// what a connection can be kept for, host names are not case sensitive
+	bool sameOrigin(const HttpUrl& other) const
 	{
-		m_host = uri.host();
-		m_overSSL = (uri.scheme() == "https");
-		m_scheme = m_overSSL ? "https" : "http";
-		m_port = m_overSSL ? 443 : 80;
-
-		if (uri.port().size())
-			m_port = (short)std::stoi(uri.port());
-
-		m_path = uri.path().size() ? uri.path() : "/";
+		return m_valid && other.m_valid && m_overSSL == other.m_overSSL
+			&& m_port == other.m_port && StringUtil::iEquals(m_host, other.m_host);
 	}
 
+private:
 	void clear()
 	{
+		m_text.reset();
 		m_valid = false;
 		m_overSSL = false;
-		m_scheme.clear();
-		m_host.clear();
+		m_ipv6 = false;
+		m_scheme = {};
+		m_userinfo = {};
+		m_host = {};
 		m_port = 0;
-		m_path.clear();
+		m_path = {};
 	}
 
+	std::shared_ptr<const std::string> m_text;
 	bool m_valid = false;
 	bool m_overSSL = false;
-	std::string m_scheme;
-	std::string m_host;
-	int m_port;
-	std::string m_path;
+	bool m_ipv6 = false;
+	std::string_view m_scheme;
+	std::string_view m_userinfo;
+	std::string_view m_host;
+	int m_port = 0;
+	std::string_view m_path;
 };
 
 class KeyValue
@@ -465,7 +602,7 @@ inline bool isUriBasicChar(unsigned char ch)
 
 inline bool isUriSeparatorChar(unsigned char ch)
 {
-	unsigned char t[] = ";/?:@&=+$,#";
+	unsigned char t[] = ";/?:@&=+$,#[]"; // "[]" of IPv6 hosts
 	unsigned char* end = t + _sizeof(t) - 1;
 	return std::find(t, end, ch) != end;
 }
@@ -607,11 +744,92 @@ private:
 	bool m_b;
 };
 
+// a view of a buffer owned by someone else
 struct BinaryData
 {
-	static const size_t kBufferSize = KB(2);
-	BYTE buffer[kBufferSize];
-	DWORD size;
+	BinaryData() {}
+	BinaryData(BYTE* b, size_t c) : buffer(b), capacity(c) {}
+
+	BYTE* buffer = nullptr;
+	size_t size = 0;
+	size_t capacity = 0;
+};
+
+// Keeps the read buffers of a download, a buffer goes back to the pool
+// when its lease ends instead of being freed.
+class BufferPool
+{
+public:
+	typedef std::unique_ptr<BYTE[]> Buffer;
+
+	static constexpr size_t kMinBufferSize = KB(64);
+	static constexpr size_t kMaxBufferSize = MB(4);
+
+	class Lease
+	{
+	public:
+		Lease(BufferPool* pool, Buffer buffer) :
+			m_pool(pool), m_buffer(std::move(buffer)) {}
+
+		Lease(Lease&& other) :
+			m_pool(other.m_pool), m_buffer(std::move(other.m_buffer))
+		{
+			other.m_pool = nullptr;
+		}
+
+		~Lease()
+		{
+			if (m_pool && m_buffer)
+				m_pool->release(std::move(m_buffer));
+		}
+
+		BinaryData data() const
+		{
+			return BinaryData(m_buffer.get(), m_pool->bufferSize());
+		}
+
+	private:
+		Lease(const Lease&) = delete;
+		void operator =(const Lease&) = delete;
+
+		BufferPool* m_pool;
+		Buffer m_buffer;
+	};
+
+	void init(size_t bufferSize)
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_bufferSize = std::min(std::max(
+			bufferSize, kMinBufferSize), kMaxBufferSize);
+		m_free.clear();
+	}
+
+	size_t bufferSize() const
+	{
+		return m_bufferSize;
+	}
+
+	Lease acquire()
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		if (m_free.empty())
+			return Lease(this, Buffer(new BYTE[m_bufferSize]));
+
+		Buffer buffer = std::move(m_free.back());
+		m_free.pop_back();
+		return Lease(this, std::move(buffer));
+	}
+
+private:
+	void release(Buffer buffer)
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_free.push_back(std::move(buffer));
+	}
+
+	size_t m_bufferSize = kMinBufferSize;
+	std::vector<Buffer> m_free;
+	std::mutex m_mutex;
 };
 
 class NativeString
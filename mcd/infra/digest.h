@@ -0,0 +1,268 @@
+#pragma once
+#include "guard.h"
+
+#ifdef _WIN32
+#include <bcrypt.h>
+#else
+#include <openssl/evp.h>
+#endif
+
+BEGIN_NAMESPACE_MCD
+
+// SHA-256 of the platform, CNG on Windows and OpenSSL elsewhere, both
+// use the SHA extensions of the CPU when there are any
+class Sha256
+{
+public:
+	static const size_t kSize = 32;
+	typedef std::array<BYTE, kSize> Digest;
+
+	Sha256()
+	{
+#ifdef _WIN32
+		BCryptCreateHash(algorithm(), &m_hash, nullptr, 0, nullptr, 0, 0);
+#else
+		m_ctx = EVP_MD_CTX_new();
+		EVP_DigestInit_ex(m_ctx, EVP_sha256(), nullptr);
+#endif
+	}
+
+	Sha256(const Sha256&) = delete;
+	Sha256& operator =(const Sha256&) = delete;
+
+	~Sha256()
+	{
+#ifdef _WIN32
+		if (m_hash)
+			BCryptDestroyHash(m_hash);
+#else
+		EVP_MD_CTX_free(m_ctx);
+#endif
+	}
+
+	void update(const BYTE* data, size_t size)
+	{
+#ifdef _WIN32
+		while (size) {
+			ULONG part = (ULONG)std::min<size_t>(size, MAXULONG);
+			BCryptHashData(m_hash, (PUCHAR)data, part, 0);
+			data += part;
+			size -= part;
+		}
+#else
+		EVP_DigestUpdate(m_ctx, data, size);
+#endif
+	}
+
+	// once, nothing is added after it
+	Digest finish()
+	{
+		Digest digest = {};
+#ifdef _WIN32
+		BCryptFinishHash(m_hash, digest.data(), (ULONG)kSize, 0);
+#else
+		EVP_DigestFinal_ex(m_ctx, digest.data(), nullptr);
+#endif
+		return digest;
+	}
+
+	static std::string hex(const Digest& digest)
+	{
+		static const char kDigits[] = "0123456789abcdef";
+		std::string result;
+		for (BYTE i : digest) {
+			result += kDigits[i >> 4];
+			result += kDigits[i & 0xf];
+		}
+
+		return result;
+	}
+
+private:
+#ifdef _WIN32
+	// a provider handle may be shared by threads
+	static BCRYPT_ALG_HANDLE algorithm()
+	{
+		static BCRYPT_ALG_HANDLE handle = []() {
+			BCRYPT_ALG_HANDLE h = nullptr;
+			BCryptOpenAlgorithmProvider(&h,
+				BCRYPT_SHA256_ALGORITHM, nullptr, 0);
+			return h;
+		}();
+
+		return handle;
+	}
+
+	BCRYPT_HASH_HANDLE m_hash = nullptr;
+#else
+	EVP_MD_CTX* m_ctx = nullptr;
+#endif
+};
+
+// SHA-256 of every 1 MiB block of a file, and the root: SHA-256 of the
+// block digests one after another, the same as
+//   split -b 1M --filter='openssl dgst -sha256 -binary' FILE
+//     | openssl dgst -sha256
+// The blocks are hashed as the writes arrive, in whatever order. Within
+// a block the bytes must go in order, so a piece arriving ahead of what
+// the block has seen waits in memory for the gap to fill, kMaxBuffered
+// at most for all blocks. A block that could not be hashed on the way,
+// for want of memory or because an earlier run wrote it, is read back
+// from the file by finish().
+class TreeHash
+{
+public:
+	static constexpr int64_t kBlockSize = MB(1);
+	static const size_t kMaxBuffered = MB(64);
+
+	void init(int64_t size)
+	{
+		m_size = size;
+		m_blocks.clear();
+		for (int64_t i = 0; i < size; i += kBlockSize)
+			m_blocks.emplace_back(new Block());
+	}
+
+	// may be called from several threads at the same time, the bytes
+	// of a position are taken for the same when they come twice
+	void update(const BYTE* data, size_t size, int64_t pos)
+	{
+		while (size) {
+			int64_t index = pos / kBlockSize;
+			int64_t offset = pos % kBlockSize;
+			size_t piece = (size_t)std::min<int64_t>(
+				size, kBlockSize - offset);
+
+			if (_should(index < (int64_t)m_blocks.size(), pos, m_size))
+				feed(index, offset, data, piece);
+
+			data += piece;
+			size -= piece;
+			pos += piece;
+		}
+	}
+
+	// once the file has been flushed, returns the root in hex
+	Result finish(ConStrRef path, std::string* hex)
+	{
+		std::ifstream file;
+		std::vector<BYTE> buffer;
+		Sha256 root;
+
+		for (size_t i = 0; i < m_blocks.size(); ++i) {
+			Block& block = *m_blocks[i];
+			if (!block.done) {
+				if (!file.is_open()) {
+					file.open(nativePath(path), std::ios::binary);
+					buffer.resize((size_t)kBlockSize);
+				}
+
+				size_t size = (size_t)blockSize(i);
+				file.seekg((int64_t)i * kBlockSize);
+				file.read((char*)buffer.data(), size);
+				_must_or_return(InternalError::ioError, file.good(), path, i);
+
+				Sha256 sha;
+				sha.update(buffer.data(), size);
+				block.digest = sha.finish();
+			}
+
+			root.update(block.digest.data(), block.digest.size());
+		}
+
+		*hex = Sha256::hex(root.finish());
+		return {};
+	}
+
+private:
+	struct Block
+	{
+		std::mutex mutex;
+		int64_t frontier = 0; // hashed from the start of the block
+		std::unique_ptr<Sha256> sha; // while in progress
+		std::map<int64_t, std::string> ahead; // by offset in the block
+		bool reread = false; // left to finish()
+		bool done = false;
+		Sha256::Digest digest = {};
+	};
+
+	int64_t blockSize(int64_t index) const
+	{
+		return std::min(kBlockSize, m_size - index * kBlockSize);
+	}
+
+	void feed(int64_t index, int64_t offset, const BYTE* data, size_t size)
+	{
+		Block& block = *m_blocks[index];
+		Guard::Mutex lock(&block.mutex);
+		if (block.done || block.reread)
+			return;
+
+		if (offset > block.frontier) {
+			keepAhead(&block, offset, data, size);
+			return;
+		}
+
+		hashFrom(&block, offset, data, size);
+		while (block.ahead.size()
+			&& block.ahead.begin()->first <= block.frontier) {
+			auto it = block.ahead.begin();
+			std::string piece = std::move(it->second);
+			int64_t pieceOffset = it->first;
+			block.ahead.erase(it);
+			m_buffered -= piece.size();
+
+			hashFrom(&block, pieceOffset,
+				(const BYTE*)piece.data(), piece.size());
+		}
+
+		if (block.frontier == blockSize(index)) {
+			block.digest = block.sha->finish();
+			block.sha.reset();
+			block.done = true;
+		}
+	}
+
+	// requires the lock of the block, the part before the
+	// frontier has been hashed already
+	void hashFrom(Block* block, int64_t offset, const BYTE* data, size_t size)
+	{
+		int64_t end = offset + (int64_t)size;
+		if (end <= block->frontier)
+			return;
+
+		if (!block->sha)
+			block->sha.reset(new Sha256());
+
+		int64_t skip = block->frontier - offset;
+		block->sha->update(data + skip, (size_t)(end - block->frontier));
+		block->frontier = end;
+	}
+
+	// requires the lock of the block
+	void keepAhead(Block* block, int64_t offset, const BYTE* data, size_t size)
+	{
+		std::string& piece = block->ahead[offset];
+		if (piece.size() >= size)
+			return;
+
+		if (m_buffered + size - piece.size() > kMaxBuffered) {
+			for (auto& i : block->ahead)
+				m_buffered -= i.second.size();
+
+			block->ahead.clear();
+			block->sha.reset();
+			block->reread = true;
+			return;
+		}
+
+		m_buffered += size - piece.size();
+		piece.assign((const char*)data, size);
+	}
+
+	int64_t m_size = 0;
+	Guard::PtrSet<Block> m_blocks;
+	std::atomic_size_t m_buffered = 0;
+};
+
+END_NAMESPACE_MCD
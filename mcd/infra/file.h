@@ -0,0 +1,820 @@
+#pragma once
+#include "guard.h"
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#endif
+
+BEGIN_NAMESPACE_MCD
+
+// waits until the content of the file is on the disk; on POSIX a
+// directory is synced the same way, which is what makes a rename in
+// it last
+inline Result syncFile(ConStrRef path)
+{
+#ifdef _WIN32
+	HANDLE file = CreateFile(u8to16(path), GENERIC_WRITE,
+		FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING,
+		FILE_ATTRIBUTE_NORMAL, NULL);
+	_must_or_return(InternalError::ioError,
+		file != INVALID_HANDLE_VALUE, path, GetLastError());
+
+	Guard::Handle guard(file);
+	_must_or_return(InternalError::ioError,
+		FlushFileBuffers(file), path, GetLastError());
+#else
+	int file = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+	_must_or_return(InternalError::ioError, file >= 0, path, errno);
+
+	Guard::Fd guard(file);
+	_must_or_return(InternalError::ioError,
+		fsync(file) == 0, path, errno);
+#endif
+	return {};
+}
+
+// Where the bytes of ParallelFileWriter finally go. Implementations must
+// allow write() to be called from several threads at the same time.
+class FileBackend : public InterfaceClass
+{
+public:
+	// the existing content is kept when `keep` is set
+	virtual Result open(ConStrRef path, bool keep) = 0;
+	virtual Result write(const BYTE* data, size_t size, int64_t pos) = 0;
+
+	// hands everything written so far to the OS
+	virtual Result flush() = 0;
+
+	// waits until everything written so far is on the disk, for what
+	// is recorded as done to survive a power loss
+	virtual Result sync() = 0;
+};
+
+// std::ofstream behind one lock, each write is a seek and a write
+class StreamFileBackend : public FileBackend
+{
+public:
+	Result open(ConStrRef path, bool keep) override
+	{
+		auto mode = std::ios::binary | std::ios::out;
+		if (keep)
+			mode |= std::ios::in;
+
+		m_file.open(nativePath(path), mode);
+		_must_or_return(InternalError::ioError, m_file.good());
+		m_path = path;
+		return {};
+	}
+
+	Result write(const BYTE* data, size_t size, int64_t pos) override
+	{
+		Guard::Mutex lock(&m_mutex);
+		m_file.seekp(pos);
+		m_file.write((const char*)data, size);
+		_must(m_file.good());
+		_must_or_return(InternalError::ioError, m_file.good());
+		return {};
+	}
+
+	Result flush() override
+	{
+		Guard::Mutex lock(&m_mutex);
+		m_file.flush();
+		_must_or_return(InternalError::ioError, m_file.good());
+		return {};
+	}
+
+	// the stream has no descriptor of its own to sync
+	Result sync() override
+	{
+		_call(flush());
+		return syncFile(m_path);
+	}
+
+private:
+	std::mutex m_mutex;
+	std::ofstream m_file;
+	std::string m_path;
+};
+
+#ifdef _WIN32
+// Writes at explicit offsets on an overlapped handle, so the writes of
+// different connections neither share a file pointer nor wait on a lock.
+class PositionalFileBackend : public FileBackend
+{
+public:
+	~PositionalFileBackend()
+	{
+		if (m_file != INVALID_HANDLE_VALUE)
+			CloseHandle(m_file);
+	}
+
+	Result open(ConStrRef path, bool keep) override
+	{
+		m_file = CreateFile(u8to16(path), GENERIC_WRITE,
+			FILE_SHARE_READ, NULL, keep ? OPEN_ALWAYS : CREATE_ALWAYS,
+			FILE_ATTRIBUTE_NORMAL | FILE_FLAG_OVERLAPPED, NULL);
+
+		_must_or_return(InternalError::ioError,
+			m_file != INVALID_HANDLE_VALUE, path, GetLastError());
+		return {};
+	}
+
+	Result write(const BYTE* data, size_t size, int64_t pos) override
+	{
+		OVERLAPPED ov = {};
+		ov.Offset = (DWORD)(pos & 0xFFFFFFFF);
+		ov.OffsetHigh = (DWORD)(pos >> 32);
+		ov.hEvent = threadEvent();
+		_must(ov.hEvent);
+
+		DWORD written = 0;
+		Bool r = WriteFile(m_file, data, (DWORD)size, NULL, &ov);
+		if (!r && GetLastError() == ERROR_IO_PENDING)
+			r = GetOverlappedResult(m_file, &ov, &written, TRUE);
+		else if (r)
+			r = GetOverlappedResult(m_file, &ov, &written, FALSE);
+
+		_must_or_return(InternalError::ioError, r, pos, GetLastError());
+		_must_or_return(InternalError::ioError, written == size, pos);
+		return {};
+	}
+
+	// WriteFile has already handed the data to the OS
+	Result flush() override
+	{
+		return {};
+	}
+
+	Result sync() override
+	{
+		_must_or_return(InternalError::ioError,
+			FlushFileBuffers(m_file), GetLastError());
+		return {};
+	}
+
+private:
+	// one event per thread, several writes may be pending on the handle
+	static HANDLE threadEvent()
+	{
+		struct Event
+		{
+			Event() { handle = CreateEvent(NULL, TRUE, FALSE, NULL); }
+			~Event() { if (handle) CloseHandle(handle); }
+			HANDLE handle;
+		};
+
+		thread_local Event event;
+		return event.handle;
+	}
+
+	HANDLE m_file = INVALID_HANDLE_VALUE;
+};
+#else
+// pwrite() at explicit offsets, the posix counterpart of the above
+class PositionalFileBackend : public FileBackend
+{
+public:
+	~PositionalFileBackend()
+	{
+		if (m_file >= 0)
+			close(m_file);
+	}
+
+	Result open(ConStrRef path, bool keep) override
+	{
+		int flags = O_WRONLY | O_CREAT | O_CLOEXEC;
+		if (!keep)
+			flags |= O_TRUNC;
+
+		m_file = ::open(path.c_str(), flags, 0644);
+		_must_or_return(InternalError::ioError, m_file >= 0, path, errno);
+		return {};
+	}
+
+	Result write(const BYTE* data, size_t size, int64_t pos) override
+	{
+		while (size) {
+			ssize_t n = pwrite(m_file, data, size, (off_t)pos);
+			if (n < 0 && errno == EINTR)
+				continue;
+
+			_must_or_return(InternalError::ioError, n > 0, pos, errno);
+			data += n;
+			size -= n;
+			pos += n;
+		}
+
+		return {};
+	}
+
+	// pwrite has already handed the data to the OS
+	Result flush() override
+	{
+		return {};
+	}
+
+	Result sync() override
+	{
+		_must_or_return(InternalError::ioError,
+			fdatasync(m_file) == 0, errno);
+		return {};
+	}
+
+private:
+	int m_file = -1;
+};
+#endif
+
+// Maps the (preallocated) file in windows and copies the data straight
+// into them, so a write is a memcpy with no system call. The lock is
+// only held to look up a window. Windows nobody is copying into are
+// unmapped, least recently used first, once more than `maxWindows` are
+// mapped, which keeps the resident size bounded; their dirty pages stay
+// in the page cache to be written back by the OS.
+class MappedFileBackend : public FileBackend
+{
+public:
+	MappedFileBackend(int64_t size, size_t windowSize, size_t maxWindows) :
+		m_size(size), m_maxWindows(maxWindows)
+	{
+#ifdef _WIN32
+		SYSTEM_INFO si = {};
+		GetSystemInfo(&si);
+		size_t unit = si.dwAllocationGranularity;
+#else
+		size_t unit = (size_t)sysconf(_SC_PAGESIZE);
+#endif
+
+		// views must start on the allocation granularity
+		m_windowSize = std::max(unit, windowSize / unit * unit);
+	}
+
+	~MappedFileBackend()
+	{
+		for (auto& i : m_windows)
+			unmapView(i.second);
+
+#ifdef _WIN32
+		if (m_mapping)
+			CloseHandle(m_mapping);
+
+		if (m_file != INVALID_HANDLE_VALUE)
+			CloseHandle(m_file);
+#else
+		if (m_file >= 0)
+			close(m_file);
+#endif
+	}
+
+#ifdef _WIN32
+	Result open(ConStrRef path, bool keep) override
+	{
+		_must(m_size > 0, path);
+		m_file = CreateFile(u8to16(path), GENERIC_READ | GENERIC_WRITE,
+			FILE_SHARE_READ, NULL, keep ? OPEN_ALWAYS : CREATE_ALWAYS,
+			FILE_ATTRIBUTE_NORMAL, NULL);
+		_must_or_return(InternalError::ioError,
+			m_file != INVALID_HANDLE_VALUE, path, GetLastError());
+
+		m_mapping = CreateFileMapping(m_file, NULL, PAGE_READWRITE,
+			(DWORD)(m_size >> 32), (DWORD)(m_size & 0xFFFFFFFF), NULL);
+		_must_or_return(InternalError::ioError,
+			m_mapping, path, GetLastError());
+		return {};
+	}
+#else
+	// the file must already have its final size, see preallocateFile()
+	Result open(ConStrRef path, bool keep) override
+	{
+		_must(m_size > 0, path);
+		int flags = O_RDWR | O_CREAT | O_CLOEXEC;
+		if (!keep)
+			flags |= O_TRUNC;
+
+		m_file = ::open(path.c_str(), flags, 0644);
+		_must_or_return(InternalError::ioError, m_file >= 0, path, errno);
+
+		struct stat st = {};
+		_must_or_return(InternalError::ioError,
+			fstat(m_file, &st) == 0 && st.st_size >= m_size, path, errno);
+		return {};
+	}
+#endif
+
+	Result write(const BYTE* data, size_t size, int64_t pos) override
+	{
+		_must_or_return(InternalError::ioError,
+			pos >= 0 && pos + (int64_t)size <= m_size, pos, size);
+
+		while (size) {
+			int64_t index = pos / m_windowSize;
+			size_t offset = (size_t)(pos % m_windowSize);
+
+			BYTE* base = nullptr;
+			size_t length = 0;
+			_call(acquire(index, &base, &length));
+
+			size_t n = std::min(size, length - offset);
+			memcpy(base + offset, data, n);
+			release(index);
+
+			data += n;
+			size -= n;
+			pos += n;
+		}
+
+		return {};
+	}
+
+	Result flush() override
+	{
+		return flushViews(false);
+	}
+
+	// the windows already unmapped have left their pages to the
+	// cache of the file, which the file sync writes back as well
+	Result sync() override
+	{
+		_call(flushViews(true));
+#ifdef _WIN32
+		_must_or_return(InternalError::ioError,
+			FlushFileBuffers(m_file), GetLastError());
+#else
+		_must_or_return(InternalError::ioError,
+			fdatasync(m_file) == 0, errno);
+#endif
+		return {};
+	}
+
+private:
+	struct Window
+	{
+		BYTE* base = nullptr;
+		size_t length = 0;
+		int users = 0;
+		uint64_t lastUse = 0;
+	};
+
+	// the windows are pinned rather than locked while they are
+	// flushed, the writers go on meanwhile
+	Result flushViews(bool wait)
+	{
+		std::vector<std::pair<int64_t, Window>> windows;
+		{
+			Guard::Mutex lock(&m_mutex);
+			for (auto& i : m_windows) {
+				++i.second.users;
+				windows.push_back(i);
+			}
+		}
+
+		DWORD error = 0;
+		for (auto& i : windows) {
+			if (!flushView(i.second, wait) && !error)
+				error = GetLastError();
+		}
+
+		Guard::Mutex lock(&m_mutex);
+		for (auto& i : windows)
+			--m_windows[i.first].users;
+
+		_must_or_return(InternalError::ioError, !error, error);
+		return {};
+	}
+
+	Result acquire(int64_t index, BYTE** base, size_t* length)
+	{
+		Guard::Mutex lock(&m_mutex);
+		auto found = m_windows.find(index);
+		if (found == m_windows.end()) {
+			evictIdle();
+			_call(map(index, &found));
+		}
+
+		Window& w = found->second;
+		++w.users;
+		w.lastUse = ++m_useCounter;
+		*base = w.base;
+		*length = w.length;
+		return {};
+	}
+
+	void release(int64_t index)
+	{
+		Guard::Mutex lock(&m_mutex);
+		--m_windows[index].users;
+	}
+
+	Result map(int64_t index, std::map<int64_t, Window>::iterator* result)
+	{
+		int64_t start = index * m_windowSize;
+		Window w;
+		w.length = (size_t)std::min<int64_t>(m_windowSize, m_size - start);
+#ifdef _WIN32
+		w.base = (BYTE*)MapViewOfFile(m_mapping, FILE_MAP_WRITE,
+			(DWORD)(start >> 32), (DWORD)(start & 0xFFFFFFFF), w.length);
+#else
+		void* base = mmap(NULL, w.length, PROT_READ | PROT_WRITE,
+			MAP_SHARED, m_file, (off_t)start);
+		w.base = (base == MAP_FAILED) ? nullptr : (BYTE*)base;
+#endif
+		_must_or_return(InternalError::ioError,
+			w.base, start, GetLastError());
+
+		*result = m_windows.emplace(index, w).first;
+		return {};
+	}
+
+	void evictIdle()
+	{
+		while (m_windows.size() >= m_maxWindows) {
+			auto victim = m_windows.end();
+			for (auto i = m_windows.begin(); i != m_windows.end(); ++i) {
+				if (i->second.users)
+					continue;
+
+				if (victim == m_windows.end()
+					|| i->second.lastUse < victim->second.lastUse)
+					victim = i;
+			}
+
+			// all windows busy, map one more for now
+			if (victim == m_windows.end())
+				return;
+
+			unmapView(victim->second);
+			m_windows.erase(victim);
+		}
+	}
+
+	// starts writing the pages back, as much as a write() to the file
+	// would have done; waits for the disk as well when `wait` is set,
+	// Windows leaves that to FlushFileBuffers()
+	static bool flushView(const Window& w, bool wait)
+	{
+#ifdef _WIN32
+		UNUSED(wait);
+		return FlushViewOfFile(w.base, 0) != FALSE;
+#else
+		return msync(w.base, w.length, wait ? MS_SYNC : MS_ASYNC) == 0;
+#endif
+	}
+
+	static void unmapView(const Window& w)
+	{
+#ifdef _WIN32
+		UnmapViewOfFile(w.base);
+#else
+		munmap(w.base, w.length);
+#endif
+	}
+
+	int64_t m_size;
+	size_t m_windowSize;
+	size_t m_maxWindows;
+	uint64_t m_useCounter = 0;
+
+#ifdef _WIN32
+	HANDLE m_file = INVALID_HANDLE_VALUE;
+	HANDLE m_mapping = NULL;
+#else
+	int m_file = -1;
+#endif
+	std::map<int64_t, Window> m_windows;
+	std::mutex m_mutex;
+};
+
+// Decouples the network from the disk. write() copies the data into one
+// of a fixed number of chunks and returns, a dedicated thread writes the
+// chunks out in order. Data continuing a queued chunk is appended to it,
+// and chunks end on multiples of the chunk size, so a slow disk sees few
+// large aligned writes. Callers block only when every chunk is in use.
+class WriteBehindBackend : public FileBackend
+{
+public:
+	typedef std::unique_ptr<FileBackend> Target;
+
+	WriteBehindBackend(Target target, size_t chunkSize, size_t chunkNum) :
+		m_target(std::move(target)), m_chunkSize(chunkSize),
+		m_chunks(chunkNum)
+	{
+		for (auto& i : m_chunks) {
+			i.buffer.reset(new BYTE[chunkSize]);
+			m_free.push_back(&i);
+		}
+	}
+
+	~WriteBehindBackend()
+	{
+		{
+			Lock lock(m_mutex);
+			m_stopping = true;
+		}
+
+		m_wakeWriter.notify_all();
+		if (m_thread.joinable())
+			m_thread.join();
+	}
+
+	Result open(ConStrRef path, bool keep) override
+	{
+		_must(m_chunks.size() && m_chunkSize);
+		_call(m_target->open(path, keep));
+		m_thread = std::thread(std::bind(&WriteBehindBackend::run, this));
+		return {};
+	}
+
+	Result write(const BYTE* data, size_t size, int64_t pos) override
+	{
+		while (size) {
+			Chunk* chunk = nullptr;
+			size_t offset = 0;
+			size_t n = 0;
+			_call(reserve(pos, size, &chunk, &offset, &n));
+
+			memcpy(chunk->buffer.get() + offset, data, n);
+			commit(chunk);
+
+			data += n;
+			size -= n;
+			pos += n;
+		}
+
+		return {};
+	}
+
+	Result flush() override
+	{
+		_call(drain());
+		return m_target->flush();
+	}
+
+	Result sync() override
+	{
+		_call(drain());
+		return m_target->sync();
+	}
+
+private:
+	typedef std::unique_lock<std::mutex> Lock;
+
+	// waits for the chunks queued so far, not for the ones queued later
+	Result drain()
+	{
+		Lock lock(m_mutex);
+		uint64_t target = m_nextSeq;
+		m_written.wait(lock, [&]() {
+			return m_doneSeq >= target || m_error.failed();
+		});
+
+		return m_error;
+	}
+
+	struct Chunk
+	{
+		std::unique_ptr<BYTE[]> buffer;
+		uint64_t seq = 0;
+		int64_t pos = 0;
+		size_t size = 0; // reserved, including copies still running
+		size_t limit = 0;
+		int users = 0;
+	};
+
+	Result reserve(int64_t pos, size_t size,
+		Chunk** chunk, size_t* offset, size_t* n)
+	{
+		Lock lock(m_mutex);
+		for (auto i : m_pending) {
+			if (i->pos + (int64_t)i->size == pos && i->size < i->limit) {
+				take(i, size, chunk, offset, n);
+				return {};
+			}
+		}
+
+		m_chunkFreed.wait(lock, [this]() {
+			return m_free.size() || m_error.failed();
+		});
+
+		if (m_error.failed())
+			return m_error;
+
+		Chunk* c = m_free.back();
+		m_free.pop_back();
+		c->seq = ++m_nextSeq;
+		c->pos = pos;
+		c->size = 0;
+		c->limit = m_chunkSize - (size_t)(pos % m_chunkSize);
+		m_pending.push_back(c);
+
+		take(c, size, chunk, offset, n);
+		return {};
+	}
+
+	void take(Chunk* c, size_t size,
+		Chunk** chunk, size_t* offset, size_t* n)
+	{
+		*chunk = c;
+		*offset = c->size;
+		*n = std::min(size, c->limit - c->size);
+		c->size += *n;
+		++c->users;
+	}
+
+	void commit(Chunk* chunk)
+	{
+		{
+			Lock lock(m_mutex);
+			--chunk->users;
+		}
+
+		m_wakeWriter.notify_one();
+	}
+
+	bool frontReady() const
+	{
+		return m_pending.size() && m_pending.front()->users == 0;
+	}
+
+	void run()
+	{
+		Lock lock(m_mutex);
+		for (;;) {
+			m_wakeWriter.wait(lock, [this]() {
+				return frontReady() || (m_stopping && m_pending.empty());
+			});
+
+			if (!frontReady())
+				return;
+
+			Chunk* c = m_pending.front();
+			m_pending.pop_front();
+
+			lock.unlock();
+			Result r = m_target->write(c->buffer.get(), c->size, c->pos);
+			lock.lock();
+
+			if (r.failed() && m_error.ok())
+				m_error = r;
+
+			m_doneSeq = c->seq;
+			m_free.push_back(c);
+			m_chunkFreed.notify_all();
+			m_written.notify_all();
+		}
+	}
+
+	Target m_target;
+	size_t m_chunkSize;
+	std::vector<Chunk> m_chunks;
+	std::vector<Chunk*> m_free;
+	std::deque<Chunk*> m_pending;
+
+	uint64_t m_nextSeq = 0;
+	uint64_t m_doneSeq = 0;
+	bool m_stopping = false;
+	Result m_error;
+
+	std::mutex m_mutex;
+	std::condition_variable m_wakeWriter;
+	std::condition_variable m_chunkFreed;
+	std::condition_variable m_written;
+	std::thread m_thread;
+};
+
+inline std::string parentDirectory(ConStrRef path)
+{
+	auto pos = path.find_last_of("\\/");
+	if (pos == std::string::npos)
+		return ".";
+
+	return path.substr(0, pos + 1);
+}
+
+// Grows the file to its final size before the download starts, so the
+// blocks are reserved in one go instead of being appended piece by piece
+// as out-of-order writes land, and a short disk fails here and not at
+// 97%. Filesystems that refuse to set the size just skip this step.
+// A `sparse` file only gets its size, neither the blocks nor the free
+// space for them, for a file of which little is ever written.
+#ifdef _WIN32
+inline Result preallocateFile(ConStrRef path, int64_t size,
+	bool keep, bool sparse)
+{
+	HANDLE file = CreateFile(u8to16(path), GENERIC_WRITE,
+		FILE_SHARE_READ, NULL, keep ? OPEN_ALWAYS : CREATE_ALWAYS,
+		FILE_ATTRIBUTE_NORMAL, NULL);
+	_must_or_return(InternalError::ioError,
+		file != INVALID_HANDLE_VALUE, path, GetLastError());
+
+	Guard::Handle guard(file);
+
+	LARGE_INTEGER curSize = {};
+	_must_or_return(InternalError::ioError,
+		GetFileSizeEx(file, &curSize), path, GetLastError());
+
+	int64_t needed = size - curSize.QuadPart;
+	if (needed <= 0)
+		return {};
+
+	// else NTFS allocates the clusters up to the new end
+	if (sparse) {
+		DWORD unused = 0;
+		_should(DeviceIoControl(file, FSCTL_SET_SPARSE,
+			NULL, 0, NULL, 0, &unused, NULL), path, GetLastError());
+	}
+
+	ULARGE_INTEGER freeSpace = {};
+	if (!sparse && GetDiskFreeSpaceEx(u8to16(parentDirectory(path)),
+		&freeSpace, NULL, NULL)) {
+		_must_or_return(RequireError::diskSpace,
+			(ULONGLONG)needed <= freeSpace.QuadPart,
+			path, needed, freeSpace.QuadPart);
+	}
+
+	LARGE_INTEGER end = {};
+	end.QuadPart = size;
+	Bool r = SetFilePointerEx(file, end, NULL, FILE_BEGIN)
+		&& SetEndOfFile(file);
+
+	if (!r) {
+		DWORD err = GetLastError();
+		_must_or_return(RequireError::diskSpace,
+			err != ERROR_DISK_FULL, path, size);
+		_should(false, path, size, err);
+	}
+
+	return {};
+}
+#else
+inline Result preallocateFile(ConStrRef path, int64_t size,
+	bool keep, bool sparse)
+{
+	int flags = O_WRONLY | O_CREAT | O_CLOEXEC;
+	if (!keep)
+		flags |= O_TRUNC;
+
+	int file = ::open(path.c_str(), flags, 0644);
+	_must_or_return(InternalError::ioError, file >= 0, path, errno);
+
+	Guard::Fd guard(file);
+
+	struct stat st = {};
+	_must_or_return(InternalError::ioError,
+		fstat(file, &st) == 0, path, errno);
+
+	int64_t needed = size - st.st_size;
+	if (needed <= 0)
+		return {};
+
+	if (sparse) {
+		_must_or_return(InternalError::ioError,
+			ftruncate(file, size) == 0, path, size, errno);
+		return {};
+	}
+
+	struct statvfs vfs = {};
+	if (statvfs(parentDirectory(path).c_str(), &vfs) == 0) {
+		uint64_t freeSpace = (uint64_t)vfs.f_bavail * vfs.f_frsize;
+		_must_or_return(RequireError::diskSpace,
+			(uint64_t)needed <= freeSpace, path, needed, freeSpace);
+	}
+
+	int err = posix_fallocate(file, st.st_size, needed);
+	if (err) {
+		_must_or_return(RequireError::diskSpace,
+			err != ENOSPC, path, size);
+		_should(false, path, size, err);
+		ftruncate(file, size);
+	}
+
+	return {};
+}
+#endif
+
+// replaces `to` in one step, a crash leaves either the old or the new file
+inline Result replaceFile(ConStrRef from, ConStrRef to)
+{
+#ifdef _WIN32
+	Bool r = MoveFileEx(u8to16(from), u8to16(to),
+		MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH);
+#else
+	bool r = (rename(from.c_str(), to.c_str()) == 0);
+#endif
+	_must_or_return(InternalError::ioError, r, to, GetLastError());
+	return {};
+}
+
+inline void removeFile(ConStrRef path)
+{
+#ifdef _WIN32
+	DeleteFile(u8to16(path));
+#else
+	unlink(path.c_str());
+#endif
+}
+
+END_NAMESPACE_MCD
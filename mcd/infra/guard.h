@@ -1,6 +1,8 @@
 #pragma once
 #include "ward.h"
+#ifdef _WIN32
 #include <winhttp.h>
+#endif
 
 BEGIN_NAMESPACE_MCD
 
@@ -12,12 +14,19 @@ using GuardImpl = std::unique_ptr<
 	std::function<void(T)>
 >;
 
+#ifdef _WIN32
 struct WinHttp : public GuardImpl<HINTERNET>
 {
 	WinHttp(HINTERNET h = NULL) :
 		GuardImpl<HINTERNET>(h, WinHttpCloseHandle) {}
 };
 
+struct Handle : public GuardImpl<HANDLE>
+{
+	Handle(HANDLE h = NULL) :
+		GuardImpl<HANDLE>(h, CloseHandle) {}
+};
+
 template <class T>
 struct DeleteObjectGuard : public GuardImpl<T>
 {
@@ -52,6 +61,41 @@ private:
 	HWND m_hwnd;
 	HDC m_hdc;
 };
+#else
+class Fd
+{
+public:
+	Fd(int fd = -1) : m_fd(fd) {}
+	Fd(const Fd&) = delete;
+	Fd& operator =(const Fd&) = delete;
+
+	~Fd()
+	{
+		reset();
+	}
+
+	void reset(int fd = -1)
+	{
+		if (m_fd >= 0)
+			close(m_fd);
+
+		m_fd = fd;
+	}
+
+	int get() const
+	{
+		return m_fd;
+	}
+
+	operator bool() const
+	{
+		return m_fd >= 0;
+	}
+
+private:
+	int m_fd;
+};
+#endif
 
 class Mutex: public std::lock_guard<std::mutex>
 {
@@ -0,0 +1,66 @@
+#pragma once
+#include "guard.h"
+
+BEGIN_NAMESPACE_MCD
+
+// Durations in buckets doubling from 1 µs, the last one open ended.
+// Recording is a few relaxed atomic adds, so a read loop may record on
+// every pass while another thread takes snapshots.
+class LatencyHistogram
+{
+public:
+	static const int kBuckets = 28; // up to about 67 s, then the open one
+
+	struct Counts
+	{
+		std::array<int64_t, kBuckets> buckets = {};
+		int64_t count = 0;
+		int64_t sumMicros = 0;
+
+		void add(const Counts& other)
+		{
+			for (int i = 0; i < kBuckets; ++i)
+				buckets[i] += other.buckets[i];
+
+			count += other.count;
+			sumMicros += other.sumMicros;
+		}
+	};
+
+	// in seconds, the bucket i holds the values below it
+	static double upperBound(int i)
+	{
+		return i + 1 < kBuckets ? ldexp(1e-6, i) : HUGE_VAL;
+	}
+
+	void record(double seconds)
+	{
+		int64_t micros = (int64_t)(std::max(seconds, 0.0) * 1e6);
+		int i = 0;
+		while (i + 1 < kBuckets && micros >= ((int64_t)1 << i))
+			++i;
+
+		m_buckets[i].fetch_add(1, std::memory_order_relaxed);
+		m_count.fetch_add(1, std::memory_order_relaxed);
+		m_sumMicros.fetch_add(micros, std::memory_order_relaxed);
+	}
+
+	// not a consistent cut while recording goes on, close enough
+	Counts counts() const
+	{
+		Counts c;
+		for (int i = 0; i < kBuckets; ++i)
+			c.buckets[i] = m_buckets[i].load(std::memory_order_relaxed);
+
+		c.count = m_count.load(std::memory_order_relaxed);
+		c.sumMicros = m_sumMicros.load(std::memory_order_relaxed);
+		return c;
+	}
+
+private:
+	std::array<std::atomic_int64_t, kBuckets> m_buckets = {};
+	std::atomic_int64_t m_count = 0;
+	std::atomic_int64_t m_sumMicros = 0;
+};
+
+END_NAMESPACE_MCD
@@ -0,0 +1,57 @@
+#pragma once
+
+// The handful of Win32 names used below network/ and engine/, so that
+// the download engine builds unchanged on Linux. The GUI is Windows only.
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <cerrno>
+#include <csignal>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+typedef uint8_t BYTE;
+typedef uint16_t WORD;
+typedef uint32_t DWORD;
+typedef int BOOL;
+
+#define TRUE 1
+#define FALSE 0
+
+struct RECT
+{
+	long left;
+	long top;
+	long right;
+	long bottom;
+};
+
+#define UNREFERENCED_PARAMETER(p) ((void)(p))
+#define ARRAYSIZE(a) (sizeof(a) / sizeof((a)[0]))
+
+inline DWORD GetLastError()
+{
+	return (DWORD)errno;
+}
+
+inline DWORD GetCurrentThreadId()
+{
+	return (DWORD)syscall(SYS_gettid);
+}
+
+inline void DebugBreak()
+{
+	raise(SIGTRAP);
+}
+
+inline void OutputDebugStringA(const char* str)
+{
+	fputs(str, stderr);
+}
+
+inline const char* PathFindFileNameA(const char* path)
+{
+	const char* name = strrchr(path, '/');
+	return name ? name + 1 : path;
+}
@@ -0,0 +1,114 @@
+#pragma once
+#include "guard.h"
+
+BEGIN_NAMESPACE_MCD
+
+// A token bucket without a bucket: a reader books the bytes it is about
+// to read on a time line running at the rate, and waits until its
+// booking comes up. Time left idle is not banked, so nothing bursts, and
+// as a read is no larger than a booking, readers sharing a limiter take
+// turns and get even shares. A limiter may have a parent, e.g. the one
+// of a download under a global one, and both must agree.
+class RateLimiter
+{
+public:
+	typedef std::chrono::steady_clock Clock;
+
+	// reads are cut to what passes in this much time, for smooth pacing
+	static constexpr double kPace = 0.05;
+	static constexpr size_t kMinChunk = KB(1);
+
+	RateLimiter(RateLimiter* parent = nullptr) : m_parent(parent) {}
+	RateLimiter(const RateLimiter&) = delete;
+	RateLimiter& operator =(const RateLimiter&) = delete;
+
+	// before the limiter is used
+	void setParent(RateLimiter* parent)
+	{
+		m_parent = parent;
+	}
+
+	// bytes per second, 0 lifts the limit; may be called any time
+	void setRate(int64_t rate)
+	{
+		Guard::Mutex lock(&m_mutex);
+		m_rate = std::max<int64_t>(rate, 0);
+		m_next = Clock::now(); // the old bookings no longer count
+	}
+
+	int64_t rate() const
+	{
+		Guard::Mutex lock(&m_mutex);
+		return m_rate;
+	}
+
+	// how much a read should ask for
+	size_t chunkSize(size_t wanted) const
+	{
+		size_t chunk = wanted;
+		int64_t rate = this->rate();
+		if (rate > 0) {
+			size_t paced = (size_t)(rate * kPace);
+			chunk = std::min(chunk, std::max(paced, kMinChunk));
+		}
+
+		return m_parent ? m_parent->chunkSize(chunk) : chunk;
+	}
+
+	// books `size` bytes to read, returns the seconds to wait first
+	double reserve(size_t size)
+	{
+		auto now = Clock::now();
+		auto until = reserve(size, now);
+		return std::chrono::duration<double>(until - now).count();
+	}
+
+	// gives back the part of a booking the read did not fill
+	void release(size_t size)
+	{
+		{
+			Guard::Mutex lock(&m_mutex);
+			if (m_rate > 0) {
+				m_next -= toDuration(size);
+				m_next = std::max(m_next, Clock::now());
+			}
+		}
+
+		if (m_parent)
+			m_parent->release(size);
+	}
+
+private:
+	// the bytes pass at the later of the two bookings, so the parent
+	// books them no earlier than this limiter lets them through
+	Clock::time_point reserve(size_t size, Clock::time_point notBefore)
+	{
+		Clock::time_point until = notBefore;
+		{
+			Guard::Mutex lock(&m_mutex);
+			if (m_rate > 0) {
+				if (m_next < notBefore)
+					m_next = notBefore;
+
+				until = m_next;
+				m_next += toDuration(size);
+			}
+		}
+
+		return m_parent ? m_parent->reserve(size, until) : until;
+	}
+
+	// requires m_mutex
+	Clock::duration toDuration(size_t size) const
+	{
+		return std::chrono::duration_cast<Clock::duration>(
+			std::chrono::duration<double>((double)size / m_rate));
+	}
+
+	RateLimiter* m_parent;
+	int64_t m_rate = 0;
+	Clock::time_point m_next;
+	mutable std::mutex m_mutex;
+};
+
+END_NAMESPACE_MCD
@@ -49,18 +49,14 @@ public:
 	static Result ioError() { return make(6); }
 };
 
-class FeatureError {
-	static Result make(int code) { return { "feature", code }; }
-
-public:
-	static Result httpBodyOver2GB() { return make(1); }
-};
-
 class RequireError {
 	static Result make(int code) { return { "require", code }; }
 
 public:
 	static Result httpSupportRange() { return make(1); }
+	static Result diskSpace() { return make(2); }
+	static Result digestMismatch() { return make(3); }
+	static Result targetExists() { return make(4); }
 };
 
 
@@ -123,6 +119,11 @@ public:
 		return push_var(data, true);
 	}
 
+	VarDumper& operator <<(std::string_view data)
+	{
+		return push_var(std::string(data), true);
+	}
+
 	VarDumper& operator <<(bool data)
 	{
 		return push_var(data ? "true" : "false");
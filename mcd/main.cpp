@@ -2,6 +2,7 @@
 
 #pragma comment(lib, "winhttp")
 #pragma comment(lib, "shlwapi")
+#pragma comment(lib, "bcrypt")
 
 #ifdef _UNICODE
 #if defined _M_IX86
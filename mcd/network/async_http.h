@@ -0,0 +1,853 @@
+#pragma once
+#include "reactor.h"
+#include "http1.h"
+#include "../infra/rate_limiter.h"
+
+BEGIN_NAMESPACE_MCD
+
+// One HTTP/1.1 connection driven by an EventLoop: connect, TLS, sending
+// and receiving never block, and the body is handed over from the read
+// buffer of the loop as it arrives. Like SocketTransport it serves one
+// GET at a time, follows redirects and keeps the connection for the
+// next request to the same origin. Everything, the listener included,
+// runs on the loop thread; the connection is destroyed there or after
+// the loop has stopped.
+class AsyncHttpConnection : public EventLoop::Handler
+{
+public:
+	class Listener : public InterfaceClass
+	{
+	public:
+		// the final response, after redirects, a failure ends the request
+		virtual Result onResponse(int statusCode, std::string_view rawHeaders) = 0;
+
+		// *enough = true drops the rest of the body
+		virtual Result onBody(const BinaryData& data, bool* enough) = 0;
+
+		// once per request, the connection is idle again and the
+		// next request may be started from here
+		virtual void onDone(Result r) = 0;
+	};
+
+	static const int kMaxRedirects = 10;
+	static const size_t kMaxHeadSize = KB(64);
+	static const size_t kMaxLineSize = KB(8);
+
+	// level-triggered, so a busy connection yields to the others
+	// after this many reads and is called again in the next round
+	static const int kReadsPerEvent = 4;
+
+	AsyncHttpConnection(EventLoop* loop, int timeoutSeconds) :
+		m_loop(loop), m_timeout(timeoutSeconds) {}
+
+	AsyncHttpConnection(const AsyncHttpConnection&) = delete;
+	AsyncHttpConnection& operator =(const AsyncHttpConnection&) = delete;
+
+	~AsyncHttpConnection()
+	{
+		if (m_ssl)
+			SSL_free(m_ssl);
+
+		if (m_fd >= 0)
+			::close(m_fd);
+	}
+
+	EventLoop* loop() const
+	{
+		return m_loop;
+	}
+
+	// reads are paced by it from then on, may be null
+	void setRateLimiter(RateLimiter* limiter)
+	{
+		m_rateLimiter = limiter;
+	}
+
+	// of the current request, once it has a response
+	const ConnTimings& timings() const
+	{
+		return m_timings;
+	}
+
+	void request(const StringParser::HttpUrl& url,
+		const RequestHeaders& headers, Listener* listener)
+	{
+		assert(m_loop->inLoop() && !m_listener);
+		m_listener = listener;
+		m_url = url;
+		m_headers = headers;
+		m_redirects = 0;
+
+		m_lastActive = Clock::now();
+		m_timer = m_loop->after(m_timeout, [this]() {
+			checkTimeout();
+		});
+
+		Result r = begin();
+		if (r.failed())
+			fail(r);
+	}
+
+	// drops the connection, a pending request ends without onDone()
+	void close()
+	{
+		assert(m_loop->inLoop());
+		closeSocket();
+		cancelTimer();
+		m_state = State::Idle;
+		m_listener = nullptr;
+	}
+
+	void onEvents(uint32_t events) override
+	{
+		UNUSED(events);
+		m_lastActive = Clock::now();
+
+		Result r = handleEvents();
+		if (r.failed())
+			fail(r);
+	}
+
+private:
+	typedef std::chrono::steady_clock Clock;
+	typedef http1::Framing Framing;
+
+	enum class State {
+		Idle,
+		Resolving,
+		Connecting,
+		Handshaking,
+		Sending,
+		ReadingHead,
+		ReadingBody
+	};
+
+	enum class ChunkState {
+		Size, // "1a2b;ext"
+		DataEnd, // the CRLF after the data
+		Trailer // until an empty line
+	};
+
+	static Result socketResult(int err)
+	{
+		return Result(resultSpace(), err);
+	}
+
+	Result handleEvents()
+	{
+		switch (m_state) {
+		case State::Idle:
+			// the server closed a kept-alive connection
+			closeSocket();
+			return {};
+		case State::Resolving:
+			return onResolved();
+		case State::Connecting:
+			return onConnectable();
+		case State::Handshaking:
+			return handshake();
+		case State::Sending:
+			return sendRequest();
+		default:
+			return receive();
+		}
+	}
+
+	Result begin()
+	{
+		m_output = http1::requestHead(m_url, "GET", m_headers, false);
+		m_outputPos = 0;
+		m_responseStarted = false;
+		m_redirectTo = StringParser::HttpUrl();
+
+		m_timings = {};
+		m_reused = reusable();
+		if (m_reused)
+			return startSending();
+
+		return connect();
+	}
+
+	bool reusable() const
+	{
+		return m_fd >= 0 && m_keepAlive && m_bodyDone
+			&& m_url.sameOrigin(m_origin);
+	}
+
+	Result connect()
+	{
+		m_stepStart = Clock::now();
+		closeSocket();
+		m_addresses.clear();
+		_call(AddressCache::lookup(std::string(m_url.host()),
+			m_url.port(), &m_addresses, &m_lookup));
+
+		if (m_lookup) {
+			m_state = State::Resolving;
+			return m_loop->watch(m_lookup->fd.get(),
+				EPOLLIN, this, &m_lookupWatch);
+		}
+
+		m_addressIndex = 0;
+		return connectNext(ECONNREFUSED);
+	}
+
+	Result onResolved()
+	{
+		if (!m_lookup->done)
+			return {};
+
+		AddressCache::LookupPtr lookup = m_lookup;
+		stopLookup();
+		if (lookup->result.failed())
+			return lookup->result;
+
+		m_addresses = lookup->addresses;
+		m_addressIndex = 0;
+		return connectNext(ECONNREFUSED);
+	}
+
+	void stopLookup()
+	{
+		if (m_lookupWatch) {
+			m_loop->unwatch(m_lookup->fd.get(), m_lookupWatch);
+			m_lookupWatch = 0;
+		}
+
+		m_lookup.reset();
+	}
+
+	// the addresses of the host are tried in turn
+	Result connectNext(int lastError)
+	{
+		closeSocket();
+		while (m_addressIndex < m_addresses.size()) {
+			const SocketAddress& a = m_addresses[m_addressIndex++];
+			int fd = socket(a.family,
+				SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+			if (fd < 0) {
+				lastError = errno;
+				continue;
+			}
+
+			m_fd = fd;
+			int on = 1;
+			setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+
+			if (::connect(fd, (const sockaddr*)&a.addr, a.size) == 0)
+				return connected();
+
+			if (errno == EINPROGRESS) {
+				m_state = State::Connecting;
+				return watch(EPOLLOUT);
+			}
+
+			lastError = errno;
+			closeSocket();
+		}
+
+		return socketResult(lastError);
+	}
+
+	Result onConnectable()
+	{
+		int err = 0;
+		socklen_t len = sizeof(err);
+		if (getsockopt(m_fd, SOL_SOCKET, SO_ERROR, &err, &len) != 0)
+			err = errno;
+
+		if (err)
+			return connectNext(err);
+
+		return connected();
+	}
+
+	Result connected()
+	{
+		m_timings.connect = std::chrono::duration<double>(
+			Clock::now() - m_stepStart).count();
+		m_origin = m_url;
+		if (m_url.overSSL())
+			return startTls();
+
+		return startSending();
+	}
+
+	// verifies the certificate against the host, which is also sent as SNI
+	Result startTls()
+	{
+		SSL_CTX* ctx = tlsContext();
+		_must_or_return(TlsError::handshake, ctx);
+
+		m_ssl = SSL_new(ctx);
+		_must_or_return(TlsError::handshake, m_ssl);
+
+		SSL_set_fd(m_ssl, m_fd);
+		std::string host(m_url.host());
+		SSL_set_tlsext_host_name(m_ssl, host.c_str());
+		SSL_set1_host(m_ssl, host.c_str());
+		SSL_set_mode(m_ssl, SSL_MODE_ENABLE_PARTIAL_WRITE
+			| SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+
+		m_state = State::Handshaking;
+		m_stepStart = Clock::now();
+		return handshake();
+	}
+
+	Result handshake()
+	{
+		ERR_clear_error();
+		int r = SSL_connect(m_ssl);
+		if (r == 1) {
+			m_timings.tls = std::chrono::duration<double>(
+				Clock::now() - m_stepStart).count();
+			return startSending();
+		}
+
+		if (wouldBlock(r))
+			return watch(m_wants);
+
+		long verify = SSL_get_verify_result(m_ssl);
+		if (!_eval_error(verify == X509_V_OK).setContext(m_url.host(), verify))
+			return TlsError::certificate(verify);
+
+		return tlsError(r);
+	}
+
+	Result startSending()
+	{
+		m_state = State::Sending;
+		return sendRequest();
+	}
+
+	Result sendRequest()
+	{
+		while (m_outputPos < m_output.size()) {
+			size_t sent = 0;
+			bool blocked = false;
+			_call(write(m_output.data() + m_outputPos,
+				m_output.size() - m_outputPos, &sent, &blocked));
+
+			if (blocked)
+				return watch(m_wants);
+
+			m_outputPos += sent;
+		}
+
+		m_state = State::ReadingHead;
+		m_input.clear();
+		return watch(EPOLLIN);
+	}
+
+	Result receive()
+	{
+		BinaryData buffer = m_loop->buffer();
+		for (int i = 0; i < kReadsPerEvent || pending(); ++i) {
+			size_t toRead = buffer.capacity;
+			if (m_rateLimiter) {
+				if (m_booked == 0) {
+					m_booked = m_rateLimiter->chunkSize(buffer.capacity);
+					double wait = m_rateLimiter->reserve(m_booked);
+					if (wait > 0)
+						return pause(wait);
+				}
+
+				toRead = m_booked;
+			}
+
+			size_t received = 0;
+			bool blocked = false;
+			_call(read(buffer.buffer, toRead, &received, &blocked));
+
+			if (blocked)
+				return watch(m_wants);
+
+			if (received == 0)
+				return onPeerClosed();
+
+			if (m_rateLimiter)
+				m_booked -= received;
+
+			bool ended = false;
+			m_responseStarted = true;
+			_call(consume(buffer.buffer, received, &ended));
+
+			// the listener may have started the next request already
+			if (ended)
+				return {};
+		}
+
+		return {};
+	}
+
+	Result consume(const BYTE* data, size_t size, bool* ended)
+	{
+		if (m_state == State::ReadingBody)
+			return consumeBody(data, size, ended);
+
+		m_input.append((const char*)data, size);
+		size_t end = m_input.find("\r\n\r\n");
+		if (end == std::string::npos) {
+			_must_or_return(InternalError::invalidInput,
+				m_input.size() < kMaxHeadSize);
+			return {};
+		}
+
+		// the head and what follows are read in place from m_head,
+		// the two buffers trade places and keep their capacity
+		m_head.swap(m_input);
+		m_input.clear();
+		std::string_view head(m_head.data(), end + 4);
+		std::string_view rest(m_head);
+		rest.remove_prefix(end + 4);
+
+		_call(http1::parseStatusLine(head, &m_statusCode, &m_http10));
+
+		// interim responses (100 Continue, 103 Early Hints) are skipped
+		if (http1::interimStatus(m_statusCode))
+			return consume((const BYTE*)rest.data(), rest.size(), ended);
+
+		http1::BodyFraming framing("GET", m_statusCode, m_http10, head);
+		m_framing = framing.kind;
+		m_keepAlive = framing.keepAlive;
+		m_bodyLeft = framing.length;
+		m_bodyDone = framing.empty();
+		m_chunkLeft = 0;
+		m_chunkState = ChunkState::Size;
+		m_enough = false;
+		m_state = State::ReadingBody;
+
+		// the body of a redirect is read and dropped
+		m_redirectTo = redirectTarget(head);
+		if (!m_redirectTo.valid())
+			_call(m_listener->onResponse(m_statusCode, head));
+
+		if (m_bodyDone)
+			return complete(ended);
+
+		return consumeBody((const BYTE*)rest.data(), rest.size(), ended);
+	}
+
+	Result consumeBody(const BYTE* data, size_t size, bool* ended)
+	{
+		while (size && !m_bodyDone) {
+			if (m_framing == Framing::Chunked && m_chunkLeft == 0) {
+				const BYTE* lf = (const BYTE*)memchr(data, '\n', size);
+				size_t taken = lf ? lf - data + 1 : size;
+				m_input.append((const char*)data, taken);
+				data += taken;
+				size -= taken;
+
+				_must_or_return(InternalError::invalidInput,
+					m_input.size() < kMaxLineSize);
+
+				if (lf)
+					_call(chunkLine());
+
+				continue;
+			}
+
+			size_t n = size;
+			if (m_framing == Framing::Length)
+				n = (size_t)std::min<int64_t>(n, m_bodyLeft);
+			else if (m_framing == Framing::Chunked)
+				n = (size_t)std::min<int64_t>(n, m_chunkLeft);
+
+			_call(deliver(data, n));
+			data += n;
+			size -= n;
+
+			if (m_framing == Framing::Length) {
+				m_bodyLeft -= n;
+				m_bodyDone = (m_bodyLeft == 0);
+			}
+			else if (m_framing == Framing::Chunked) {
+				m_chunkLeft -= n;
+				if (m_chunkLeft == 0)
+					m_chunkState = ChunkState::DataEnd;
+			}
+
+			if (m_enough && !m_bodyDone) {
+				m_keepAlive = false;
+				return complete(ended);
+			}
+		}
+
+		// whatever follows the body is not ours, the server is confused
+		if (size)
+			m_keepAlive = false;
+
+		if (m_bodyDone)
+			return complete(ended);
+
+		return {};
+	}
+
+	Result chunkLine()
+	{
+		std::string line = m_input;
+		m_input.clear();
+		line.pop_back(); // '\n'
+		if (line.size() && line.back() == '\r')
+			line.pop_back();
+
+		if (m_chunkState == ChunkState::Size) {
+			_call(http1::parseChunkSize(line, &m_chunkLeft));
+			if (m_chunkLeft == 0)
+				m_chunkState = ChunkState::Trailer;
+		}
+		else if (m_chunkState == ChunkState::DataEnd) {
+			_must_or_return(InternalError::invalidInput, line.empty(), line);
+			m_chunkState = ChunkState::Size;
+		}
+		else if (line.empty()) {
+			m_bodyDone = true;
+		}
+
+		return {};
+	}
+
+	Result deliver(const BYTE* data, size_t size)
+	{
+		if (m_redirectTo.valid() || m_enough || size == 0)
+			return {};
+
+		BinaryData body((BYTE*)data, size);
+		body.size = size;
+		return m_listener->onBody(body, &m_enough);
+	}
+
+	// the body ends with the connection only when unframed
+	Result onPeerClosed()
+	{
+		closeSocket();
+		bool unframed = (m_state == State::ReadingBody
+			&& m_framing == Framing::UntilClose);
+		if (!_eval_error(unframed).setContext(m_bodyLeft))
+			return socketResult(ECONNRESET);
+
+		m_bodyDone = true;
+		bool ended = false;
+		return complete(&ended);
+	}
+
+	Result complete(bool* ended)
+	{
+		*ended = true;
+		if (!m_keepAlive || !m_bodyDone) {
+			closeSocket();
+		}
+		else {
+			// only to notice the server closing it
+			m_state = State::Idle;
+			_call(watch(EPOLLIN));
+		}
+
+		if (m_redirectTo.valid()) {
+			m_url = m_redirectTo;
+			++m_redirects;
+			return begin();
+		}
+
+		m_state = State::Idle;
+		cancelTimer();
+		done({});
+		return {};
+	}
+
+	// a kept-alive connection may have been closed by the server in the
+	// meantime, such a request is sent once more on a new connection
+	void fail(Result r)
+	{
+		bool resend = m_reused && !m_responseStarted
+			&& (m_state == State::Sending || m_state == State::ReadingHead);
+
+		closeSocket();
+		m_state = State::Idle;
+
+		if (resend) {
+			m_reused = false;
+			m_outputPos = 0;
+			Result again = connect();
+			if (again.ok())
+				return;
+
+			r = again;
+			closeSocket();
+			m_state = State::Idle;
+		}
+
+		cancelTimer();
+		done(r);
+	}
+
+	void done(Result r)
+	{
+		Listener* listener = m_listener;
+		m_listener = nullptr;
+		if (listener)
+			listener->onDone(r);
+	}
+
+	StringParser::HttpUrl redirectTarget(std::string_view head) const
+	{
+		if (!http1::redirectStatus(m_statusCode)
+			|| m_redirects >= kMaxRedirects)
+			return {};
+
+		std::string location(http1::headerValue(head, "Location"));
+		if (location.empty())
+			return {};
+
+		return http1::redirectUrl(m_url, location);
+	}
+
+	// the timer is set once per request and moved on when it finds
+	// the connection has been active meanwhile
+	void checkTimeout()
+	{
+		m_timer = 0;
+		double idle = std::chrono::duration<double>(
+			Clock::now() - m_lastActive).count();
+
+		if (idle < m_timeout) {
+			m_timer = m_loop->after(m_timeout - idle, [this]() {
+				checkTimeout();
+			});
+			return;
+		}
+
+		_should(false, m_url.host(), (int)m_state);
+		fail(socketResult(ETIMEDOUT));
+	}
+
+	// out of the epoll set until the limiter lets the booked read
+	// through, the socket buffer fills up and the sender slows down
+	Result pause(double seconds)
+	{
+		if (m_watch) {
+			m_loop->unwatch(m_fd, m_watch);
+			m_watch = 0;
+			m_events = 0;
+		}
+
+		// not idle, the timeout starts when the pause ends
+		m_lastActive = Clock::now() + std::chrono::duration_cast<
+			Clock::duration>(std::chrono::duration<double>(seconds));
+
+		m_pauseTimer = m_loop->after(seconds, [this]() {
+			m_pauseTimer = 0;
+			Result r = receive();
+			if (r.failed())
+				fail(r);
+		});
+
+		return {};
+	}
+
+	void cancelTimer()
+	{
+		if (m_timer) {
+			m_loop->cancel(m_timer);
+			m_timer = 0;
+		}
+	}
+
+	Result watch(uint32_t events)
+	{
+		if (m_watch == 0) {
+			_call(m_loop->watch(m_fd, events, this, &m_watch));
+		}
+		else if (events != m_events) {
+			_call(m_loop->modify(m_fd, events, m_watch));
+		}
+
+		m_events = events;
+		return {};
+	}
+
+	void closeSocket()
+	{
+		stopLookup();
+		if (m_pauseTimer) {
+			m_loop->cancel(m_pauseTimer);
+			m_pauseTimer = 0;
+		}
+
+		if (m_booked) {
+			m_rateLimiter->release(m_booked);
+			m_booked = 0;
+		}
+
+		if (m_fd < 0)
+			return;
+
+		if (m_watch) {
+			m_loop->unwatch(m_fd, m_watch);
+			m_watch = 0;
+		}
+
+		if (m_ssl) {
+			SSL_free(m_ssl);
+			m_ssl = nullptr;
+		}
+
+		::close(m_fd);
+		m_fd = -1;
+		m_events = 0;
+		m_origin = {};
+	}
+
+	// sets m_wants when the call has to wait for the socket
+	bool wouldBlock(int r)
+	{
+		int err = SSL_get_error(m_ssl, r);
+		if (err == SSL_ERROR_WANT_READ)
+			m_wants = EPOLLIN;
+		else if (err == SSL_ERROR_WANT_WRITE)
+			m_wants = EPOLLOUT;
+		else
+			return false;
+
+		return true;
+	}
+
+	bool pending() const
+	{
+		return m_ssl && SSL_pending(m_ssl) > 0;
+	}
+
+	Result read(BYTE* buffer, size_t size, size_t* received, bool* blocked)
+	{
+		*received = 0;
+		*blocked = false;
+
+		if (m_ssl) {
+			ERR_clear_error();
+			int n = SSL_read(m_ssl, buffer, (int)std::min<size_t>(size, INT_MAX));
+			if (n > 0) {
+				*received = n;
+				return {};
+			}
+
+			if (SSL_get_error(m_ssl, n) == SSL_ERROR_ZERO_RETURN)
+				return {};
+
+			*blocked = wouldBlock(n);
+			return *blocked ? Result() : tlsError(n);
+		}
+
+		for (;;) {
+			ssize_t n = ::recv(m_fd, buffer, size, 0);
+			if (n < 0 && errno == EINTR)
+				continue;
+
+			if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+				m_wants = EPOLLIN;
+				*blocked = true;
+				return {};
+			}
+
+			_must_or_return_socket_error(n >= 0);
+			*received = (size_t)n;
+			return {};
+		}
+	}
+
+	Result write(const char* data, size_t size, size_t* sent, bool* blocked)
+	{
+		*sent = 0;
+		*blocked = false;
+
+		if (m_ssl) {
+			ERR_clear_error();
+			int n = SSL_write(m_ssl, data, (int)std::min<size_t>(size, INT_MAX));
+			if (n > 0) {
+				*sent = n;
+				return {};
+			}
+
+			*blocked = wouldBlock(n);
+			return *blocked ? Result() : tlsError(n);
+		}
+
+		for (;;) {
+			ssize_t n = ::send(m_fd, data, size, MSG_NOSIGNAL);
+			if (n < 0 && errno == EINTR)
+				continue;
+
+			if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+				m_wants = EPOLLOUT;
+				*blocked = true;
+				return {};
+			}
+
+			_must_or_return_socket_error(n > 0);
+			*sent = (size_t)n;
+			return {};
+		}
+	}
+
+	Result tlsError(int r)
+	{
+		int err = errno;
+		int sslError = SSL_get_error(m_ssl, r);
+		unsigned long libError = ERR_peek_last_error();
+
+		if (sslError == SSL_ERROR_SYSCALL) {
+			_should(false, sslError, err, m_url.host());
+			return socketResult(socketError(err));
+		}
+
+		_should(false, sslError, ERR_GET_REASON(libError), m_url.host());
+		return SSL_is_init_finished(m_ssl)
+			? TlsError::protocol() : TlsError::handshake();
+	}
+
+	EventLoop* m_loop;
+	int m_timeout;
+	EventLoop::TimerId m_timer = 0;
+	Clock::time_point m_lastActive;
+	RateLimiter* m_rateLimiter = nullptr;
+	size_t m_booked = 0; // with the limiter, what is left to read
+	EventLoop::TimerId m_pauseTimer = 0;
+
+	int m_fd = -1;
+	SSL* m_ssl = nullptr;
+	EventLoop::WatchId m_watch = 0;
+	uint32_t m_events = 0;
+	uint32_t m_wants = EPOLLIN;
+	AddressCache::Addresses m_addresses;
+	size_t m_addressIndex = 0;
+	AddressCache::LookupPtr m_lookup; // while resolving
+	EventLoop::WatchId m_lookupWatch = 0;
+
+	State m_state = State::Idle;
+	Listener* m_listener = nullptr;
+	StringParser::HttpUrl m_url;
+	StringParser::HttpUrl m_redirectTo;
+	RequestHeaders m_headers;
+	int m_redirects = 0;
+	StringParser::HttpUrl m_origin;
+	bool m_reused = false;
+	bool m_responseStarted = false;
+	ConnTimings m_timings;
+	Clock::time_point m_stepStart; // of connecting or the handshake
+
+	std::string m_output;
+	size_t m_outputPos = 0;
+	std::string m_input; // the head, then chunk lines
+	std::string m_head; // of the last response, see consume()
+
+	int m_statusCode = 0;
+	bool m_http10 = false;
+	Framing m_framing = Framing::None;
+	bool m_keepAlive = false;
+	bool m_bodyDone = false;
+	bool m_enough = false;
+	int64_t m_bodyLeft = 0;
+	int64_t m_chunkLeft = 0;
+	ChunkState m_chunkState = ChunkState::Size;
+};
+
+END_NAMESPACE_MCD
@@ -1,5 +1,14 @@
 #pragma once
-#include "http_api.h"
+#include "../infra/file.h"
+#include "../infra/rate_limiter.h"
+#include "../infra/digest.h"
+#include "../infra/metrics.h"
+#include "http1.h"
+#ifdef _WIN32
+#include "winhttp_transport.h"
+#else
+#include "socket_transport.h"
+#endif
 
 #define _equal_or_return_http_error(http, code, ...) { \
 	int response = http.statusCode(); \
@@ -10,8 +19,6 @@
 
 BEGIN_NAMESPACE_MCD
 
-using namespace http_api;
-
 class HttpConfig : public IMetaViewer
 {
 public:
@@ -82,23 +89,12 @@ private:
 };
 
 
+// The head of a response as received, kept in one block, and where in
+// it each header is; looking one up compares the names in place, case
+// insensitive as RFC 7230 has them, and copies nothing.
 class HttpHeaders : public IMetaViewer
 {
 public:
-	struct HeaderValues : public IMetaViewer
-	{
-		MetaViewerFunc
-		{
-			return VarDumper()
-				<< originalKey
-				<< values
-			;
-		}
-
-		std::string originalKey;
-		std::vector<std::string> values;
-	};
-
 	class ContentLength
 	{
 	public:
@@ -126,18 +122,19 @@ public:
 		ValueType m_value = 0;
 	};
 
-	typedef std::map<std::string, HeaderValues> Headers;
-
-	Result parse(const std::string& rawHeaders)
+	// the status line and "Name: value" lines, taken over
+	Result parse(std::string rawHeaders)
 	{
-		parseRawHeader(rawHeaders);
+		m_raw = std::move(rawHeaders);
+		parseRawHeader();
 		_call(parseContentLength());
 		return {};
 	}
 
 	void clear()
 	{
-		m_headers.clear();
+		m_raw.clear();
+		m_fields.clear();
 		m_contentLength.reset();
 	}
 
@@ -146,86 +143,114 @@ public:
 		return m_contentLength;
 	}
 
-	// header names are not case sensitive (RFC-2616)
-	const HeaderValues& operator [](const std::string& key) const
+	bool has(std::string_view key) const
 	{
-		auto result = m_headers.find(toLower(key));
-		if (result == m_headers.end())
-			return m_headerNotExists;
-
-		return result->second;
+		return find(key) != m_fields.end();
 	}
 
-	bool has(const std::string& key) const
+	// of the first header of the name, empty when there is none; valid
+	// until the headers change
+	std::string_view firstValue(std::string_view key) const
 	{
-		return (*this)[key].values.size();
+		auto it = find(key);
+		return it == m_fields.end() ? std::string_view() : value(*it);
 	}
 
-	std::string firstValue(const std::string& key) const
+	// of every header of the name, in the order received
+	std::vector<std::string_view> values(std::string_view key) const
 	{
-		auto& key_ = (*this)[key];
-		if (key_.values.empty())
-			return std::string();
+		std::vector<std::string_view> result;
+		for (auto& i : m_fields) {
+			if (iEquals(name(i), key))
+				result.push_back(value(i));
+		}
 
-		return key_.values[0];
+		return result;
 	}
 
 	MetaViewerFunc
 	{
+		std::vector<std::pair<std::string_view, std::string_view>> fields;
+		for (auto& i : m_fields)
+			fields.push_back({ name(i), value(i) });
+
 		return VarDumper()
-			<< m_headers
+			<< fields
 			<< m_contentLength
 		;
 	}
 
 private:
-	void parseRawHeader(const std::string& rawHeaders)
+	// offsets into m_raw, which copies and moves leave valid
+	struct Field
+	{
+		uint32_t nameAt;
+		uint32_t nameSize;
+		uint32_t valueAt;
+		uint32_t valueSize;
+	};
+
+	typedef std::vector<Field>::const_iterator FieldIt;
+
+	std::string_view name(const Field& f) const
 	{
-		auto headerLines = split(rawHeaders, "\r\n", true);
-		if (headerLines.size())
-			headerLines[0].clear();
+		return std::string_view(m_raw).substr(f.nameAt, f.nameSize);
+	}
 
-		StringParser::KeyValue parser(": ");
-		for (auto& line : headerLines) {
-			if (line.empty())
-				continue;
+	std::string_view value(const Field& f) const
+	{
+		return std::string_view(m_raw).substr(f.valueAt, f.valueSize);
+	}
 
-			parser.parse(line);
-			addNewHeader(parser);
-		}
+	FieldIt find(std::string_view key) const
+	{
+		return std::find_if(m_fields.begin(), m_fields.end(),
+			[&](const Field& f) {
+				return iEquals(name(f), key);
+			});
 	}
 
-	void addNewHeader(const StringParser::KeyValue& parser)
+	void parseRawHeader()
 	{
-		std::string lowerKey = toLower(parser.key());
-		auto& mapKey = m_headers[lowerKey];
-		mapKey.originalKey = parser.key();
-		mapKey.values.push_back(parser.value());
+		m_fields.clear();
+		m_fields.reserve(std::count(m_raw.begin(), m_raw.end(), '\n'));
+
+		const char* raw = m_raw.data();
+		http1::scanHeaders(m_raw, [&](std::string_view n, std::string_view v) {
+			Field f;
+			f.nameAt = (uint32_t)(n.data() - raw);
+			f.nameSize = (uint32_t)n.size();
+			f.valueAt = (uint32_t)(v.data() - raw);
+			f.valueSize = (uint32_t)v.size();
+			m_fields.push_back(f);
+			return true;
+		});
 	}
 
 	Result parseContentLength()
 	{
-		auto& header = (*this)["content-length"];
-		if (!_should(header.values.size(), *this)) {
+		auto it = find("Content-Length");
+		if (!_should(it != m_fields.end(), *this)) {
 			return {};
 		}
 
 		int64_t lengthNumber = 0;
-		const std::string& length = header.values[0];
-		bool r = toNumber(length, &lengthNumber);
+		std::string_view length = value(*it);
+		auto r = std::from_chars(length.data(),
+			length.data() + length.size(), lengthNumber);
 
-		_must_or_return(InternalError::invalidInput, r, length);
 		_must_or_return(InternalError::invalidInput,
-			lengthNumber >= 0);
-		_must_or_return(FeatureError::httpBodyOver2GB,
-			lengthNumber < GB64(2), length);
+			r.ec == std::errc() && r.ptr == length.data() + length.size(),
+			length);
+		_must_or_return(InternalError::invalidInput,
+			lengthNumber >= 0, length);
 
 		m_contentLength = lengthNumber;
 		return {};
 	}
 
-	Headers m_headers;
-	HeaderValues m_headerNotExists;
+	std::string m_raw;
+	std::vector<Field> m_fields;
 	ContentLength m_contentLength;
 };
 
@@ -247,6 +272,12 @@ public:
 		return {};
 	}
 
+	// the receiver may stop accepting data before the response ends
+	virtual bool completed() const
+	{
+		return false;
+	}
+
 	SizeType sizeDone() const
 	{
 		return m_sizeDone;
@@ -301,11 +332,11 @@ public:
 		if (m_file.is_open()) {
 			if (!reuse) {
 				m_file.close();
-				m_file.open(path, std::ios::binary);
+				m_file.open(nativePath(path), std::ios::binary);
 			}
 		}
 		else {
-			m_file.open(path, std::ios::binary);
+			m_file.open(nativePath(path), std::ios::binary);
 		}
 
 		m_file.seekp(pos);
@@ -328,11 +359,54 @@ private:
 class ParallelFileWriter
 {
 public:
-	Result init(ConStrRef path)
+	enum class Mode {
+		Stream, // one std::ofstream behind a lock
+		Positional, // concurrent writes at explicit offsets
+		Mapped // copies into mapped views of the file
+	};
+
+	struct Options
 	{
-		m_file.open(path, std::ios::binary);
-		_must_or_return(InternalError::ioError, m_file.good());
-		return {};
+		Mode mode = Mode::Positional;
+
+		// mapped mode only, at most maxWindows * windowSize is mapped
+		size_t mapWindowSize = MB(16);
+		size_t mapMaxWindows = sizeof(void*) > 4 ? 64 : 16;
+
+		// chunks queued for a write-behind thread, 0 writes inline
+		size_t writeBehindChunks = 0;
+		size_t writeBehindChunkSize = MB(1);
+
+		// the file is not preallocated, see preallocateFile()
+		bool sparse = false;
+	};
+
+	// the file is preallocated to `size` before any worker starts,
+	// the existing content is kept when resuming a partial download
+	Result init(ConStrRef path, int64_t size,
+		bool resume, const Options& options)
+	{
+		_call(preallocateFile(path, size, resume, options.sparse));
+
+		std::unique_ptr<FileBackend> backend;
+		if (options.mode == Mode::Stream) {
+			backend.reset(new StreamFileBackend());
+		}
+		else if (options.mode == Mode::Mapped) {
+			backend.reset(new MappedFileBackend(size,
+				options.mapWindowSize, options.mapMaxWindows));
+		}
+		else {
+			backend.reset(new PositionalFileBackend());
+		}
+
+		if (options.writeBehindChunks) {
+			backend.reset(new WriteBehindBackend(std::move(backend),
+				options.writeBehindChunkSize, options.writeBehindChunks));
+		}
+
+		m_backend = std::move(backend);
+		return m_backend->open(path, true);
 	}
 
 	void abort()
@@ -340,108 +414,439 @@ public:
 		m_aborted = true;
 	}
 
+	// every write goes through it on its way, before the first one
+	void hashWith(TreeHash* hash)
+	{
+		m_hash = hash;
+	}
+
+	Result flush()
+	{
+		_must(m_backend);
+		return m_backend->flush();
+	}
+
+	// on the disk and not only with the OS, see FileBackend::sync()
+	Result sync()
+	{
+		_must(m_backend);
+		return m_backend->sync();
+	}
+
 	Result write(const BinaryData& data, int64_t pos)
 	{
 		if (m_aborted)
 			return InternalError::forceAbort();
 
-		Guard::Mutex lock(&m_mutex);
-		m_file.seekp(pos);
-		m_file.write((char*)data.buffer, data.size);
-		_must(m_file.good());
-		_must_or_return(InternalError::ioError, m_file.good());
+		auto start = std::chrono::steady_clock::now();
+		_call(m_backend->write(data.buffer, data.size, pos));
+		m_writeLatency.record(std::chrono::duration<double>(
+			std::chrono::steady_clock::now() - start).count());
+
+		if (m_hash)
+			m_hash->update(data.buffer, data.size, pos);
+
 		return {};
 	}
 
+	// of the backend, a write behind is timed to its queue
+	const LatencyHistogram& writeLatency() const
+	{
+		return m_writeLatency;
+	}
+
 private:
-	bool m_aborted = false;
-	std::mutex m_mutex;
-	std::ofstream m_file;
+	std::atomic_bool m_aborted = false;
+	LatencyHistogram m_writeLatency;
+	std::unique_ptr<FileBackend> m_backend;
+	TreeHash* m_hash = nullptr;
 };
 
 class HttpProxyWriter : public HttpResponseBase
 {
 public:
+	typedef Range<int64_t> Span; // [a, b)
+	typedef std::function<void()> LostFn;
+
+	// Several requests for the same bytes, each byte is written by the
+	// one delivering it first. The writers still in the race when it is
+	// won are told through their LostFn.
+	struct Race
+	{
+		std::mutex mutex;
+		int64_t pos = 0; // written by one or another up to here
+		int64_t end = 0;
+		std::vector<HttpProxyWriter*> writers;
+	};
+
+	typedef std::shared_ptr<Race> RacePtr;
+
 	HttpProxyWriter(ParallelFileWriter* writer) :
 		m_writer(writer) {}
 
-	void init(int64_t pos)
+	// called when the rest of the range has gone to another request,
+	// won by it in a race or given back, from the thread that took it
+	// and after its locks are let go; not once this writer has been
+	// given another range, save for a call already under way
+	void onLost(LostFn fn)
 	{
-		m_pos = pos;
+		m_lost = fn;
+	}
+
+	// joins `race` if any, the range is the rest of it
+	void init(Span range, RacePtr race = {})
+	{
+		Guard::Mutex lock(&m_mutex);
+		leaveRace();
+		++m_generation;
+		m_pos = range.first;
+		m_end = range.second;
+
+		if (race) {
+			Guard::Mutex raceLock(&race->mutex);
+			race->writers.push_back(this);
+			m_race = race;
+		}
+	}
+
+	// opens the rest of the range to another request
+	RacePtr startRace(Span* rest)
+	{
+		Guard::Mutex lock(&m_mutex);
+		if (m_race || m_pos >= m_end)
+			return {};
+
+		RacePtr race(new Race());
+		race->pos = m_pos;
+		race->end = m_end;
+		race->writers.push_back(this);
+		m_race = race;
+		*rest = Span(m_pos, m_end);
+		return race;
+	}
+
+	bool racing() const
+	{
+		Guard::Mutex lock(&m_mutex);
+		return m_race != nullptr;
+	}
+
+	// skips what the race has written meanwhile, short of the last
+	// byte so that there is still a range to ask for
+	void catchUp()
+	{
+		Guard::Mutex lock(&m_mutex);
+		if (!m_race)
+			return;
+
+		Guard::Mutex raceLock(&m_race->mutex);
+		m_pos = std::max(m_pos, std::min(m_race->pos, m_end - 1));
+	}
+
+	// where the stream of the current request is, the bytes before
+	// it are written, if not always by this writer
+	int64_t pos() const
+	{
+		Guard::Mutex lock(&m_mutex);
+		return m_pos;
+	}
+
+	int64_t end() const
+	{
+		Guard::Mutex lock(&m_mutex);
+		return m_end;
+	}
+
+	// what is left to race for is nothing to split or steal
+	int64_t remaining() const
+	{
+		Guard::Mutex lock(&m_mutex);
+		return m_race ? 0 : m_end - m_pos;
+	}
+
+	// gives away the back half of the remaining range, the data
+	// beyond the new end will be dropped by the following writes
+	bool split(int64_t minSize, Span* tail)
+	{
+		Guard::Mutex lock(&m_mutex);
+		int64_t remaining = m_end - m_pos;
+		if (m_race || remaining < minSize * 2)
+			return false;
+
+		int64_t middle = m_pos + remaining / 2;
+		*tail = Span(middle, m_end);
+		m_end = middle;
+		return true;
+	}
+
+	// gives away everything not written yet, unless another
+	// writer of the race is left to write it
+	bool release(Span* tail)
+	{
+		Losses losses;
+		bool others = false;
+		{
+			Guard::Mutex lock(&m_mutex);
+			others = leaveRace();
+			if (m_pos >= m_end)
+				return false;
+
+			*tail = Span(m_pos, m_end);
+			m_end = m_pos;
+			losses.push_back(loss());
+		}
+
+		tell(losses);
+		return !others;
+	}
+
+	virtual bool completed() const override
+	{
+		Guard::Mutex lock(&m_mutex);
+		if (m_race) {
+			Guard::Mutex raceLock(&m_race->mutex);
+			return m_race->pos >= m_race->end;
+		}
+
+		return m_pos >= m_end;
+	}
+
+	// what the responses brought, written or not
+	int64_t received() const
+	{
+		return m_received;
 	}
 
 	virtual Result write(const BinaryData& data) override
+	{
+		m_received.fetch_add(data.size, std::memory_order_relaxed);
+
+		Losses losses;
+		Result r;
+		{
+			Guard::Mutex lock(&m_mutex);
+			int64_t allowed = m_end - m_pos;
+			if (allowed <= 0)
+				return {};
+
+			BinaryData head = data;
+			head.size = (size_t)std::min<int64_t>(data.size, allowed);
+			r = m_race ? writeRacing(head, &losses) : writeImpl(head);
+		}
+
+		tell(losses);
+		return r;
+	}
+
+private:
+	// a writer to be told of its loss once the locks are let go
+	struct Loss
+	{
+		const HttpProxyWriter* writer;
+		int64_t generation;
+		LostFn fn;
+	};
+
+	typedef std::vector<Loss> Losses;
+
+	Loss loss() const
+	{
+		return { this, m_generation, m_lost };
+	}
+
+	// a writer that has taken another range since is left alone
+	static void tell(const Losses& losses)
+	{
+		for (auto& i : losses) {
+			if (i.fn && i.writer->m_generation == i.generation)
+				i.fn();
+		}
+	}
+
+	Result writeImpl(const BinaryData& data)
 	{
 		_call(m_writer->write(data, m_pos));
 		m_pos += data.size;
 		return HttpResponseBase::write(data);
 	}
 
-private:
+	// requires m_mutex, only the bytes no other writer has
+	// written are written and counted
+	Result writeRacing(const BinaryData& data, Losses* losses)
+	{
+		Guard::Mutex raceLock(&m_race->mutex);
+		int64_t end = m_pos + data.size;
+		int64_t from = std::max(m_pos, m_race->pos);
+
+		if (from < end) {
+			BinaryData fresh = data;
+			fresh.buffer += from - m_pos;
+			fresh.size = (size_t)(end - from);
+			_call(m_writer->write(fresh, from));
+			HttpResponseBase::write(fresh);
+			m_race->pos = end;
+
+			if (end >= m_race->end) {
+				for (auto i : m_race->writers) {
+					if (i != this)
+						losses->push_back(i->loss());
+				}
+			}
+		}
+
+		m_pos = end;
+		return {};
+	}
+
+	// requires m_mutex, returns true when other writers are left
+	bool leaveRace()
+	{
+		if (!m_race)
+			return false;
+
+		bool others = false;
+		{
+			Guard::Mutex raceLock(&m_race->mutex);
+			auto& writers = m_race->writers;
+			writers.erase(std::remove(writers.begin(), writers.end(), this),
+				writers.end());
+
+			others = writers.size() > 0;
+		}
+
+		m_race.reset();
+		return others;
+	}
+
 	int64_t m_pos = 0;
+	int64_t m_end = 0;
+	RacePtr m_race;
+	LostFn m_lost;
+	std::atomic_int64_t m_generation = 0; // of the range, see init()
+	std::atomic_int64_t m_received = 0;
+	mutable std::mutex m_mutex;
 	ParallelFileWriter* m_writer = nullptr;
 };
 
+inline std::unique_ptr<HttpTransport> createTransport()
+{
+#ifdef _WIN32
+	return std::unique_ptr<HttpTransport>(new WinHttpTransport());
+#else
+	return std::unique_ptr<HttpTransport>(new SocketTransport());
+#endif
+}
+
 class HttpRequest : public IMetaViewer
 {
 public:
 	Result init(const HttpConfig& config = {})
 	{
+		reset();
 		m_headers = config.headers();
-		HINTERNET session;
-		_call(createSession(
-			&session,
+
+		auto transport = createTransport();
+		_call(transport->init(
 			config.httpProxy(),
 			config.connectTimeout()
 		));
 
-		_must(session);
-		m_session = session;
+		Guard::Mutex lock(&m_transportMutex);
+		m_transport = std::move(transport);
 		return {};
 	}
 
 	~HttpRequest()
+	{
+		reset();
+	}
+
+	bool initialized() const
+	{
+		return m_transport != nullptr;
+	}
+
+	// drops the transport with its pooled connections
+	void reset()
 	{
 		abortPrevious();
-		safeRelease(&m_session);
+		Guard::Mutex lock(&m_transportMutex);
+		m_transport.reset();
 	}
 
+	// may be called from any thread; the response is left to the
+	// thread of open(), which sees the transport fail
 	void abort()
 	{
-		abortPrevious();
+		Guard::Mutex lock(&m_transportMutex);
 		m_userAborted = true;
+		if (m_transport)
+			m_transport->cancel();
 	}
 
-	Result open(ConStrRef url, ConStrRef verb)
+	// successive requests to the same origin share one connection
+	Result open(ConStrRef url, ConStrRef verb,
+		const RequestHeaders& extraHeaders = {})
 	{
-		_must(m_session, url);
+		StringParser::HttpUrl url_(url);
+		_must_or_return(InternalError::invalidInput, url_.valid(), url);
+		return open(url_, verb, extraHeaders);
+	}
+
+	// for a url parsed once and requested many times
+	Result open(const StringParser::HttpUrl& url, ConStrRef verb,
+		const RequestHeaders& extraHeaders = {})
+	{
+		_must(m_transport, url.host());
+		_must_or_return(InternalError::invalidInput, url.valid());
 		abortPrevious();
-		m_userAborted = false;
+		{
+			Guard::Mutex lock(&m_transportMutex);
+			m_userAborted = false;
+			m_transport->clearCancel();
+		}
 
-		HttpConnect conn;
-		_call(connect(&conn, m_session,
-			m_headers, url, verb));
+		RequestHeaders headers(m_headers);
+		headers.insert(headers.end(),
+			extraHeaders.begin(), extraHeaders.end());
 
-		_must(conn);
-		m_connect = conn;
+		_call(m_transport->open(url, verb, headers));
 		return receiveResponse();
 	}
 
 	Result saveResponse(HttpResponseBase* response)
+	{
+		BYTE buffer[KB(2)];
+		BinaryData data(buffer, sizeof(buffer));
+		return saveResponse(response, &data);
+	}
+
+	// reads are paced by it from then on, may be null
+	void setRateLimiter(RateLimiter* limiter)
+	{
+		m_rateLimiter = limiter;
+	}
+
+	// a response without a length runs until the transport has no more
+	Result saveResponse(HttpResponseBase* response, BinaryData* buffer)
 	{
 		int64_t sizeReceived = 0;
-		int64_t sizeTotal = m_contentLength;
+		int64_t sizeTotal = m_contentLength.didSet()
+			? m_contentLength.get() : INT64_MAX;
 		response->setResponsedSize(m_contentLength);
 
-		BinaryData data;
+		BinaryData& data = *buffer;
 		while (sizeReceived < sizeTotal) {
-			_call(readData(m_connect, &data));
+			_call(fillBuffer(&data, sizeTotal - sizeReceived));
 
 			if (data.size == 0)
 				break;
 
 			_call(response->write(data));
 			sizeReceived += data.size;
+
+			if (response->completed())
+				break;
 		}
 
 		if (m_userAborted)
@@ -455,6 +860,12 @@ public:
 		return m_statusCode;
 	}
 
+	// of the last open()
+	ConnTimings timings() const
+	{
+		return m_transport ? m_transport->timings() : ConnTimings();
+	}
+
 	const HttpHeaders& headers() const
 	{
 		return m_responseHeaders;
@@ -466,30 +877,64 @@ private:
 		m_statusCode = 0;
 		m_responseHeaders.clear();
 		m_contentLength.reset();
+	}
+
+	// a read returns what has arrived so far, gather several reads
+	// so that the writer behind is called once per buffer
+	Result fillBuffer(BinaryData* data, int64_t sizeLeft)
+	{
+		size_t toFill = (size_t)std::min<int64_t>(data->capacity, sizeLeft);
+		if (m_rateLimiter) {
+			toFill = m_rateLimiter->chunkSize(toFill);
+			pace(toFill);
+		}
+
+		data->size = 0;
+
+		while (data->size < toFill) {
+			size_t size = 0;
+			_call(m_transport->read(data->buffer + data->size,
+				toFill - data->size, &size));
+
+			if (size == 0)
+				break;
 
-		// ERROR_INTERNET_OPERATION_CANCELLED (12017)
-		//   The operation was canceled, usually because the handle on
-		//   which the request was operating was closed before the
-		//   operation completed.
-		m_connect.release();
+			data->size += size;
+		}
+
+		if (m_rateLimiter && data->size < toFill)
+			m_rateLimiter->release(toFill - data->size);
+
+		return {};
+	}
+
+	// waits for the limiter in short naps, abort() is not kept waiting
+	void pace(size_t size)
+	{
+		double wait = m_rateLimiter->reserve(size);
+		while (wait > 0 && !m_userAborted) {
+			double nap = std::min(wait, kMaxNap);
+			sleep(nap);
+			wait -= nap;
+		}
 	}
 
 	Result receiveResponse()
 	{
 		// get status code
 		int statusCode = 0;
-		_call(queryStatusCode(m_connect, &statusCode));
+		_call(m_transport->queryStatusCode(&statusCode));
 
 		// get response headers
 		std::string rawHeaders;
-		_call(queryRawResponseHeaders(m_connect, &rawHeaders));
+		_call(m_transport->queryRawHeaders(&rawHeaders));
 
 		HttpHeaders headers;
-		_call(headers.parse(rawHeaders));
+		_call(headers.parse(std::move(rawHeaders)));
 
 		m_contentLength = headers.contentLength();
 		m_statusCode = (int)statusCode;
-		m_responseHeaders = headers;
+		m_responseHeaders = std::move(headers);
 		return {};
 	}
 
@@ -503,21 +948,30 @@ private:
 		;
 	}
 
-	bool m_userAborted = false;
+	static constexpr double kMaxNap = 0.1;
+
+	std::atomic_bool m_userAborted = false;
 	int m_statusCode;
 	HttpConfig::Headers m_headers;
 	HttpHeaders m_responseHeaders;
 	HttpHeaders::ContentLength m_contentLength;
-	HINTERNET m_session = NULL;
-	HttpConnect m_connect;
+	std::unique_ptr<HttpTransport> m_transport;
+	std::mutex m_transportMutex; // between abort() and replacing it
+	RateLimiter* m_rateLimiter = nullptr;
 };
 
 class HttpGetRequest : public HttpRequest
 {
 public:
-	Result open(ConStrRef url)
+	Result open(ConStrRef url, const RequestHeaders& extraHeaders = {})
+	{
+		return HttpRequest::open(url, "GET", extraHeaders);
+	}
+
+	Result open(const StringParser::HttpUrl& url,
+		const RequestHeaders& extraHeaders = {})
 	{
-		return HttpRequest::open(url, "GET");
+		return HttpRequest::open(url, "GET", extraHeaders);
 	}
 
 	Result save(std::string* str)
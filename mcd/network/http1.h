@@ -0,0 +1,260 @@
+#pragma once
+#include "transport.h"
+
+BEGIN_NAMESPACE_MCD
+
+// HTTP/1.1 message framing, shared by the blocking socket transport and
+// the event-driven connections of the reactor engine.
+namespace http1 {
+
+enum class Framing {
+	None,
+	Length,
+	Chunked,
+	UntilClose
+};
+
+// an IPv6 literal goes in brackets
+inline std::string hostName(const StringParser::HttpUrl& url)
+{
+	std::string host(url.host());
+	return url.ipv6() ? "[" + host + "]" : host;
+}
+
+inline std::string hostPort(const StringParser::HttpUrl& url)
+{
+	return hostName(url) + ":" + std::to_string(url.port());
+}
+
+// the port is left out when it is the default one of the scheme
+inline std::string hostHeader(const StringParser::HttpUrl& url)
+{
+	int defaultPort = url.overSSL() ? 443 : 80;
+	if (url.port() == defaultPort)
+		return hostName(url);
+
+	return hostPort(url);
+}
+
+inline std::string origin(const StringParser::HttpUrl& url)
+{
+	return std::string(url.scheme()) + "://" + hostPort(url);
+}
+
+inline std::string headerName(ConStrRef line)
+{
+	return trim(line.substr(0, line.find(':')));
+}
+
+// without the spaces and tabs around it
+inline std::string_view trimOws(std::string_view s)
+{
+	size_t first = s.find_first_not_of(" \t");
+	if (first == s.npos)
+		return s.substr(s.size());
+
+	size_t last = s.find_last_not_of(" \t");
+	return s.substr(first, last - first + 1);
+}
+
+// calls `fn(name, value)` with views into the head for each of its
+// header lines, until it returns false; the status line is skipped,
+// so is a line without a colon
+template <typename Fn>
+void scanHeaders(std::string_view rawHeaders, Fn fn)
+{
+	size_t pos = rawHeaders.find("\r\n");
+	while (pos < rawHeaders.size()) {
+		pos += 2;
+		size_t end = std::min(rawHeaders.find("\r\n", pos), rawHeaders.size());
+		std::string_view line = rawHeaders.substr(pos, end - pos);
+		pos = end;
+
+		size_t colon = line.find(':');
+		if (colon == line.npos || colon == 0)
+			continue;
+
+		if (!fn(line.substr(0, colon), trimOws(line.substr(colon + 1))))
+			return;
+	}
+}
+
+// of the first header of the name, a view into the head
+inline std::string_view headerValue(
+	std::string_view rawHeaders, std::string_view name)
+{
+	std::string_view result;
+	scanHeaders(rawHeaders, [&](std::string_view n, std::string_view v) {
+		unless (iEquals(n, name))
+			return true;
+
+		result = v;
+		return false;
+	});
+
+	return result;
+}
+
+// a header value holding the word, in any case
+inline bool hasToken(std::string_view value, std::string_view token)
+{
+	return std::search(value.begin(), value.end(), token.begin(), token.end(),
+		[](char a, char b) {
+			return tolower((BYTE)a) == tolower((BYTE)b);
+		}) != value.end();
+}
+
+// `absoluteForm` is what a proxy wants as the request target
+inline std::string requestHead(const StringParser::HttpUrl& url,
+	ConStrRef verb, const RequestHeaders& headers, bool absoluteForm)
+{
+	std::string target(url.path());
+	if (absoluteForm)
+		target = "http://" + hostPort(url) + target;
+
+	std::stringstream ss;
+	ss << verb << " " << target << " HTTP/1.1\r\n";
+
+	bool hasHost = false;
+	for (auto& i : headers)
+		hasHost |= iEquals(headerName(i), "Host");
+
+	if (!hasHost)
+		ss << "Host: " << hostHeader(url) << "\r\n";
+
+	for (auto& i : headers)
+		ss << i << "\r\n";
+
+	ss << "\r\n";
+	return ss.str();
+}
+
+// "HTTP/1.1 206 Partial Content"
+inline Result parseStatusLine(std::string_view head, int* status, bool* http10)
+{
+	std::string_view line = head.substr(0, head.find("\r\n"));
+	std::string_view version = line.substr(0, line.find(' '));
+	std::string_view rest = line.substr(version.size());
+	rest = rest.substr(std::min(rest.find_first_not_of(' '), rest.size()));
+
+	int code = 0;
+	auto parsed = std::from_chars(rest.data(), rest.data() + rest.size(), code);
+	bool valid = version.substr(0, 7) == "HTTP/1."
+		&& parsed.ec == std::errc() && parsed.ptr != rest.data()
+		&& (parsed.ptr == rest.data() + rest.size() || *parsed.ptr == ' ');
+	_must_or_return(InternalError::invalidInput, valid, line);
+
+	*http10 = (version == "HTTP/1.0");
+	*status = code;
+	return {};
+}
+
+inline bool interimStatus(int status)
+{
+	return inRange(status, 100, 200) && status != 101;
+}
+
+inline bool redirectStatus(int status)
+{
+	return inArray(status, { 301, 302, 303, 307, 308 });
+}
+
+inline StringParser::HttpUrl resolve(
+	const StringParser::HttpUrl& base, ConStrRef location)
+{
+	if (location.find("://") != std::string::npos)
+		return StringParser::HttpUrl(location);
+
+	std::string path = location;
+	if (path.empty() || path[0] != '/') {
+		std::string_view dir = base.path().substr(0, base.path().find('?'));
+		path = std::string(dir.substr(0, dir.rfind('/') + 1)) + path;
+	}
+
+	return StringParser::HttpUrl(origin(base) + path);
+}
+
+// where a redirect from `base` leads, an invalid url when it is not
+// to be followed: https is never left for plain http
+inline StringParser::HttpUrl redirectUrl(
+	const StringParser::HttpUrl& base, ConStrRef location)
+{
+	StringParser::HttpUrl next = resolve(base, location);
+	if (!next.valid() || (base.overSSL() && !next.overSSL()))
+		return {};
+
+	return next;
+}
+
+// how the body of a response ends, and whether the connection
+// can carry the next request after it
+struct BodyFraming
+{
+	BodyFraming(ConStrRef verb, int status,
+		bool http10, std::string_view rawHeaders)
+	{
+		std::string_view connection, contentLength, transferEncoding;
+		scanHeaders(rawHeaders, [&](std::string_view n, std::string_view v) {
+			if (iEquals(n, "Connection"))
+				connection = v;
+			else if (iEquals(n, "Content-Length"))
+				contentLength = v;
+			else if (iEquals(n, "Transfer-Encoding"))
+				transferEncoding = v;
+
+			return true;
+		});
+
+		keepAlive = http10
+			? hasToken(connection, "keep-alive")
+			: !hasToken(connection, "close");
+
+		bool noBody = (verb == "HEAD" || status == 204
+			|| status == 304 || status < 200);
+
+		int64_t size = -1;
+		const char* sizeEnd = contentLength.data() + contentLength.size();
+		auto parsed = std::from_chars(contentLength.data(), sizeEnd, size);
+		if (noBody) {
+			kind = Framing::None;
+		}
+		else if (hasToken(transferEncoding, "chunked")) {
+			kind = Framing::Chunked;
+		}
+		else if (parsed.ec == std::errc() && parsed.ptr == sizeEnd
+			&& size >= 0) {
+			kind = Framing::Length;
+			length = size;
+		}
+		else {
+			kind = Framing::UntilClose;
+			keepAlive = false;
+		}
+	}
+
+	bool empty() const
+	{
+		return kind == Framing::None
+			|| (kind == Framing::Length && length == 0);
+	}
+
+	Framing kind = Framing::None;
+	bool keepAlive = false;
+	int64_t length = 0;
+};
+
+// "1a2b;ext", the size line before each chunk
+inline Result parseChunkSize(ConStrRef line, int64_t* size)
+{
+	std::string hex = trim(line.substr(0, line.find(';')));
+	char* end = nullptr;
+	*size = strtoll(hex.c_str(), &end, 16);
+	_must_or_return(InternalError::invalidInput,
+		hex.size() && *end == '\0' && *size >= 0, line);
+
+	return {};
+}
+
+} // namespace http1
+
+END_NAMESPACE_MCD
@@ -16,6 +16,21 @@ inline const char* resultSpace()
 	return "winhttp";
 }
 
+inline bool cannotConnect(const Result& r)
+{
+	return r.space() == resultSpace()
+		&& r.code() == ERROR_WINHTTP_CANNOT_CONNECT;
+}
+
+// worth another try after a while
+inline bool transientError(const Result& r)
+{
+	return r.space() == resultSpace() && inArray(r.code(), {
+		ERROR_WINHTTP_TIMEOUT,
+		ERROR_WINHTTP_CANNOT_CONNECT
+	});
+}
+
 typedef std::vector<std::string> RequestHeaders;
 
 inline void safeRelease(HINTERNET* handle)
@@ -70,7 +85,18 @@ public:
 	operator bool() const { return m_connect && m_request; }
 	HINTERNET conn() const { return m_connect; }
 	HINTERNET req() const { return m_request; }
-	
+
+	void setRequest(HINTERNET req)
+	{
+		safeRelease(&m_request);
+		m_request = req;
+	}
+
+	void releaseRequest()
+	{
+		safeRelease(&m_request);
+	}
+
 	void release()
 	{
 		safeRelease(&m_connect);
@@ -133,32 +159,44 @@ inline Result addRequestHeaders(
 	return {};
 }
 
+// the connection handle can be kept for successive requests to the
+// same server, WinHTTP then reuses its keep-alive sockets
 inline Result connect
 (
-	HttpConnect *result,
+	HINTERNET* result,
 	HINTERNET session,
-	const RequestHeaders& headers,
-	ConStrRef url,
-	ConStrRef verb = "GET"
+	const StringParser::HttpUrl& url
 )
 {
-	_must(session, verb, url);
+	_must(session, url.host());
 
-	StringParser::HttpUrl url_(url);
-	_must_or_return(InternalError::invalidInput, url_.valid(), url);
+	HINTERNET connect = WinHttpConnect(session,
+		u8to16(std::string(url.host())), (WORD)url.port(), NULL);
+	_must_or_return_winhttp_error(connect, url.host());
+
+	*result = connect;
+	return {};
+}
 
-	Guard::WinHttp connect = WinHttpConnect(session,
-		u8to16(url_.host()), (WORD)url_.port(), NULL);
-	_must_or_return_winhttp_error(connect.get(), url);
+inline Result request
+(
+	HINTERNET* result,
+	HINTERNET connect,
+	const RequestHeaders& headers,
+	const StringParser::HttpUrl& url,
+	ConStrRef verb = "GET"
+)
+{
+	_must(connect, verb, url.path());
 
 	Guard::WinHttp request = openRequest(
-		connect.get(), verb, url_.path(), url_.overSSL());
-	_must_or_return_winhttp_error(request.get(), url);
+		connect, verb, std::string(url.path()), url.overSSL());
+	_must_or_return_winhttp_error(request.get(), url.path());
 
 	_call(addRequestHeaders(request.get(), headers));
 	_call(sendRequest(request.get()));
 
-	*result = HttpConnect(connect.release(), request.release());
+	*result = request.release();
 	return {};
 }
 
@@ -216,10 +254,10 @@ inline Result queryRawResponseHeaders(
 	return {};
 }
 
-inline Result readData(const HttpConnect& conn, BinaryData* data)
+inline Result readData(const HttpConnect& conn,
+	BYTE* buffer, DWORD toRead, DWORD* size)
 {
-	Bool r = WinHttpReadData(conn.req(),
-		data->buffer, data->kBufferSize, &data->size);
+	Bool r = WinHttpReadData(conn.req(), buffer, toRead, size);
 	_must_or_return_winhttp_error(r);
 	return {};
 }
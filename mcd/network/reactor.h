@@ -0,0 +1,312 @@
+#pragma once
+#include "transport.h"
+
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
+
+BEGIN_NAMESPACE_MCD
+
+// One thread waiting on an epoll set. Handlers, timers and posted tasks
+// all run on that thread, so what a handler owns needs no locking as
+// long as other threads only reach it through post().
+class EventLoop
+{
+public:
+	typedef std::function<void()> Task;
+	typedef std::chrono::steady_clock Clock;
+	typedef uint64_t TimerId;
+	typedef uint64_t WatchId;
+
+	class Handler : public InterfaceClass
+	{
+	public:
+		// EPOLLIN, EPOLLOUT, EPOLLERR, EPOLLHUP
+		virtual void onEvents(uint32_t events) = 0;
+	};
+
+	static const int kMaxEvents = 256;
+
+	EventLoop() {}
+	EventLoop(const EventLoop&) = delete;
+	EventLoop& operator =(const EventLoop&) = delete;
+
+	~EventLoop()
+	{
+		stop();
+	}
+
+	// `bufferSize` is the read buffer shared by the handlers of the loop
+	Result start(size_t bufferSize)
+	{
+		m_epoll.reset(epoll_create1(EPOLL_CLOEXEC));
+		_must_or_return_socket_error(m_epoll);
+
+		m_wakeup.reset(eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK));
+		_must_or_return_socket_error(m_wakeup);
+
+		epoll_event ev = {};
+		ev.events = EPOLLIN;
+		ev.data.u64 = 0;
+		_must_or_return_socket_error(
+			epoll_ctl(m_epoll.get(), EPOLL_CTL_ADD, m_wakeup.get(), &ev) == 0);
+
+		m_buffer.reset(new BYTE[bufferSize]);
+		m_bufferSize = bufferSize;
+		m_thread = std::thread(std::bind(&EventLoop::run, this));
+		return {};
+	}
+
+	// tasks still queued are dropped
+	void stop()
+	{
+		if (!m_thread.joinable())
+			return;
+
+		m_stopping = true;
+		wakeup();
+		m_thread.join();
+	}
+
+	// may be called from any thread
+	void post(Task task)
+	{
+		{
+			Guard::Mutex lock(&m_postedMutex);
+			m_posted.push_back(std::move(task));
+		}
+
+		wakeup();
+	}
+
+	bool inLoop() const
+	{
+		return std::this_thread::get_id() == m_thread.get_id();
+	}
+
+	// the rest is for the loop thread only
+
+	// events of a watch removed meanwhile are not delivered, even
+	// when the descriptor number has been reused
+	Result watch(int fd, uint32_t events, Handler* handler, WatchId* id)
+	{
+		assert(inLoop());
+		WatchId id_ = ++m_lastWatchId;
+
+		epoll_event ev = {};
+		ev.events = events;
+		ev.data.u64 = id_;
+		_must_or_return_socket_error(
+			epoll_ctl(m_epoll.get(), EPOLL_CTL_ADD, fd, &ev) == 0);
+
+		m_handlers[id_] = handler;
+		*id = id_;
+		return {};
+	}
+
+	Result modify(int fd, uint32_t events, WatchId id)
+	{
+		assert(inLoop());
+		epoll_event ev = {};
+		ev.events = events;
+		ev.data.u64 = id;
+		_must_or_return_socket_error(
+			epoll_ctl(m_epoll.get(), EPOLL_CTL_MOD, fd, &ev) == 0);
+
+		return {};
+	}
+
+	// before the descriptor is closed
+	void unwatch(int fd, WatchId id)
+	{
+		assert(inLoop());
+		epoll_ctl(m_epoll.get(), EPOLL_CTL_DEL, fd, nullptr);
+		m_handlers.erase(id);
+	}
+
+	TimerId after(double seconds, Task task)
+	{
+		assert(inLoop());
+		auto when = Clock::now() + std::chrono::microseconds(
+			(int64_t)(seconds * 1000000));
+
+		TimerId id = ++m_lastTimerId;
+		m_timers[{when, id}] = std::move(task);
+		m_timerIds[id] = when;
+		return id;
+	}
+
+	void cancel(TimerId id)
+	{
+		assert(inLoop());
+		auto it = m_timerIds.find(id);
+		if (it == m_timerIds.end())
+			return;
+
+		m_timers.erase({it->second, id});
+		m_timerIds.erase(it);
+	}
+
+	// valid until the handler returns
+	BinaryData buffer()
+	{
+		assert(inLoop());
+		return BinaryData(m_buffer.get(), m_bufferSize);
+	}
+
+private:
+	typedef std::pair<Clock::time_point, TimerId> TimerKey;
+
+	void wakeup()
+	{
+		uint64_t one = 1;
+		ssize_t r = ::write(m_wakeup.get(), &one, sizeof(one));
+		UNUSED(r); // the counter is already set when it fails
+	}
+
+	void run()
+	{
+		epoll_event events[kMaxEvents];
+		while (!m_stopping) {
+			int n = epoll_wait(m_epoll.get(),
+				events, kMaxEvents, nextTimeout());
+			if (n < 0 && errno != EINTR) {
+				_should(false, GetLastError());
+				return;
+			}
+
+			for (int i = 0; i < n; ++i) {
+				WatchId id = events[i].data.u64;
+				if (id == 0) {
+					uint64_t value = 0;
+					ssize_t r = ::read(m_wakeup.get(), &value, sizeof(value));
+					UNUSED(r);
+					continue;
+				}
+
+				// a previous handler of this round may have removed it
+				auto it = m_handlers.find(id);
+				if (it != m_handlers.end())
+					it->second->onEvents(events[i].events);
+			}
+
+			runPosted();
+			runTimers();
+		}
+	}
+
+	int nextTimeout() const
+	{
+		if (m_timers.empty())
+			return -1;
+
+		auto left = m_timers.begin()->first.first - Clock::now();
+		auto ms = std::chrono::duration_cast<
+			std::chrono::milliseconds>(left).count();
+
+		// rounded up, a timer never fires early
+		return (int)std::max<int64_t>(0, ms + 1);
+	}
+
+	void runPosted()
+	{
+		std::vector<Task> posted;
+		{
+			Guard::Mutex lock(&m_postedMutex);
+			posted.swap(m_posted);
+		}
+
+		for (auto& task : posted)
+			task();
+	}
+
+	void runTimers()
+	{
+		auto now = Clock::now();
+		while (m_timers.size() && m_timers.begin()->first.first <= now) {
+			auto it = m_timers.begin();
+			Task task = std::move(it->second);
+			m_timerIds.erase(it->first.second);
+			m_timers.erase(it);
+			task();
+		}
+	}
+
+	Guard::Fd m_epoll;
+	Guard::Fd m_wakeup;
+	std::thread m_thread;
+	std::atomic_bool m_stopping = false;
+
+	std::vector<Task> m_posted;
+	std::mutex m_postedMutex;
+
+	std::map<WatchId, Handler*> m_handlers;
+	WatchId m_lastWatchId = 0;
+
+	std::map<TimerKey, Task> m_timers;
+	std::map<TimerId, Clock::time_point> m_timerIds;
+	TimerId m_lastTimerId = 0;
+
+	std::unique_ptr<BYTE[]> m_buffer;
+	size_t m_bufferSize = 0;
+};
+
+// A small fixed set of event loops, the connections are spread over
+// them round-robin. Thousands of connections need as many descriptors,
+// so the soft limit is raised to the hard one.
+class Reactor
+{
+public:
+	static constexpr int kMaxLoops = 4;
+
+	static int defaultLoops()
+	{
+		int cores = (int)std::thread::hardware_concurrency();
+		return std::max(1, std::min(kMaxLoops, cores));
+	}
+
+	Result start(int loops, size_t bufferSize)
+	{
+		_must(loops > 0, loops);
+		raiseFileLimit();
+
+		for (auto i : range(loops)) {
+			UNUSED(i);
+			m_loops.emplace_back(new EventLoop());
+			_call(m_loops.back()->start(bufferSize));
+		}
+
+		return {};
+	}
+
+	void stop()
+	{
+		for (auto& i : m_loops)
+			i->stop();
+	}
+
+	EventLoop* next()
+	{
+		assert(m_loops.size());
+		size_t i = m_next++ % m_loops.size();
+		return m_loops[i].get();
+	}
+
+private:
+	static void raiseFileLimit()
+	{
+		rlimit limit = {};
+		if (getrlimit(RLIMIT_NOFILE, &limit) != 0)
+			return;
+
+		if (limit.rlim_cur < limit.rlim_max) {
+			limit.rlim_cur = limit.rlim_max;
+			setrlimit(RLIMIT_NOFILE, &limit);
+		}
+	}
+
+	Guard::PtrSet<EventLoop> m_loops;
+	std::atomic_size_t m_next = 0;
+};
+
+END_NAMESPACE_MCD
@@ -0,0 +1,587 @@
+#pragma once
+#include "../infra/guard.h"
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <sys/eventfd.h>
+#include <climits>
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#include <openssl/x509v3.h>
+
+#define _must_or_return_socket_error(result, ...) { \
+	int err = errno; \
+	if (!_eval_error(result).setContext(__VA_ARGS__)) \
+		return Result(resultSpace(), socketError(err)); \
+}
+
+BEGIN_NAMESPACE_MCD
+
+namespace http_api {
+
+// errno, or a negative getaddrinfo() code when resolving fails
+inline const char* resultSpace()
+{
+	return "socket";
+}
+
+inline const char* tlsResultSpace()
+{
+	return "tls";
+}
+
+class TlsError {
+	static Result make(int code) { return { tlsResultSpace(), code }; }
+
+public:
+	static const int kCertificateBase = 1000;
+
+	static Result handshake() { return make(1); }
+	static Result protocol() { return make(2); }
+
+	// X509_V_ERR_* above kCertificateBase
+	static Result certificate(long verify)
+	{
+		return make(kCertificateBase + (int)verify);
+	}
+};
+
+typedef std::vector<std::string> RequestHeaders;
+
+// a receive timeout shows up as EAGAIN on a blocking socket
+inline int socketError(int err)
+{
+	if (err == EAGAIN || err == EWOULDBLOCK)
+		return ETIMEDOUT;
+
+	return err ? err : ECONNRESET;
+}
+
+inline bool cannotConnect(const Result& r)
+{
+	return r.space() == resultSpace() && inArray(r.code(), {
+		ECONNREFUSED,
+		EHOSTUNREACH,
+		ENETUNREACH
+	});
+}
+
+// worth another try after a while
+inline bool transientError(const Result& r)
+{
+	return cannotConnect(r) || (r.space() == resultSpace()
+		&& inArray(r.code(), {
+			ETIMEDOUT,
+			ECONNRESET,
+			ECONNABORTED,
+			EPIPE,
+			EAI_AGAIN
+		}));
+}
+
+inline std::string errorString(const Result& r)
+{
+	if (r.space() == resultSpace())
+		return r.code() < 0 ? gai_strerror(r.code()) : strerror(r.code());
+
+	if (r.space() == tlsResultSpace()) {
+		if (r.code() > TlsError::kCertificateBase) {
+			return X509_verify_cert_error_string(
+				r.code() - TlsError::kCertificateBase);
+		}
+
+		return r.is(TlsError::handshake)
+			? "TLS handshake failed" : "TLS protocol error";
+	}
+
+	return {};
+}
+
+inline SSL_CTX* createTlsContext()
+{
+	SSL_CTX* ctx = SSL_CTX_new(TLS_client_method());
+	if (!ctx)
+		return nullptr;
+
+	SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+	SSL_CTX_set_default_verify_paths(ctx);
+	SSL_CTX_set_verify(ctx, SSL_VERIFY_PEER, NULL);
+#ifdef SSL_OP_IGNORE_UNEXPECTED_EOF
+	// servers closing without close_notify end the body like a FIN
+	SSL_CTX_set_options(ctx, SSL_OP_IGNORE_UNEXPECTED_EOF);
+#endif
+	return ctx;
+}
+
+// one context for the process, it only holds the trusted roots
+inline SSL_CTX* tlsContext()
+{
+	static std::unique_ptr<SSL_CTX, void(*)(SSL_CTX*)> ctx(
+		createTlsContext(), SSL_CTX_free);
+	return ctx.get();
+}
+
+struct SocketAddress
+{
+	sockaddr_storage addr = {};
+	socklen_t size = 0;
+	int family = AF_UNSPEC;
+};
+
+// getaddrinfo() blocks and cannot be interrupted, so lookups are made
+// on a thread of their own and the answer is waited for on an eventfd:
+// by an event loop like on any other descriptor, by a blocking connect
+// along with its cancellation. A host is looked up once for every
+// connection of a download and again when the entry is a minute old;
+// connections asking for a host being looked up share the one answer.
+class AddressCache
+{
+public:
+	typedef std::vector<SocketAddress> Addresses;
+	typedef std::chrono::steady_clock Clock;
+
+	// fd turns readable once done, the rest is set by then; the
+	// resolver holds it as well, so a waiter may give up at any time
+	struct Lookup
+	{
+		Guard::Fd fd;
+		std::atomic_bool done = false;
+		Result result;
+		Addresses addresses;
+	};
+
+	typedef std::shared_ptr<Lookup> LookupPtr;
+
+	static constexpr int kMaxAgeSeconds = 60;
+
+	// answers from the cache, or sets *lookup to be waited on
+	static Result lookup(ConStrRef host, int port,
+		Addresses* addresses, LookupPtr* lookup)
+	{
+		static AddressCache cache;
+		return cache.lookupImpl(host, port, addresses, lookup);
+	}
+
+	~AddressCache()
+	{
+		{
+			Guard::Mutex lock(&m_mutex);
+			m_stopping = true;
+		}
+
+		m_condition.notify_all();
+		if (m_thread.joinable())
+			m_thread.join();
+	}
+
+private:
+	struct Entry
+	{
+		Addresses addresses;
+		Clock::time_point time;
+	};
+
+	struct Query
+	{
+		std::string host;
+		int port = 0;
+		std::vector<LookupPtr> waiters;
+	};
+
+	Result lookupImpl(ConStrRef host, int port,
+		Addresses* addresses, LookupPtr* lookup)
+	{
+		std::string key = host + ":" + std::to_string(port);
+		Guard::Mutex lock(&m_mutex);
+
+		auto it = m_entries.find(key);
+		if (it != m_entries.end() && Clock::now() - it->second.time
+			< std::chrono::seconds(kMaxAgeSeconds)) {
+			*addresses = it->second.addresses;
+			return {};
+		}
+
+		LookupPtr waiter(new Lookup());
+		waiter->fd.reset(eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK));
+		_must_or_return_socket_error(waiter->fd);
+
+		Query& query = m_queries[key];
+		if (query.waiters.empty()) {
+			query.host = host;
+			query.port = port;
+			m_queue.push(key);
+			m_condition.notify_one();
+		}
+
+		query.waiters.push_back(waiter);
+		if (!m_thread.joinable())
+			m_thread = std::thread(std::bind(&AddressCache::run, this));
+
+		*lookup = waiter;
+		return {};
+	}
+
+	void run()
+	{
+		std::unique_lock<std::mutex> lock(m_mutex);
+		for (;;) {
+			m_condition.wait(lock, [this]() {
+				return m_stopping || m_queue.size();
+			});
+
+			if (m_stopping)
+				return;
+
+			std::string key = m_queue.front();
+			m_queue.pop();
+			std::string host = m_queries[key].host;
+			int port = m_queries[key].port;
+
+			lock.unlock();
+			Entry entry;
+			Result r = resolve(host, port, &entry.addresses);
+			entry.time = Clock::now();
+			lock.lock();
+
+			if (r.ok())
+				m_entries[key] = entry;
+
+			auto waiters = std::move(m_queries[key].waiters);
+			m_queries.erase(key);
+			for (auto& i : waiters) {
+				i->result = r;
+				i->addresses = entry.addresses;
+				i->done = true;
+
+				uint64_t one = 1;
+				ssize_t n = ::write(i->fd.get(), &one, sizeof(one));
+				UNUSED(n); // the counter is already set when it fails
+			}
+		}
+	}
+
+	static Result resolve(ConStrRef host, int port, Addresses* addresses)
+	{
+		addrinfo hints = {};
+		hints.ai_family = AF_UNSPEC;
+		hints.ai_socktype = SOCK_STREAM;
+
+		addrinfo* list = nullptr;
+		int r = getaddrinfo(host.c_str(),
+			std::to_string(port).c_str(), &hints, &list);
+		if (r == EAI_SYSTEM)
+			r = socketError(errno);
+
+		if (!_eval_error(r == 0).setContext(host, r))
+			return Result(resultSpace(), r);
+
+		std::unique_ptr<addrinfo, void(*)(addrinfo*)> guard(
+			list, freeaddrinfo);
+
+		for (addrinfo* ai = list; ai; ai = ai->ai_next) {
+			SocketAddress address;
+			memcpy(&address.addr, ai->ai_addr, ai->ai_addrlen);
+			address.size = ai->ai_addrlen;
+			address.family = ai->ai_family;
+			addresses->push_back(address);
+		}
+
+		return {};
+	}
+
+	// guarded by m_mutex
+	std::map<std::string, Entry> m_entries;
+	std::map<std::string, Query> m_queries; // being looked up
+	std::queue<std::string> m_queue;
+	bool m_stopping = false;
+
+	std::thread m_thread;
+	std::mutex m_mutex;
+	std::condition_variable m_condition;
+};
+
+// A blocking TCP connection, optionally wrapped in TLS. Send and receive
+// timeouts are left to the socket options, and shutdown() from another
+// thread wakes up a call blocked on the socket, or on resolving and
+// connecting, which wait on an eventfd as well.
+class SocketStream
+{
+public:
+	SocketStream() :
+		m_wakeup(eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK)) {}
+	SocketStream(const SocketStream&) = delete;
+	SocketStream& operator =(const SocketStream&) = delete;
+
+	~SocketStream()
+	{
+		close();
+	}
+
+	bool connected() const
+	{
+		return m_fd >= 0;
+	}
+
+	// fails with ECANCELED after shutdown(), until clearCancel()
+	Result connect(ConStrRef host, int port, int timeoutSeconds)
+	{
+		close();
+		ignoreSigPipe();
+
+		AddressCache::Addresses addresses;
+		AddressCache::LookupPtr lookup;
+		_call(AddressCache::lookup(host, port, &addresses, &lookup));
+
+		if (lookup) {
+			int err = waitFor(lookup->fd.get(), POLLIN, timeoutSeconds);
+			if (err)
+				return Result(resultSpace(), err);
+
+			// set before the fd, reading it orders what it covers
+			_must(lookup->done);
+			if (lookup->result.failed())
+				return lookup->result;
+
+			addresses = lookup->addresses;
+		}
+
+		int err = ECONNREFUSED;
+		for (auto& i : addresses) {
+			err = connectTo(i, timeoutSeconds);
+			if (err == 0)
+				return {};
+
+			close();
+			if (err == ECANCELED)
+				break;
+		}
+
+		return Result(resultSpace(), err);
+	}
+
+	// verifies the certificate against `host`, which is also sent as SNI
+	Result startTls(ConStrRef host)
+	{
+		SSL_CTX* ctx = tlsContext();
+		_must_or_return(TlsError::handshake, ctx);
+
+		SSL* ssl = SSL_new(ctx);
+		_must_or_return(TlsError::handshake, ssl);
+		{
+			Guard::Mutex lock(&m_mutex);
+			m_ssl = ssl;
+		}
+
+		SSL_set_fd(ssl, m_fd);
+		SSL_set_tlsext_host_name(ssl, host.c_str());
+		SSL_set1_host(ssl, host.c_str());
+
+		ERR_clear_error();
+		if (SSL_connect(ssl) == 1)
+			return {};
+
+		long verify = SSL_get_verify_result(ssl);
+		if (!_eval_error(verify == X509_V_OK).setContext(host, verify))
+			return TlsError::certificate(verify);
+
+		return ioError(0, host);
+	}
+
+	Result send(const char* data, size_t size)
+	{
+		while (size) {
+			ssize_t n = 0;
+			if (m_ssl) {
+				ERR_clear_error();
+				n = SSL_write(m_ssl, data, (int)size);
+				if (n <= 0)
+					return ioError((int)n);
+			}
+			else {
+				n = ::send(m_fd, data, size, MSG_NOSIGNAL);
+				if (n < 0 && errno == EINTR)
+					continue;
+
+				_must_or_return_socket_error(n > 0);
+			}
+
+			data += n;
+			size -= n;
+		}
+
+		return {};
+	}
+
+	// *received is 0 when the peer has closed the connection
+	Result recv(BYTE* buffer, size_t size, size_t* received)
+	{
+		*received = 0;
+		for (;;) {
+			ssize_t n = 0;
+			if (m_ssl) {
+				ERR_clear_error();
+				int toRead = (int)std::min<size_t>(size, INT_MAX);
+				n = SSL_read(m_ssl, buffer, toRead);
+				if (n <= 0) {
+					if (SSL_get_error(m_ssl, (int)n) == SSL_ERROR_ZERO_RETURN)
+						return {};
+
+					return ioError((int)n);
+				}
+			}
+			else {
+				n = ::recv(m_fd, buffer, size, 0);
+				if (n < 0 && errno == EINTR)
+					continue;
+
+				_must_or_return_socket_error(n >= 0);
+			}
+
+			*received = (size_t)n;
+			return {};
+		}
+	}
+
+	// wakes up a blocked call, can be called from any thread; the
+	// connects that follow fail as well, until clearCancel()
+	void shutdown()
+	{
+		Guard::Mutex lock(&m_mutex);
+		m_cancelled = true;
+		uint64_t one = 1;
+		ssize_t n = ::write(m_wakeup.get(), &one, sizeof(one));
+		UNUSED(n); // the counter is already set when it fails
+
+		if (m_fd >= 0)
+			::shutdown(m_fd, SHUT_RDWR);
+	}
+
+	void clearCancel()
+	{
+		Guard::Mutex lock(&m_mutex);
+		m_cancelled = false;
+		uint64_t count = 0;
+		ssize_t n = ::read(m_wakeup.get(), &count, sizeof(count));
+		UNUSED(n); // nothing to read when it was not set
+	}
+
+	void close()
+	{
+		Guard::Mutex lock(&m_mutex);
+		if (m_ssl) {
+			SSL_free(m_ssl);
+			m_ssl = nullptr;
+		}
+
+		if (m_fd >= 0) {
+			::close(m_fd);
+			m_fd = -1;
+		}
+	}
+
+private:
+	// writing to a connection the peer has reset must not kill us
+	static void ignoreSigPipe()
+	{
+		static std::once_flag once;
+		std::call_once(once, []() {
+			signal(SIGPIPE, SIG_IGN);
+		});
+	}
+
+	// returns an errno value, 0 when `fd` is ready and ECANCELED
+	// once shutdown() has been called
+	int waitFor(int fd, short events, int timeoutSeconds)
+	{
+		pollfd pfds[] = {
+			{ fd, events, 0 },
+			{ m_wakeup.get(), POLLIN, 0 }
+		};
+
+		int r = poll(pfds, 2, timeoutSeconds * 1000);
+		if (r < 0)
+			return errno;
+		if (pfds[1].revents || m_cancelled)
+			return ECANCELED;
+		if (r == 0)
+			return ETIMEDOUT;
+
+		return 0;
+	}
+
+	// returns an errno value, 0 when connected
+	int connectTo(const SocketAddress& address, int timeoutSeconds)
+	{
+		int fd = socket(address.family,
+			SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+		if (fd < 0)
+			return errno;
+
+		{
+			// a shutdown() from now on reaches the socket
+			Guard::Mutex lock(&m_mutex);
+			m_fd = fd;
+			if (m_cancelled)
+				return ECANCELED;
+		}
+
+		if (::connect(fd, (const sockaddr*)&address.addr, address.size) != 0) {
+			if (errno != EINPROGRESS)
+				return errno;
+
+			int err = waitFor(fd, POLLOUT, timeoutSeconds);
+			if (err)
+				return err;
+
+			err = 0;
+			socklen_t len = sizeof(err);
+			if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) != 0)
+				return errno;
+			if (err)
+				return err;
+		}
+
+		fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+
+		timeval tv = {};
+		tv.tv_sec = timeoutSeconds;
+		setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+		setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+		int on = 1;
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+		return 0;
+	}
+
+	template <class... Context>
+	Result ioError(int r, Context... context)
+	{
+		int err = errno;
+		int sslError = SSL_get_error(m_ssl, r);
+		unsigned long libError = ERR_peek_last_error();
+
+		if (sslError == SSL_ERROR_SYSCALL || sslError == SSL_ERROR_WANT_READ
+			|| sslError == SSL_ERROR_WANT_WRITE) {
+			_should(false, sslError, err, context...);
+			return Result(resultSpace(), socketError(err));
+		}
+
+		_should(false, sslError, ERR_GET_REASON(libError), context...);
+		return SSL_is_init_finished(m_ssl)
+			? TlsError::protocol() : TlsError::handshake();
+	}
+
+	int m_fd = -1;
+	SSL* m_ssl = nullptr;
+	Guard::Fd m_wakeup; // readable once cancelled
+	std::atomic_bool m_cancelled = false;
+	std::mutex m_mutex;
+};
+
+} // namespace http_api
+
+END_NAMESPACE_MCD
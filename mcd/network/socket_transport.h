@@ -0,0 +1,387 @@
+#pragma once
+#include "http1.h"
+
+BEGIN_NAMESPACE_MCD
+
+// HTTP/1.1 over SocketStream. The body is framed by Content-Length, by
+// chunked transfer coding or by the end of the connection; only a body
+// read to its end leaves the connection reusable for the next request.
+class SocketTransport : public HttpTransport
+{
+public:
+	static const int kMaxRedirects = 10;
+	static const size_t kMaxHeadSize = KB(64);
+	static const size_t kRecvSize = KB(16);
+
+	Result init(ConStrRef proxy, int timeoutSeconds) override
+	{
+		m_timeout = timeoutSeconds;
+		if (proxy.empty())
+			return {};
+
+		_must_or_return(InternalError::invalidInput,
+			m_proxy.parse(proxy), proxy);
+		return {};
+	}
+
+	Result open(const StringParser::HttpUrl& url, ConStrRef verb,
+		const RequestHeaders& headers) override
+	{
+		m_timings = {};
+		StringParser::HttpUrl url_ = url;
+		for (int i = 0; ; ++i) {
+			_call(openOnce(url_, verb, headers));
+
+			std::string location;
+			unless (redirected(&location) && i < kMaxRedirects)
+				return {};
+
+			StringParser::HttpUrl next = http1::redirectUrl(url_, location);
+			if (!next.valid())
+				return {};
+
+			drainSmallBody();
+			url_ = next;
+		}
+	}
+
+	Result queryStatusCode(int* statusCode) override
+	{
+		_must(m_statusCode);
+		*statusCode = m_statusCode;
+		return {};
+	}
+
+	Result queryRawHeaders(std::string* rawHeaders) override
+	{
+		_must(m_rawHeaders.size());
+		*rawHeaders = m_rawHeaders;
+		return {};
+	}
+
+	Result read(BYTE* buffer, size_t toRead, size_t* size) override
+	{
+		*size = 0;
+		if (m_bodyDone || toRead == 0)
+			return {};
+
+		if (m_framing == Framing::Chunked && m_chunkLeft == 0) {
+			_call(nextChunk());
+			if (m_bodyDone)
+				return {};
+		}
+
+		size_t n = toRead;
+		if (m_framing == Framing::Length)
+			n = (size_t)std::min<int64_t>(n, m_bodyLeft);
+		else if (m_framing == Framing::Chunked)
+			n = (size_t)std::min<int64_t>(n, m_chunkLeft);
+
+		_call(readSome(buffer, n, size));
+		if (*size == 0) {
+			// the body ends with the connection only when unframed
+			bool unframed = (m_framing == Framing::UntilClose);
+			if (!_eval_error(unframed).setContext(m_bodyLeft))
+				return socketResult(ECONNRESET);
+
+			m_bodyDone = true;
+			return {};
+		}
+
+		if (m_framing == Framing::Length) {
+			m_bodyLeft -= *size;
+			m_bodyDone = (m_bodyLeft == 0);
+		}
+		else if (m_framing == Framing::Chunked) {
+			m_chunkLeft -= *size;
+		}
+
+		return {};
+	}
+
+	ConnTimings timings() const override
+	{
+		return m_timings;
+	}
+
+	void cancel() override
+	{
+		m_cancelled = true;
+		m_stream.shutdown();
+	}
+
+	void clearCancel() override
+	{
+		m_cancelled = false;
+		m_stream.clearCancel();
+	}
+
+private:
+	typedef http1::Framing Framing;
+
+	static Result socketResult(int err)
+	{
+		return Result(resultSpace(), err);
+	}
+
+	// a kept-alive connection may have been closed by the server in the
+	// meantime, such a request is sent once more on a new connection
+	Result openOnce(const StringParser::HttpUrl& url, ConStrRef verb,
+		const RequestHeaders& headers)
+	{
+		bool reused = reusable(url);
+		if (!reused)
+			_call(connectTo(url));
+
+		std::string request = buildRequest(url, verb, headers);
+		Result r = exchange(request, verb);
+		if (r.failed() && reused && !m_cancelled && m_rawHeaders.empty()) {
+			_call(connectTo(url));
+			r = exchange(request, verb);
+		}
+
+		if (r.failed())
+			m_stream.close();
+
+		return r;
+	}
+
+	bool reusable(const StringParser::HttpUrl& url) const
+	{
+		return m_stream.connected() && !m_cancelled && m_keepAlive
+			&& m_bodyDone && url.sameOrigin(m_origin);
+	}
+
+	Result connectTo(const StringParser::HttpUrl& url)
+	{
+		m_origin = {};
+		resetInput();
+
+		typedef std::chrono::steady_clock Clock;
+		auto start = Clock::now();
+		const StringParser::HttpUrl& peer = m_proxy.valid() ? m_proxy : url;
+		_call(m_stream.connect(std::string(peer.host()), peer.port(), m_timeout));
+		m_timings.connect = std::chrono::duration<double>(
+			Clock::now() - start).count();
+
+		if (url.overSSL()) {
+			if (m_proxy.valid())
+				_call(tunnel(url));
+
+			start = Clock::now();
+			_call(m_stream.startTls(std::string(url.host())));
+			m_timings.tls = std::chrono::duration<double>(
+				Clock::now() - start).count();
+		}
+
+		m_origin = url;
+		return {};
+	}
+
+	// https through a proxy goes in a CONNECT tunnel
+	Result tunnel(const StringParser::HttpUrl& url)
+	{
+		std::string authority = http1::hostPort(url);
+		std::string request = "CONNECT " + authority + " HTTP/1.1\r\n"
+			"Host: " + authority + "\r\n\r\n";
+
+		_call(m_stream.send(request.data(), request.size()));
+		_call(readHead());
+
+		int status = m_statusCode;
+		if (!_eval_error(inRange(status, 200, 300)).setContext(authority))
+			return Result("http", status);
+
+		m_statusCode = 0;
+		m_rawHeaders.clear();
+		return {};
+	}
+
+	std::string buildRequest(const StringParser::HttpUrl& url,
+		ConStrRef verb, const RequestHeaders& headers) const
+	{
+		// a proxy wants the absolute form, except inside a tunnel
+		bool absoluteForm = m_proxy.valid() && !url.overSSL();
+		return http1::requestHead(url, verb, headers, absoluteForm);
+	}
+
+	Result exchange(ConStrRef request, ConStrRef verb)
+	{
+		m_statusCode = 0;
+		m_rawHeaders.clear();
+		m_bodyDone = false;
+
+		_call(m_stream.send(request.data(), request.size()));
+
+		// interim responses (100 Continue, 103 Early Hints) are skipped
+		do {
+			_call(readHead());
+		} while (http1::interimStatus(m_statusCode));
+
+		setFraming(verb);
+		return {};
+	}
+
+	Result readHead()
+	{
+		size_t end = std::string::npos;
+		for (;;) {
+			end = m_input.find("\r\n\r\n", m_inputPos);
+			if (end != std::string::npos)
+				break;
+
+			_must_or_return(InternalError::invalidInput,
+				m_input.size() - m_inputPos < kMaxHeadSize);
+
+			size_t received = 0;
+			_call(fillInput(&received));
+			if (received == 0)
+				return socketResult(ECONNRESET);
+		}
+
+		m_rawHeaders.assign(m_input, m_inputPos, end + 4 - m_inputPos);
+		m_inputPos = end + 4;
+
+		_call(http1::parseStatusLine(m_rawHeaders, &m_statusCode, &m_http10));
+		return {};
+	}
+
+	void setFraming(ConStrRef verb)
+	{
+		http1::BodyFraming framing(verb, m_statusCode,
+			m_http10, m_rawHeaders);
+
+		m_framing = framing.kind;
+		m_keepAlive = framing.keepAlive;
+		m_bodyLeft = framing.length;
+		m_bodyDone = framing.empty();
+		m_chunkLeft = 0;
+		m_chunkStarted = false;
+	}
+
+	// "1a2b;ext\r\n" before each chunk, the last one is "0\r\n" followed
+	// by optional trailers and an empty line
+	Result nextChunk()
+	{
+		std::string line;
+		if (m_chunkStarted) {
+			_call(readLine(&line));
+			_must_or_return(InternalError::invalidInput, line.empty(), line);
+		}
+
+		_call(readLine(&line));
+		m_chunkStarted = true;
+
+		_call(http1::parseChunkSize(line, &m_chunkLeft));
+
+		if (m_chunkLeft > 0)
+			return {};
+
+		do {
+			_call(readLine(&line));
+		} while (line.size());
+
+		m_bodyDone = true;
+		return {};
+	}
+
+	Result readLine(std::string* line)
+	{
+		size_t end = std::string::npos;
+		for (;;) {
+			end = m_input.find("\r\n", m_inputPos);
+			if (end != std::string::npos)
+				break;
+
+			_must_or_return(InternalError::invalidInput,
+				m_input.size() - m_inputPos < KB(8));
+
+			size_t received = 0;
+			_call(fillInput(&received));
+			if (received == 0)
+				return socketResult(ECONNRESET);
+		}
+
+		*line = m_input.substr(m_inputPos, end - m_inputPos);
+		m_inputPos = end + 2;
+		return {};
+	}
+
+	// buffered bytes first, large reads go straight into the caller's buffer
+	Result readSome(BYTE* buffer, size_t size, size_t* received)
+	{
+		size_t buffered = m_input.size() - m_inputPos;
+		if (buffered == 0)
+			return m_stream.recv(buffer, size, received);
+
+		size_t n = std::min(size, buffered);
+		memcpy(buffer, m_input.data() + m_inputPos, n);
+		m_inputPos += n;
+		*received = n;
+		return {};
+	}
+
+	Result fillInput(size_t* received)
+	{
+		m_input.erase(0, m_inputPos);
+		m_inputPos = 0;
+
+		BYTE buffer[kRecvSize];
+		_call(m_stream.recv(buffer, sizeof(buffer), received));
+		m_input.append((const char*)buffer, *received);
+		return {};
+	}
+
+	void resetInput()
+	{
+		m_input.clear();
+		m_inputPos = 0;
+		m_statusCode = 0;
+		m_rawHeaders.clear();
+		m_bodyDone = false;
+	}
+
+	bool redirected(std::string* location) const
+	{
+		unless (http1::redirectStatus(m_statusCode))
+			return false;
+
+		*location = std::string(http1::headerValue(m_rawHeaders, "Location"));
+		return location->size();
+	}
+
+	// small bodies are read so that the connection can be reused
+	void drainSmallBody()
+	{
+		if (m_framing == Framing::Length && m_bodyLeft <= KB(64)) {
+			BYTE buffer[KB(4)];
+			size_t size = 0;
+			while (!m_bodyDone && read(buffer, sizeof(buffer), &size).ok()
+				&& size);
+		}
+	}
+
+	int m_timeout = 60;
+	StringParser::HttpUrl m_proxy;
+
+	SocketStream m_stream;
+	StringParser::HttpUrl m_origin;
+	std::atomic_bool m_cancelled = false;
+	ConnTimings m_timings; // of the last connection opened
+
+	std::string m_input;
+	size_t m_inputPos = 0;
+
+	int m_statusCode = 0;
+	bool m_http10 = false;
+	std::string m_rawHeaders;
+
+	Framing m_framing = Framing::None;
+	bool m_keepAlive = false;
+	bool m_bodyDone = false;
+	bool m_chunkStarted = false;
+	int64_t m_bodyLeft = 0;
+	int64_t m_chunkLeft = 0;
+};
+
+END_NAMESPACE_MCD
@@ -0,0 +1,59 @@
+#pragma once
+#ifdef _WIN32
+#include "http_api.h"
+#else
+#include "socket_api.h"
+#endif
+
+BEGIN_NAMESPACE_MCD
+
+using namespace http_api;
+
+// how long the connection a request went out on took to set up, in
+// seconds; -1 for a step that did not happen, as on a reused connection,
+// or that the transport does not tell
+struct ConnTimings
+{
+	double connect = -1;
+	double tls = -1;
+};
+
+// What HttpRequest sends its requests through: WinHTTP on Windows, plain
+// sockets (OpenSSL for https) elsewhere. A transport serves one request
+// at a time and keeps the connection for the next request to the same
+// origin. Redirects are followed the way WinHTTP does by default.
+class HttpTransport : public InterfaceClass
+{
+public:
+	// `proxy` is "host:port", empty connects directly
+	virtual Result init(ConStrRef proxy, int timeoutSeconds) = 0;
+
+	// sends the request and waits for the response headers, whatever
+	// is left of the previous response is dropped
+	virtual Result open(const StringParser::HttpUrl& url, ConStrRef verb,
+		const RequestHeaders& headers) = 0;
+
+	virtual Result queryStatusCode(int* statusCode) = 0;
+
+	// the status line and the header lines, separated by CRLF
+	virtual Result queryRawHeaders(std::string* rawHeaders) = 0;
+
+	// returns what has arrived so far, *size is 0 at the end of the body
+	virtual Result read(BYTE* buffer, size_t toRead, size_t* size) = 0;
+
+	// of the last open()
+	virtual ConnTimings timings() const
+	{
+		return {};
+	}
+
+	// may be called from any thread: a pending open() or read() fails,
+	// and the connection is not reused
+	virtual void cancel() = 0;
+
+	// as a request starts, a cancel() from then on is not lost even
+	// when it comes before the connection is made
+	virtual void clearCancel() {}
+};
+
+END_NAMESPACE_MCD
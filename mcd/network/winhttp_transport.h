@@ -0,0 +1,91 @@
+#pragma once
+#include "transport.h"
+
+BEGIN_NAMESPACE_MCD
+
+class WinHttpTransport : public HttpTransport
+{
+public:
+	~WinHttpTransport()
+	{
+		m_connect.release();
+		safeRelease(&m_session);
+	}
+
+	Result init(ConStrRef proxy, int timeoutSeconds) override
+	{
+		HINTERNET session = NULL;
+		_call(createSession(&session, proxy, timeoutSeconds));
+
+		_must(session);
+		m_session = session;
+		return {};
+	}
+
+	Result open(const StringParser::HttpUrl& url, ConStrRef verb,
+		const RequestHeaders& headers) override
+	{
+		_must(m_session, url.host());
+
+		// ERROR_INTERNET_OPERATION_CANCELLED (12017)
+		//   The operation was canceled, usually because the handle on
+		//   which the request was operating was closed before the
+		//   operation completed.
+		m_connect.releaseRequest();
+		_call(reuseConnection(url));
+
+		HINTERNET req = NULL;
+		_call(http_api::request(&req, m_connect.conn(), headers, url, verb));
+
+		m_connect.setRequest(req);
+		_must(m_connect);
+		return {};
+	}
+
+	Result queryStatusCode(int* statusCode) override
+	{
+		return http_api::queryStatusCode(m_connect, statusCode);
+	}
+
+	Result queryRawHeaders(std::string* rawHeaders) override
+	{
+		return queryRawResponseHeaders(m_connect, rawHeaders);
+	}
+
+	Result read(BYTE* buffer, size_t toRead, size_t* size) override
+	{
+		DWORD size_ = 0;
+		_call(readData(m_connect, buffer, (DWORD)toRead, &size_));
+		*size = size_;
+		return {};
+	}
+
+	// closing the handles fails the pending calls on them
+	void cancel() override
+	{
+		m_connect.release();
+	}
+
+private:
+	Result reuseConnection(const StringParser::HttpUrl& url)
+	{
+		if (m_connect.conn() && url.sameOrigin(m_origin))
+			return {};
+
+		m_connect.release();
+		m_origin = {};
+
+		HINTERNET conn = NULL;
+		_call(connect(&conn, m_session, url));
+
+		m_connect = HttpConnect(conn, NULL);
+		m_origin = url;
+		return {};
+	}
+
+	HINTERNET m_session = NULL;
+	HttpConnect m_connect;
+	StringParser::HttpUrl m_origin;
+};
+
+END_NAMESPACE_MCD
@@ -1,60 +1,9 @@
 #pragma once
 #include "control.h"
+#include "../engine/kit.h"
 
 BEGIN_NAMESPACE_MCD
 
-inline std::string errorString(DWORD code, PCWSTR module = L"")
-{
-	if (code == 0)
-		return {};
-
-	const bool fromSystem = (module[0] == '\0');
-	DWORD flag = fromSystem
-		? FORMAT_MESSAGE_FROM_SYSTEM : FORMAT_MESSAGE_FROM_HMODULE;
-
-	LPCVOID source = fromSystem ? NULL : GetModuleHandle(module);
-	if (!fromSystem && !source) {
-		assert(0);
-		return {};
-	}
-
-	flag |= FORMAT_MESSAGE_ALLOCATE_BUFFER;
-	flag |= FORMAT_MESSAGE_IGNORE_INSERTS;
-
-	PWSTR message = NULL;
-	DWORD size = FormatMessage(flag, source,
-		code, NULL, (PWSTR)&message, 0, NULL);
-
-	if (size == 0)
-		return {};
-
-	std::string result = u16to8(message);
-	LocalFree(message);
-
-	trimRight(&result);
-	if (result.size() && *result.rbegin() == '.')
-		result.pop_back();
-
-	return result;
-}
-
-inline std::string resultString(Result r)
-{
-	std::stringstream ss;
-	ss << r.space() << "." << r.code();
-
-	if (r.space() == http_api::resultSpace()) {
-		PCWSTR module = (inRange(r.code(), 12000, 13000)
-			? L"winhttp.dll" : L"");
-
-		std::string msg = errorString(r.code(), module);
-		if (msg.size())
-			ss << " (" << msg << ")";
-	}
-
-	return ss.str();
-}
-
 inline Rect curScreenRect()
 {
 	POINT cursorPos;
@@ -84,64 +33,6 @@ inline void browseToFile(ConStrRef path)
 	}
 }
 
-inline bool fileExists(ConStrRef path) {
-	struct _stat s;
-	return (_wstat(u8to16(path), &s) == 0);
-}
-
-class AbortSignal
-{
-public:
-	typedef std::function<void()> AbortFn;
-
-	class Guard
-	{
-	public:
-		Guard(AbortSignal* signal, AbortFn fn) :
-			m_signal(signal)
-		{
-			*m_signal = fn;
-		}
-
-		~Guard()
-		{
-			*m_signal = AbortFn();
-		}
-
-	private:
-		AbortSignal* m_signal;
-	};
-
-	void trigger()
-	{
-		mcd::Guard::Mutex g(&m_mutex);
-		m_didAborted = true;
-		if (m_abortFn)
-			m_abortFn();
-	}
-
-	bool didAborted() const { return m_didAborted; }
-
-	void clear()
-	{
-		m_didAborted = false;
-		m_abortFn = {};
-	}
-
-private:
-	void operator= (AbortFn fn)
-	{
-		mcd::Guard::Mutex g(&m_mutex);
-		m_abortFn = fn;
-		if (fn && m_didAborted)
-			fn();
-	}
-
-	AbortFn m_abortFn;
-	bool m_didAborted = false;
-	std::mutex m_mutex;
-};
-
 class Promise
 {
 public:
@@ -274,68 +165,6 @@ private:
 	std::thread* m_worker = nullptr;
 };
 
-inline void _formatDataSizeImpl(int64_t num, double* v, int* m, int* p)
-{
-	constexpr int kilo = 1024;
-	double& value = *v;
-	int& magnitude = *m;
-	int& precision = *p;
-
-	while (num >= (kilo * kilo)) {
-		num /= kilo;
-		++magnitude;
-	}
-
-	if (num >= kilo || !magnitude) {
-		value = (double)num / kilo;
-	}
-	else {
-		value = (double)num;
-		--magnitude;
-	}
-
-	if (value > 1000) { // 1001MB -> 1GB
-		value = 1.0;
-		precision = 0;
-		++magnitude;
-	}
-}
-
-inline void _formatDataSizeStream(int64_t num, std::stringstream* ss)
-{
-	if (num < 1000) {
-		*ss << num << "bytes";
-		return;
-	}
-
-	double value = 0;
-	int magnitude = 0;
-	int precision = 2;
-	_formatDataSizeImpl(num, &value,
-		&magnitude, &precision);
-
-	char units[] = "KMGTPEZ";
-	const int kMaxMagnitude = ARRAYSIZE(units) - 1;
-	if (magnitude > kMaxMagnitude)
-		return;
-
-	ss->precision(precision);
-	*ss << std::fixed << value;
-	*ss << units[magnitude] << "iB";
-}
-
-inline std::string formattedDataSize(int64_t num, bool toRound)
-{
-	std::stringstream ss;
-	_formatDataSizeStream(num, &ss);
-	std::string str = ss.str();
-
-	if (toRound)
-		str.resize(str.find_last_not_of("0.") + 1);
-
-	return str;
-}
-
 class UiString : public std::string
 {
 public:
@@ -352,89 +181,4 @@ public:
 
 typedef UiString _S;
 
-inline std::string safeFileNameFromUri(ConStrRef uri)
-{
-	std::string name = baseName(uri);
-
-	[](std::string* s) {
-		auto pos = s->find('?');
-		if (pos != std::string::npos)
-			s->resize(pos);
-	}(&name);
-
-	std::replace_if(name.begin(), name.end(), [](char c) {
-		return inArray(c,
-			{ '<', '>', ':', '"', '/', '\\', '|', '?', '*' });
-	}, '_');
-
-	return name;
-}
-
-template <class T>
-class Tachometer
-{
-public:
-	struct Data
-	{
-		T size = 0;
-		time_t time = 0;
-	};
-
-	static const size_t kNumTokeep = 3;
-
-	Tachometer()
-	{
-		m_preData.push(Data());
-	}
-
-	double touch(const Data& d)
-	{
-		const auto& pre = m_preData.front();
-
-		double interval = std::max(
-			0.1, (double)(d.time - pre.time));
-		double speed = (d.size - pre.size) / interval;
-
-		m_preData.push(d);
-		if (m_preData.size() > kNumTokeep)
-			m_preData.pop();
-
-		return speed;
-	}
-
-private:
-	std::queue<Data> m_preData;
-};
-
-class TimePassed
-{
-public:
-	TimePassed()
-	{
-		m_start = time(nullptr);
-	}
-
-	time_t get() const
-	{
-		return time(nullptr) - m_start;
-	}
-
-private:
-	time_t m_start;
-};
-
-inline Result parseHttpRange(ConStrRef str,
-	std::array<int64_t, 3>* result)
-{
-	std::cmatch matched;
-	std::regex rule(R"((\d+)-(\d+)/(\d+))");
-	bool valid = std::regex_search(str.c_str(), matched, rule);
-	_must_or_return(InternalError::invalidInput, valid, str);
-
-	for (int i : range(3))
-		toNumber(matched[i + 1].str(), &(*result)[i]);
-
-	return {};
-}
-
 END_NAMESPACE_MCD
@@ -0,0 +1,542 @@
+#include "../mcd/engine/download.h"
+#include "range_server.h"
+#include <stdio.h>
+
+#ifdef _WIN32
+#pragma comment(lib, "winhttp")
+#pragma comment(lib, "shlwapi")
+#pragma comment(lib, "bcrypt")
+#endif
+
+BEGIN_NAMESPACE_MCD
+
+// Downloads from a RangeServer of its own, once for every combination
+// of the connection counts, task sizes, buffer sizes, engines and file
+// writers given,
+// and writes a JSON object per run: the time from the start to the last
+// byte flushed, the CPU time of the engine alone, in all and per GB
+// received, and the peak RSS.
+//
+// With a tail, only the last bytes of the file are downloaded and the
+// rest is taken as done, as if resumed from a journal, into a sparse
+// file: a file of several TB can then be tried on a small disk, for
+// the offsets past 4 GB and 2^41 from the Content-Range to the writer.
+class Bench
+{
+public:
+	static const int kMaxConn = 100;
+	static const int kMaxReactorConn = 4000;
+	static const size_t kWriteBehindChunks = 16; // of the default size
+	static constexpr double kIdleTimeout = 10.0; // for the server
+
+	int run(const std::vector<std::string>& args)
+	{
+		if (!parseArgs(args)) {
+			printUsage();
+			return 1;
+		}
+
+		FILE* out = stdout;
+		if (m_outPath.size()) {
+			out = fopen(m_outPath.c_str(), "a");
+			if (!out) {
+				fprintf(stderr, "error: cannot open %s\n", m_outPath.c_str());
+				return 1;
+			}
+		}
+
+		int failures = 0;
+		Result r = runAll(out, &failures);
+		if (out != stdout)
+			fclose(out);
+
+		if (r.failed()) {
+			fprintf(stderr, "error: %s\n", resultString(r).c_str());
+			return 2;
+		}
+
+		return failures ? 3 : 0;
+	}
+
+private:
+	struct Case
+	{
+		AppTaskParam::Engine engine = AppTaskParam::Engine::Threads;
+		ParallelFileWriter::Mode writer = ParallelFileWriter::Mode::Positional;
+		bool writeBehind = false;
+		int64_t connNum = 0;
+		int64_t parts = 0;
+		int64_t bufferSize = 0;
+		int64_t run = 0;
+	};
+
+	struct Sample
+	{
+		Result result;
+		int64_t granularity = 0;
+		double seconds = 0;
+		double cpuSeconds = 0; // of the process, the server's left out
+		int64_t peakRss = 0;
+		bool peakRssReset = false; // else the peak of the process so far
+		AppMetrics metrics;
+	};
+
+	Result runAll(FILE* out, int* failures)
+	{
+		RangeServer server;
+		_call(server.start(m_server));
+
+		DownloadJournal::Validator validator;
+		_call(checkUrlSupportRange(&validator, server.url(), {}, &m_abort));
+
+		for (auto engine : m_engines)
+		for (auto writer : m_writers)
+		for (auto writeBehind : m_writeBehinds)
+		for (auto connNum : m_connNums)
+		for (auto parts : m_parts)
+		for (auto bufferSize : m_bufferSizes)
+		for (int64_t run = 1; run <= m_runs; ++run) {
+			Case c;
+			c.engine = engine;
+			c.writer = writer;
+			c.writeBehind = writeBehind;
+			c.connNum = connNum;
+			c.parts = parts;
+			c.bufferSize = bufferSize;
+			c.run = run;
+
+			Sample sample;
+			sample.result = measure(c, validator, &server, &sample);
+			if (sample.result.failed())
+				++*failures;
+
+			fprintf(out, "%s\n", toJson(c, sample).c_str());
+			fflush(out);
+			printSummary(c, sample);
+		}
+
+		return {};
+	}
+
+	Result measure(const Case& c, const DownloadJournal::Validator& validator,
+		RangeServer* server, Sample* sample)
+	{
+		std::string path = filePath();
+		remove(path.c_str());
+		remove(DownloadJournal::pathFor(path).c_str());
+
+		AppTaskParam param;
+		param.url = server->url();
+		param.filePath = path;
+		param.validator = validator;
+		param.totalSize = validator.size;
+		param.granularity = taskGranularity(
+			downloadSize(), c.connNum * c.parts);
+		param.connNum = (int)c.connNum;
+		param.bufferSize = (size_t)c.bufferSize;
+		param.engine = c.engine;
+		param.writerOptions.mode = c.writer;
+		if (c.writeBehind)
+			param.writerOptions.writeBehindChunks = kWriteBehindChunks;
+
+		int64_t tailStart = validator.size - downloadSize();
+		if (tailStart > 0) {
+			param.doneRanges.emplace_back(0, tailStart);
+			param.writerOptions.sparse = true;
+		}
+
+		sample->granularity = param.granularity;
+
+		// the connections of the last run, or of the probe, are gone
+		// and their time counted
+		_should(server->waitIdle(kIdleTimeout));
+		sample->peakRssReset = Usage::resetPeakRss();
+		double cpu = Usage::processCpuSeconds();
+		double serverCpu = server->cpuSeconds();
+		auto start = AppWorker::Clock::now();
+
+		Result r;
+		{
+			AppDownloadContractor contractor;
+			contractor.onHeartbeat([]() {});
+			r = contractor.start(param);
+			sample->seconds = std::chrono::duration<double>(
+				AppWorker::Clock::now() - start).count();
+			sample->metrics = contractor.metrics();
+		}
+
+		_should(server->waitIdle(kIdleTimeout));
+		sample->cpuSeconds = Usage::processCpuSeconds() - cpu
+			- (server->cpuSeconds() - serverCpu);
+		sample->peakRss = Usage::peakRss();
+
+		if (r.ok())
+			r = verify(path, tailStart, validator.size);
+
+		remove(path.c_str());
+		remove(DownloadJournal::pathFor(path).c_str());
+		return r;
+	}
+
+	// what RangeServer made up, byte for byte from `first` on
+	static Result verify(ConStrRef path, int64_t first, int64_t size)
+	{
+		const size_t kBlock = MB(1);
+		std::vector<BYTE> expected(kBlock + 256);
+		for (size_t i = 0; i < expected.size(); ++i)
+			expected[i] = RangeServer::byteAt(i);
+
+		std::ifstream file(nativePath(path), std::ios::binary);
+		file.seekg(first);
+		std::vector<BYTE> buffer(kBlock);
+		for (int64_t pos = first; pos < size; pos += kBlock) {
+			size_t n = (size_t)std::min<int64_t>(kBlock, size - pos);
+			file.read((char*)buffer.data(), n);
+			_must_or_return(InternalError::ioError, file.good(), path, pos);
+
+			_must_or_return(RequireError::digestMismatch,
+				memcmp(buffer.data(), expected.data() + pos % 256, n) == 0,
+				path, pos);
+		}
+
+		return {};
+	}
+
+	std::string toJson(const Case& c, const Sample& s) const
+	{
+		std::stringstream ss;
+		ss << "{\"engine\": \"" << engineName(c.engine) << "\""
+			<< ", \"writer\": \"" << writerName(c.writer) << "\""
+			<< ", \"writeBehind\": " << (c.writeBehind ? "true" : "false")
+			<< ", \"connNum\": " << c.connNum
+			<< ", \"parts\": " << c.parts
+			<< ", \"granularity\": " << s.granularity
+			<< ", \"bufferSize\": " << c.bufferSize
+			<< ", \"fileSize\": " << m_server.fileSize
+			<< ", \"downloadSize\": " << downloadSize()
+			<< ", \"bandwidth\": " << m_server.bandwidth
+			<< ", \"latency\": " << m_server.latency
+			<< ", \"run\": " << c.run
+			<< ", \"ok\": " << (s.result.ok() ? "true" : "false");
+
+		// the error is "space.code" and the context, nothing to escape
+		// but a quote
+		if (s.result.failed()) {
+			std::string error = resultString(s.result);
+			std::replace(error.begin(), error.end(), '"', '\'');
+			ss << ", \"error\": \"" << error << "\"";
+		}
+
+		ss << ", \"seconds\": " << s.seconds
+			<< ", \"throughput\": " << (int64_t)throughput(s)
+			<< ", \"cpuSeconds\": " << s.cpuSeconds
+			<< ", \"cpuSecondsPerGB\": " << cpuPerGB(s)
+			<< ", \"peakRss\": " << s.peakRss
+			<< ", \"peakRssReset\": " << (s.peakRssReset ? "true" : "false")
+			<< ", \"requests\": " << s.metrics.requests
+			<< ", \"connections\": " << s.metrics.connections
+			<< ", \"bytesReceived\": " << s.metrics.bytesReceived
+			<< "}";
+
+		return ss.str();
+	}
+
+	void printSummary(const Case& c, const Sample& s) const
+	{
+		std::string writer = writerName(c.writer);
+		if (c.writeBehind)
+			writer += "+behind";
+
+		if (s.result.failed()) {
+			fprintf(stderr, "%s w=%s c=%d g=%d k=%s: %s\n",
+				engineName(c.engine), writer.c_str(),
+				(int)c.connNum, (int)c.parts,
+				formattedDataSize(c.bufferSize, true).c_str(),
+				resultString(s.result).c_str());
+			return;
+		}
+
+		fprintf(stderr, "%s w=%s c=%d g=%d k=%s: %s/s, cpu %.2fs (%.2fs/GB),"
+			" rss %s\n",
+			engineName(c.engine), writer.c_str(),
+			(int)c.connNum, (int)c.parts,
+			formattedDataSize(c.bufferSize, true).c_str(),
+			formattedDataSize((int64_t)throughput(s), false).c_str(),
+			s.cpuSeconds, cpuPerGB(s),
+			formattedDataSize(s.peakRss, true).c_str());
+	}
+
+	// bytes per second, 0 for a failed run
+	double throughput(const Sample& s) const
+	{
+		if (s.result.failed() || s.seconds <= 0)
+			return 0;
+
+		return downloadSize() / s.seconds;
+	}
+
+	// what a buffer size or an engine costs, apart from the file size
+	double cpuPerGB(const Sample& s) const
+	{
+		return s.cpuSeconds * GB(1) / downloadSize();
+	}
+
+	// the tail, or the whole file
+	int64_t downloadSize() const
+	{
+		return m_tail > 0 ? m_tail : m_server.fileSize;
+	}
+
+	static const char* engineName(AppTaskParam::Engine engine)
+	{
+		return engine == AppTaskParam::Engine::Reactor ? "reactor" : "threads";
+	}
+
+	static const char* writerName(ParallelFileWriter::Mode mode)
+	{
+		typedef ParallelFileWriter::Mode Mode;
+		return mode == Mode::Stream ? "stream"
+			: mode == Mode::Mapped ? "mapped" : "positional";
+	}
+
+	std::string filePath() const
+	{
+		std::string dir = m_dir;
+		if (dir.size() && dir.back() != '/' && dir.back() != '\\')
+			dir += '/';
+
+		return dir + "mcd_bench.bin";
+	}
+
+	bool parseArgs(const std::vector<std::string>& args)
+	{
+		for (size_t i = 0; i < args.size(); ++i) {
+			ConStrRef arg = args[i];
+			bool hasValue = (i + 1 < args.size());
+
+			if (arg == "-s" && hasValue) {
+				unless (parseSize(args[++i], &m_server.fileSize))
+					return false;
+			}
+			else if (arg == "-t" && hasValue) {
+				unless (parseSize(args[++i], &m_tail))
+					return false;
+			}
+			else if (arg == "-b" && hasValue) {
+				unless (parseSize(args[++i], &m_server.bandwidth))
+					return false;
+			}
+			else if (arg == "-l" && hasValue) {
+				int64_t ms = 0;
+				unless (toNumber(args[++i], &ms) && inRange<int64_t>(ms, 0, 10001))
+					return false;
+
+				m_server.latency = ms / 1000.0;
+			}
+			else if (arg == "-c" && hasValue) {
+				unless (parseList(args[++i], &m_connNums))
+					return false;
+			}
+			else if (arg == "-g" && hasValue) {
+				unless (parseList(args[++i], &m_parts))
+					return false;
+			}
+			else if (arg == "-k" && hasValue) {
+				unless (parseList(args[++i], &m_bufferSizes))
+					return false;
+			}
+			else if (arg == "-e" && hasValue) {
+				unless (parseEngines(args[++i]))
+					return false;
+			}
+			else if (arg == "-w" && hasValue) {
+				unless (parseWriters(args[++i]))
+					return false;
+			}
+			else if (arg == "-n" && hasValue) {
+				unless (toNumber(args[++i], &m_runs))
+					return false;
+			}
+			else if (arg == "-d" && hasValue) {
+				m_dir = args[++i];
+			}
+			else if (arg == "-o" && hasValue) {
+				m_outPath = args[++i];
+			}
+			else {
+				return false;
+			}
+		}
+
+		bool reactor = std::find(m_engines.begin(), m_engines.end(),
+			AppTaskParam::Engine::Reactor) != m_engines.end();
+		int maxConn = reactor ? kMaxReactorConn : kMaxConn;
+
+		for (auto i : m_connNums) {
+			unless (inRange<int64_t>(i, 1, maxConn + 1))
+				return false;
+		}
+
+		for (auto i : m_parts) {
+			unless (inRange<int64_t>(i, 1, 101))
+				return false;
+		}
+
+		for (auto i : m_bufferSizes) {
+			unless (inRange<int64_t>(i, KB(1), MB(64) + 1))
+				return false;
+		}
+
+		return m_server.fileSize > 0 && m_tail <= m_server.fileSize
+			&& inRange<int64_t>(m_runs, 1, 101);
+	}
+
+	// "1,4,16" or "64K,1M"
+	static bool parseList(ConStrRef text, std::vector<int64_t>* values)
+	{
+		values->clear();
+		for (auto& i : split(text, ",", true)) {
+			int64_t value = 0;
+			unless (parseSize(trim(i), &value))
+				return false;
+
+			values->push_back(value);
+		}
+
+		return values->size() > 0;
+	}
+
+	bool parseEngines(ConStrRef text)
+	{
+		m_engines.clear();
+		for (auto& name : split(text, ",", true)) {
+			if (name == "threads") {
+				m_engines.push_back(AppTaskParam::Engine::Threads);
+				continue;
+			}
+#ifndef _WIN32
+			if (name == "reactor") {
+				m_engines.push_back(AppTaskParam::Engine::Reactor);
+				continue;
+			}
+#endif
+			return false;
+		}
+
+		return m_engines.size() > 0;
+	}
+
+	// "stream,mapped", each of them also behind a write-behind
+	// thread when "behind" is among them
+	bool parseWriters(ConStrRef text)
+	{
+		typedef ParallelFileWriter::Mode Mode;
+		m_writers.clear();
+		m_writeBehinds = { false };
+
+		for (auto& name : split(text, ",", true)) {
+			if (name == "stream")
+				m_writers.push_back(Mode::Stream);
+			else if (name == "positional")
+				m_writers.push_back(Mode::Positional);
+			else if (name == "mapped")
+				m_writers.push_back(Mode::Mapped);
+			else if (name == "behind")
+				m_writeBehinds = { false, true };
+			else
+				return false;
+		}
+
+		return m_writers.size() > 0;
+	}
+
+	// "500K", "2M", "3T", bytes
+	static bool parseSize(ConStrRef text, int64_t* size)
+	{
+		std::string number = text;
+		int64_t unit = 1;
+		char suffix = text.size() ? (char)toupper(text.back()) : 0;
+		if (inArray(suffix, { 'K', 'M', 'G', 'T' })) {
+			number.pop_back();
+			unit = suffix == 'K' ? KB(1) : suffix == 'M' ? MB(1)
+				: suffix == 'G' ? GB(1) : GB64(1) * 1024;
+		}
+
+		int64_t value = 0;
+		unless (toNumber(number, &value)
+			&& inRange<int64_t>(value, 0, INT64_MAX / unit))
+			return false;
+
+		*size = value * unit;
+		return true;
+	}
+
+	void printUsage()
+	{
+		fprintf(stderr,
+			"usage: mcd_bench [-s <size>] [-t <size>] [-b <rate>] [-l <ms>]"
+			" [-c <conn,...>] [-g <parts,...>]\n"
+			"                 [-k <buffer,...>] [-e <engine,...>]"
+			" [-w <writer,...>] [-n <runs>]\n"
+			"                 [-d <dir>] [-o <file>]\n"
+			"  -s  size of the file served, 64M by default, up to some T\n"
+			"  -t  downloads only this many bytes at the end of the file,"
+			" into a sparse\n"
+			"      file, the rest is taken as done\n"
+			"  -b  bytes per second of each server connection, no cap by default\n"
+			"  -l  milliseconds the server waits before each response\n"
+			"  -c  connection counts, 1,4,16 by default\n"
+			"  -g  tasks per connection, 3 by default\n"
+			"  -k  bytes per read, 256K by default\n"
+#ifdef _WIN32
+			"  -e  engines: threads\n"
+#else
+			"  -e  engines: threads, reactor; threads by default\n"
+#endif
+			"  -w  file writers: stream, positional, mapped; positional by"
+			" default,\n"
+			"      \"behind\" runs each of them with and without a"
+			" write-behind thread\n"
+			"  -n  runs of each combination, 1 by default\n"
+			"  -d  where the file is downloaded to, the current directory by default\n"
+			"  -o  appends the results to a file instead of printing them\n"
+			"a JSON object is written per run, a summary goes to stderr\n");
+	}
+
+	RangeServer::Options m_server;
+	int64_t m_tail = 0; // 0 for the whole file
+	std::vector<int64_t> m_connNums = { 1, 4, 16 };
+	std::vector<int64_t> m_parts = { 3 };
+	std::vector<int64_t> m_bufferSizes = { KB(256) };
+	std::vector<AppTaskParam::Engine> m_engines = {
+		AppTaskParam::Engine::Threads
+	};
+	std::vector<ParallelFileWriter::Mode> m_writers = {
+		ParallelFileWriter::Mode::Positional
+	};
+	std::vector<bool> m_writeBehinds = { false };
+	int64_t m_runs = 1;
+	std::string m_dir;
+	std::string m_outPath;
+	AbortSignal m_abort; // for the probe, never triggered
+};
+
+END_NAMESPACE_MCD
+
+
+#ifdef _WIN32
+int wmain(int argc, wchar_t* argv[])
+{
+	std::vector<std::string> args;
+	for (int i = 1; i < argc; ++i)
+		args.push_back(mcd::u16to8(argv[i]));
+
+	return mcd::Bench().run(args);
+}
+#else
+int main(int argc, char* argv[])
+{
+	std::vector<std::string> args(argv + 1, argv + argc);
+	return mcd::Bench().run(args);
+}
+#endif
@@ -0,0 +1,463 @@
+#pragma once
+#include "../mcd/infra/rate_limiter.h"
+#include "usage.h"
+#include <set>
+
+#ifdef _WIN32
+#pragma comment(lib, "ws2_32")
+#else
+#include <sys/socket.h>
+#include <sys/select.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#endif
+
+BEGIN_NAMESPACE_MCD
+
+// A file of made up content served on 127.0.0.1 over HTTP/1.1, with
+// ranges and keep-alive, a thread for each connection. Every connection
+// is held to `bandwidth` bytes per second, and every response waits
+// `latency` seconds before its head, as a far away server would.
+//
+// For the tests of the transports, the same content is also served
+// whole under other paths: chunked at /chunked.bin, and until the
+// connection closes at /close.bin. /moved.bin and /moved-abs.bin
+// redirect to the file, with a relative and an absolute Location.
+class RangeServer
+{
+public:
+	struct Options
+	{
+		int64_t fileSize = MB(64);
+		int64_t bandwidth = 0; // per connection, 0 for no cap
+		double latency = 0; // seconds before each response
+
+		// responses on a connection before it is closed without a
+		// word, as by a server timing it out; 0 for no limit
+		int maxRequests = 0;
+	};
+
+	static const size_t kChunk = KB(64);
+
+	RangeServer()
+	{
+		// the content repeats every 256 bytes, a chunk is sent from
+		// anywhere in this buffer without being made up each time
+		m_pattern.resize(kChunk + 256);
+		for (size_t i = 0; i < m_pattern.size(); ++i)
+			m_pattern[i] = byteAt(i);
+	}
+
+	RangeServer(const RangeServer&) = delete;
+	RangeServer& operator =(const RangeServer&) = delete;
+
+	~RangeServer()
+	{
+		stop();
+	}
+
+	static BYTE byteAt(int64_t pos)
+	{
+		return (BYTE)(pos * 31 + 7);
+	}
+
+	// on a port of the system's choice, see url()
+	Result start(const Options& options)
+	{
+		m_options = options;
+#ifdef _WIN32
+		WSADATA data;
+		_must_or_return(InternalError::ioError,
+			WSAStartup(MAKEWORD(2, 2), &data) == 0, "WSAStartup");
+#endif
+		m_listener = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+		_must_or_return(InternalError::ioError,
+			m_listener != kInvalidSocket, "socket", lastError());
+
+		sockaddr_in addr = {};
+		addr.sin_family = AF_INET;
+		addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		addr.sin_port = 0;
+		socklen_t len = sizeof(addr);
+
+		_must_or_return(InternalError::ioError,
+			bind(m_listener, (sockaddr*)&addr, sizeof(addr)) == 0
+			&& listen(m_listener, SOMAXCONN) == 0
+			&& getsockname(m_listener, (sockaddr*)&addr, &len) == 0,
+			"listen", lastError());
+
+		m_port = ntohs(addr.sin_port);
+		m_stopped = false;
+		m_acceptor = std::thread([this]() {
+			acceptLoop();
+		});
+
+		return {};
+	}
+
+	void stop()
+	{
+		if (m_listener == kInvalidSocket)
+			return;
+
+		m_stopped = true;
+		m_acceptor.join();
+		closeSocket(m_listener);
+		m_listener = kInvalidSocket;
+
+		std::unique_lock<std::mutex> lock(m_mutex);
+		for (auto i : m_connections)
+			shutdown(i, kShutdownBoth);
+
+		m_condition.wait(lock, [this]() {
+			return m_connections.empty();
+		});
+	}
+
+	std::string url() const
+	{
+		return "http://127.0.0.1:" + std::to_string(m_port) + "/bench.bin";
+	}
+
+	// until the client has closed every connection, false on timeout
+	bool waitIdle(double timeout)
+	{
+		std::unique_lock<std::mutex> lock(m_mutex);
+		return m_condition.wait_for(lock,
+			std::chrono::milliseconds((int)(timeout * 1000)),
+			[this]() {
+				return m_connections.empty();
+			});
+	}
+
+	// of the connections that have ended, to be left out of the
+	// time the process has used
+	double cpuSeconds()
+	{
+		Guard::Mutex lock(&m_mutex);
+		return m_cpuSeconds;
+	}
+
+	int64_t bytesSent() const
+	{
+		return m_bytesSent;
+	}
+
+	int64_t connectionsAccepted() const
+	{
+		return m_accepted;
+	}
+
+private:
+#ifdef _WIN32
+	typedef SOCKET Socket;
+	typedef int socklen_t;
+	static const Socket kInvalidSocket = INVALID_SOCKET;
+	static const int kShutdownBoth = 2; // SD_BOTH, Windows.h brings the older winsock.h
+	static const int kSendFlags = 0;
+
+	static void closeSocket(Socket s)
+	{
+		closesocket(s);
+	}
+
+	static int lastError()
+	{
+		return WSAGetLastError();
+	}
+#else
+	typedef int Socket;
+	static const Socket kInvalidSocket = -1;
+	static const int kShutdownBoth = SHUT_RDWR;
+	static const int kSendFlags = MSG_NOSIGNAL;
+
+	static void closeSocket(Socket s)
+	{
+		close(s);
+	}
+
+	static int lastError()
+	{
+		return errno;
+	}
+#endif
+
+	struct Request
+	{
+		std::string path;
+		bool head = false;
+		bool keepAlive = true;
+		bool hasRange = false;
+		int64_t first = 0;
+		int64_t last = -1; // -1 for the end
+	};
+
+	void acceptLoop()
+	{
+		while (!m_stopped) {
+			// wakes up now and then to see whether to stop
+			fd_set readable;
+			FD_ZERO(&readable);
+			FD_SET(m_listener, &readable);
+			timeval timeout = { 0, 100 * 1000 };
+			if (select((int)m_listener + 1, &readable,
+				nullptr, nullptr, &timeout) <= 0)
+				continue;
+
+			Socket s = accept(m_listener, nullptr, nullptr);
+			if (s == kInvalidSocket)
+				continue;
+
+			int on = 1;
+			setsockopt(s, IPPROTO_TCP, TCP_NODELAY, (const char*)&on, sizeof(on));
+			++m_accepted;
+			{
+				Guard::Mutex lock(&m_mutex);
+				m_connections.insert(s);
+			}
+
+			// stop() waits for the connections to go instead of joining
+			std::thread(&RangeServer::serve, this, s).detach();
+		}
+	}
+
+	void serve(Socket s)
+	{
+		RateLimiter limiter;
+		limiter.setRate(m_options.bandwidth);
+		std::string buffer;
+
+		for (int served = 1; ; ++served) {
+			Request request;
+			unless (readRequest(s, &buffer, &request)
+				&& respond(s, request, &limiter)
+				&& request.keepAlive)
+				break;
+
+			if (m_options.maxRequests && served >= m_options.maxRequests)
+				break;
+		}
+
+		closeSocket(s);
+		double cpu = Usage::threadCpuSeconds();
+
+		Guard::Mutex lock(&m_mutex);
+		m_cpuSeconds += cpu;
+		m_connections.erase(s);
+		m_condition.notify_all();
+	}
+
+	// false once the client is gone or makes no sense
+	bool readRequest(Socket s, std::string* buffer, Request* request)
+	{
+		size_t end = 0;
+		while ((end = buffer->find("\r\n\r\n")) == std::string::npos) {
+			if (buffer->size() > KB(64))
+				return false;
+
+			char data[KB(4)];
+			int n = recv(s, data, sizeof(data), 0);
+			if (n <= 0)
+				return false;
+
+			buffer->append(data, n);
+		}
+
+		std::string head = buffer->substr(0, end);
+		buffer->erase(0, end + 4);
+
+		auto lines = split(head, "\r\n");
+		request->head = lines[0].compare(0, 5, "HEAD ") == 0;
+		unless (request->head || lines[0].compare(0, 4, "GET ") == 0)
+			return false;
+
+		auto words = split(lines[0], " ");
+		if (words.size() > 1)
+			request->path = words[1];
+
+		for (size_t i = 1; i < lines.size(); ++i) {
+			size_t colon = lines[i].find(':');
+			if (colon == std::string::npos)
+				continue;
+
+			std::string name = toLower(lines[i].substr(0, colon));
+			std::string value = trim(lines[i].substr(colon + 1));
+			if (name == "connection")
+				request->keepAlive = !iEquals(value, "close");
+			else if (name == "range")
+				request->hasRange = parseRange(value, request);
+		}
+
+		return true;
+	}
+
+	// "bytes=first-" or "bytes=first-last", no lists and no suffixes
+	static bool parseRange(ConStrRef value, Request* request)
+	{
+		if (value.compare(0, 6, "bytes=") != 0)
+			return false;
+
+		auto bounds = split(value.substr(6), "-");
+		if (bounds.size() != 2 || !toNumber(bounds[0], &request->first))
+			return false;
+
+		if (bounds[1].size() && !toNumber(bounds[1], &request->last))
+			return false;
+
+		return true;
+	}
+
+	bool respond(Socket s, const Request& request, RateLimiter* limiter)
+	{
+		if (m_options.latency > 0)
+			sleep(m_options.latency);
+
+		if (request.path == "/moved.bin")
+			return redirect(s, "/bench.bin");
+
+		if (request.path == "/moved-abs.bin")
+			return redirect(s, url());
+
+		bool chunked = (request.path == "/chunked.bin");
+		if (chunked || request.path == "/close.bin")
+			return respondWhole(s, request, limiter, chunked);
+
+		int64_t size = m_options.fileSize;
+		int64_t first = 0;
+		int64_t last = size - 1;
+		std::stringstream head;
+
+		if (request.hasRange) {
+			first = request.first;
+			if (request.last >= 0)
+				last = std::min(request.last, size - 1);
+
+			if (first > last || first >= size) {
+				head << "HTTP/1.1 416 Range Not Satisfiable\r\n"
+					<< "Content-Range: bytes */" << size << "\r\n"
+					<< "Content-Length: 0\r\n\r\n";
+				return sendAll(s, head.str());
+			}
+
+			head << "HTTP/1.1 206 Partial Content\r\n"
+				<< "Content-Range: bytes " << first << "-" << last
+				<< "/" << size << "\r\n";
+		}
+		else {
+			head << "HTTP/1.1 200 OK\r\n";
+		}
+
+		head << "Content-Length: " << (last - first + 1) << "\r\n"
+			<< "Content-Type: application/octet-stream\r\n"
+			<< "ETag: \"mcd-bench-" << size << "\"\r\n"
+			<< "Accept-Ranges: bytes\r\n\r\n";
+
+		unless (sendAll(s, head.str()))
+			return false;
+
+		if (request.head)
+			return true;
+
+		return sendBody(s, first, last, limiter, false);
+	}
+
+	// the whole file without a length, the connection is closed
+	// after it unless chunked
+	bool respondWhole(Socket s, const Request& request,
+		RateLimiter* limiter, bool chunked)
+	{
+		std::string head = "HTTP/1.1 200 OK\r\n";
+		head += chunked ? "Transfer-Encoding: chunked\r\n"
+			: "Connection: close\r\n";
+		head += "Content-Type: application/octet-stream\r\n\r\n";
+
+		unless (sendAll(s, head))
+			return false;
+
+		if (request.head)
+			return chunked;
+
+		unless (sendBody(s, 0, m_options.fileSize - 1, limiter, chunked))
+			return false;
+
+		return chunked && sendAll(s, "0\r\n\r\n");
+	}
+
+	bool redirect(Socket s, ConStrRef location)
+	{
+		return sendAll(s, "HTTP/1.1 302 Found\r\n"
+			"Location: " + location + "\r\n"
+			"Content-Length: 0\r\n\r\n");
+	}
+
+	// [first, last], a chunk of the transfer coding for each send
+	bool sendBody(Socket s, int64_t first, int64_t last,
+		RateLimiter* limiter, bool chunked)
+	{
+		for (int64_t pos = first; pos <= last; ) {
+			size_t chunk = (size_t)std::min<int64_t>(
+				limiter->chunkSize(kChunk), last - pos + 1);
+
+			double wait = limiter->reserve(chunk);
+			if (wait > 0)
+				sleep(wait);
+
+			if (chunked) {
+				std::stringstream size;
+				size << std::hex << chunk << "\r\n";
+				unless (sendAll(s, size.str()))
+					return false;
+			}
+
+			const char* data = (const char*)m_pattern.data() + pos % 256;
+			unless (sendAll(s, data, chunk))
+				return false;
+
+			if (chunked && !sendAll(s, "\r\n"))
+				return false;
+
+			pos += chunk;
+			m_bytesSent += chunk;
+		}
+
+		return true;
+	}
+
+	static bool sendAll(Socket s, ConStrRef data)
+	{
+		return sendAll(s, data.data(), data.size());
+	}
+
+	static bool sendAll(Socket s, const char* data, size_t size)
+	{
+		while (size) {
+			int n = send(s, data, (int)size, kSendFlags);
+			if (n <= 0)
+				return false;
+
+			data += n;
+			size -= n;
+		}
+
+		return true;
+	}
+
+	Options m_options;
+	std::vector<BYTE> m_pattern;
+	Socket m_listener = kInvalidSocket;
+	int m_port = 0;
+	std::atomic_bool m_stopped = true;
+	std::thread m_acceptor;
+	std::atomic_int64_t m_bytesSent = 0;
+	std::atomic_int64_t m_accepted = 0;
+
+	// guarded by m_mutex
+	std::set<Socket> m_connections;
+	double m_cpuSeconds = 0;
+
+	std::mutex m_mutex;
+	std::condition_variable m_condition;
+};
+
+END_NAMESPACE_MCD
@@ -0,0 +1,104 @@
+#pragma once
+#include "../mcd/infra/guard.h"
+
+#ifdef _WIN32
+#include <psapi.h>
+#pragma comment(lib, "psapi")
+#else
+#include <sys/resource.h>
+#include <time.h>
+#endif
+
+BEGIN_NAMESPACE_MCD
+
+// What the process and its threads have used so far, for the numbers
+// of a run to be taken as differences.
+namespace Usage {
+
+#ifdef _WIN32
+inline double toSeconds(const FILETIME& t)
+{
+	ULARGE_INTEGER v;
+	v.LowPart = t.dwLowDateTime;
+	v.HighPart = t.dwHighDateTime;
+	return v.QuadPart / 1e7;
+}
+#endif
+
+// user and system time of all threads
+inline double processCpuSeconds()
+{
+#ifdef _WIN32
+	FILETIME creation, exit, kernel, user;
+	unless (GetProcessTimes(GetCurrentProcess(),
+		&creation, &exit, &kernel, &user))
+		return 0;
+
+	return toSeconds(kernel) + toSeconds(user);
+#else
+	rusage usage = {};
+	getrusage(RUSAGE_SELF, &usage);
+	return usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6
+		+ usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6;
+#endif
+}
+
+// of the calling thread
+inline double threadCpuSeconds()
+{
+#ifdef _WIN32
+	FILETIME creation, exit, kernel, user;
+	unless (GetThreadTimes(GetCurrentThread(),
+		&creation, &exit, &kernel, &user))
+		return 0;
+
+	return toSeconds(kernel) + toSeconds(user);
+#else
+	timespec t = {};
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &t);
+	return t.tv_sec + t.tv_nsec / 1e9;
+#endif
+}
+
+// Linux starts counting the peak anew, elsewhere it stays the peak
+// of the whole process and a run only shows when it went above
+inline bool resetPeakRss()
+{
+#ifdef _WIN32
+	return false;
+#else
+	std::ofstream file("/proc/self/clear_refs");
+	file << "5";
+	file.close();
+	return file.good();
+#endif
+}
+
+// in bytes
+inline int64_t peakRss()
+{
+#ifdef _WIN32
+	PROCESS_MEMORY_COUNTERS counters = {};
+	unless (GetProcessMemoryInfo(GetCurrentProcess(),
+		&counters, sizeof(counters)))
+		return 0;
+
+	return (int64_t)counters.PeakWorkingSetSize;
+#else
+	// follows clear_refs, unlike ru_maxrss
+	std::ifstream file("/proc/self/status");
+	std::string line;
+	while (std::getline(file, line)) {
+		if (line.compare(0, 6, "VmHWM:") == 0)
+			return std::atoll(line.c_str() + 6) * KB(1);
+	}
+
+	rusage usage = {};
+	getrusage(RUSAGE_SELF, &usage);
+	return (int64_t)usage.ru_maxrss * KB(1);
+#endif
+}
+
+} // namespace Usage
+
+END_NAMESPACE_MCD
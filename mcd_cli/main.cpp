@@ -0,0 +1,464 @@
+#include "../mcd/engine/manager.h"
+#include <stdio.h>
+
+#ifdef _WIN32
+#include <io.h>
+#pragma comment(lib, "winhttp")
+#pragma comment(lib, "shlwapi")
+#pragma comment(lib, "bcrypt")
+#else
+#include <pthread.h>
+#endif
+
+BEGIN_NAMESPACE_MCD
+
+// one exit code per Result space, so that scripts can tell
+// a refused range request from a network or a disk failure
+enum CliExitCode {
+	kExitOk = 0,
+	kExitUsage = 1,
+	kExitInternal = 2,
+	kExitRequire = 3,
+	kExitHttp = 4,
+	kExitTransport = 5,
+	kExitAborted = 130,
+};
+
+class Cli
+{
+public:
+	static const int kMaxConn = 100;
+	static const int kMaxReactorConn = 4000; // a descriptor each
+	static const int kMaxJobs = 20;
+
+	int run(const std::vector<std::string>& args)
+	{
+		if (!parseArgs(args)) {
+			printUsage();
+			return kExitUsage;
+		}
+
+		watchInterrupt();
+		Result r = download();
+		endProgress();
+		unwatchInterrupt();
+
+		return exitCode(r);
+	}
+
+	static int exitCode(const Result& r)
+	{
+		if (r.ok())
+			return kExitOk;
+
+		if (r.is(InternalError::userAbort))
+			return kExitAborted;
+
+		if (r.space() == InternalError::assertFailed().space())
+			return kExitInternal;
+
+		if (r.space() == RequireError::diskSpace().space())
+			return kExitRequire;
+
+		if (r.space() == "http")
+			return kExitHttp;
+
+		if (r.space() == http_api::resultSpace())
+			return kExitTransport;
+
+#ifndef _WIN32
+		if (r.space() == http_api::tlsResultSpace())
+			return kExitTransport;
+#endif
+
+		return kExitInternal;
+	}
+
+private:
+	bool parseArgs(const std::vector<std::string>& args)
+	{
+		for (size_t i = 0; i < args.size(); ++i) {
+			ConStrRef arg = args[i];
+			bool hasValue = (i + 1 < args.size());
+
+			if (arg == "-o" && hasValue) {
+				m_filePath = args[++i];
+			}
+			else if (arg == "-m" && hasValue) {
+				m_mirrors.push_back(encodeUri(trim(args[++i])));
+			}
+			else if (arg == "-t" && hasValue) {
+				m_treeHash = args[++i];
+			}
+			else if (arg == "-f") {
+				m_overwrite = true;
+			}
+			else if (arg == "-x" && hasValue) {
+				m_metricsPath = args[++i];
+			}
+			else if (arg == "-j" && hasValue) {
+				unless (toNumber(args[++i], &m_maxJobs))
+					return false;
+			}
+			else if (arg == "-c" && hasValue) {
+				unless (toNumber(args[++i], &m_connNum))
+					return false;
+			}
+			else if (arg == "-g" && hasValue) {
+				unless (toNumber(args[++i], &m_parts))
+					return false;
+			}
+			else if (arg == "-r" && hasValue) {
+				unless (parseRate(args[++i], &m_rateLimit))
+					return false;
+			}
+			else if (arg == "-p" && hasValue) {
+				unless (parseRate(args[++i], &m_jobRateLimit))
+					return false;
+			}
+			else if (arg == "-s" && hasValue) {
+				unless (toNumber(args[++i], &m_stragglerWindow))
+					return false;
+			}
+			else if (arg == "-e" && hasValue) {
+				unless (parseEngine(args[++i]))
+					return false;
+			}
+			else if (arg.size() && arg[0] != '-') {
+				m_urls.push_back(encodeUri(trim(arg)));
+			}
+			else {
+				return false;
+			}
+		}
+
+		bool single = m_filePath.size() || m_mirrors.size()
+			|| m_treeHash.size() || m_metricsPath.size();
+		if (m_urls.empty() || (single && m_urls.size() > 1))
+			return false;
+
+		for (auto& url : m_urls) {
+			std::string path = m_filePath.size()
+				? m_filePath : safeFileNameFromUri(url);
+
+			if (contains(m_filePaths, path)) {
+				fprintf(stderr, "%s is the target of two urls\n", path.c_str());
+				return false;
+			}
+
+			m_filePaths.push_back(path);
+		}
+
+		return inRange<int64_t>(m_connNum, 0, maxConn() + 1)
+			&& inRange<int64_t>(m_parts, 1, 101)
+			&& inRange<int64_t>(m_maxJobs, 1, kMaxJobs + 1)
+			&& inRange<int64_t>(m_stragglerWindow, 0, 3601);
+	}
+
+	bool parseEngine(ConStrRef name)
+	{
+		if (name == "threads") {
+			m_engine = AppTaskParam::Engine::Threads;
+			return true;
+		}
+
+#ifndef _WIN32
+		if (name == "reactor") {
+			m_engine = AppTaskParam::Engine::Reactor;
+			return true;
+		}
+#endif
+
+		return false;
+	}
+
+	// "500K", "2M", bytes per second
+	static bool parseRate(ConStrRef text, int64_t* rate)
+	{
+		std::string number = text;
+		int64_t unit = 1;
+		char suffix = text.size() ? (char)toupper(text.back()) : 0;
+		if (inArray(suffix, { 'K', 'M', 'G' })) {
+			number.pop_back();
+			unit = suffix == 'K' ? KB(1) : suffix == 'M' ? MB(1) : GB(1);
+		}
+
+		int64_t value = 0;
+		unless (toNumber(number, &value)
+			&& inRange<int64_t>(value, 0, INT64_MAX / unit))
+			return false;
+
+		*rate = value * unit;
+		return true;
+	}
+
+	int maxConn() const
+	{
+		bool reactor = (m_engine == AppTaskParam::Engine::Reactor);
+		return reactor ? kMaxReactorConn : kMaxConn;
+	}
+
+	void printUsage()
+	{
+		fprintf(stderr,
+			"usage: mcd_cli [-o <file>] [-f] [-m <url>]... [-t <hash>]"
+			" [-x <file>] [-c <conn>] [-g <parts>]\n"
+			"               [-e <engine>] [-j <jobs>] [-r <rate>] [-p <rate>]"
+			" [-s <seconds>] <url>...\n"
+			"  -o  output file of a single url, named after it by default\n"
+			"  -f  overwrites an existing file, else only one with a"
+			" journal to resume\n"
+			"      from is downloaded to\n"
+			"  -m  a mirror of a single url, the ranges are spread"
+			" over all of them\n"
+			"  -t  SHA-256 tree hash of a single url, checked as it"
+			" downloads:\n"
+			"      split -b 1M --filter='openssl dgst -sha256 -binary'"
+			" FILE | openssl dgst -sha256\n"
+			"  -x  metrics of a single url, written to the file every second:"
+			" JSON when\n"
+			"      it ends in .json, Prometheus text otherwise\n"
+			"  -c  connections (1-%d, %d with the reactor),"
+			" 0 tunes itself (default);\n"
+			"      with several urls the budget they share\n"
+			"  -g  tasks per connection (default 3)\n"
+			"  -e  threads (default), or reactor: a few event loops"
+			" for all connections, not on Windows\n"
+			"  -j  downloads at a time (1-%d, default 3)\n"
+			"  -r  bytes per second of all downloads, e.g. 500K or 2M\n"
+			"  -p  bytes per second of each download, within the one of -r\n"
+			"  -s  seconds a connection may crawl below a fifth of the"
+			" median before it\n"
+			"      reconnects, 0 never (default 8)\n",
+			kMaxConn, kMaxReactorConn, kMaxJobs);
+	}
+
+	Result download()
+	{
+		HttpConfig config;
+		config.setConnectTimeout(5);
+
+		DownloadManager manager;
+		manager.setMaxActive((int)m_maxJobs);
+		manager.setConnBudget(m_connNum ? (int)m_connNum : maxConn());
+		manager.setRateLimit(m_rateLimit);
+
+		for (size_t i = 0; i < m_urls.size(); ++i) {
+			DownloadJob job;
+			job.url = m_urls[i];
+			job.mirrors = m_mirrors;
+			job.treeHash = m_treeHash;
+			job.metricsPath = m_metricsPath;
+			job.filePath = m_filePaths[i];
+			job.overwrite = m_overwrite;
+			job.config = config;
+			job.connNum = (int)m_connNum;
+			job.maxConnNum = maxConn();
+			job.parts = (int)m_parts;
+			job.rateLimit = m_jobRateLimit;
+			job.engine = m_engine;
+			job.stragglerWindow = (double)m_stragglerWindow;
+			manager.add(job);
+		}
+
+		AbortSignal::Guard g(&m_abort, [&]() {
+			manager.abort();
+		});
+
+		if (m_abort.didAborted())
+			return InternalError::userAbort();
+
+		TimePassed tp;
+		manager.onHeartbeat([&, this]() {
+			printStatus(manager.status(), tp.get());
+		});
+
+		manager.onFinish([this](DownloadManager::JobId id, Result r) {
+			report(id, r);
+		});
+
+		return manager.run();
+	}
+
+	// one line rewritten in place for a single download,
+	// a line per running download otherwise
+	void printStatus(const std::vector<DownloadManager::JobStatus>& jobs,
+		time_t seconds)
+	{
+		for (auto& i : jobs) {
+			if (i.resumed && !contains(m_resumed, i.filePath)) {
+				m_resumed.push_back(i.filePath);
+				endProgress();
+				fprintf(stderr, "resuming %s\n", i.filePath.c_str());
+			}
+		}
+
+		if (jobs.size() == 1) {
+			if (jobs[0].text.size()) {
+				std::stringstream ss;
+				ss << jobs[0].text << " (" << seconds << "s)";
+				printProgress(ss.str());
+			}
+
+			return;
+		}
+
+		for (auto& i : jobs) {
+			if (i.active && i.text.size())
+				fprintf(stderr, "%s: %s\n",
+					i.filePath.c_str(), i.text.c_str());
+		}
+	}
+
+	static bool contains(const std::vector<std::string>& v, ConStrRef s)
+	{
+		return std::find(v.begin(), v.end(), s) != v.end();
+	}
+
+	void report(DownloadManager::JobId id, Result r)
+	{
+		if (r.is(InternalError::userAbort))
+			return;
+
+		endProgress();
+		ConStrRef path = m_filePaths[id];
+		if (r.failed())
+			fprintf(stderr, "error: %s: %s\n",
+				path.c_str(), resultString(r).c_str());
+		else if (m_urls.size() > 1)
+			fprintf(stderr, "done: %s\n", path.c_str());
+	}
+
+	// rewritten in place on a console, one line per heartbeat otherwise
+	void printProgress(ConStrRef text)
+	{
+		if (stderrIsConsole()) {
+			size_t width = std::max(m_progressWidth, text.size());
+			fprintf(stderr, "\r%-*s", (int)width, text.c_str());
+			m_progressWidth = width;
+		}
+		else {
+			fprintf(stderr, "%s\n", text.c_str());
+		}
+
+		fflush(stderr);
+	}
+
+	void endProgress()
+	{
+		if (m_progressWidth)
+			fprintf(stderr, "\n");
+
+		m_progressWidth = 0;
+	}
+
+#ifdef _WIN32
+	static bool stderrIsConsole()
+	{
+		return _isatty(_fileno(stderr)) != 0;
+	}
+
+	void watchInterrupt()
+	{
+		s_abort = &m_abort;
+		SetConsoleCtrlHandler(onConsoleCtrl, TRUE);
+	}
+
+	void unwatchInterrupt()
+	{
+		SetConsoleCtrlHandler(onConsoleCtrl, FALSE);
+		s_abort = nullptr;
+	}
+
+	static BOOL WINAPI onConsoleCtrl(DWORD type)
+	{
+		unless (inArray<DWORD>(type, { CTRL_C_EVENT, CTRL_BREAK_EVENT }))
+			return FALSE;
+
+		if (s_abort)
+			s_abort->trigger();
+
+		return TRUE;
+	}
+#else
+	static bool stderrIsConsole()
+	{
+		return isatty(fileno(stderr)) != 0;
+	}
+
+	// SIGINT and SIGTERM are taken by a thread of their own, so that the
+	// abort does not run inside a signal handler. They are blocked before
+	// any other thread starts, SIGUSR1 only ends the watch.
+	void watchInterrupt()
+	{
+		sigset_t signals;
+		sigemptyset(&signals);
+		sigaddset(&signals, SIGINT);
+		sigaddset(&signals, SIGTERM);
+		sigaddset(&signals, SIGUSR1);
+		pthread_sigmask(SIG_BLOCK, &signals, nullptr);
+
+		m_signalThread = std::thread([this, signals]() {
+			int signal = 0;
+			sigwait(&signals, &signal);
+			if (signal != SIGUSR1)
+				m_abort.trigger();
+		});
+	}
+
+	void unwatchInterrupt()
+	{
+		pthread_kill(m_signalThread.native_handle(), SIGUSR1);
+		m_signalThread.join();
+	}
+#endif
+
+	std::vector<std::string> m_urls;
+	std::vector<std::string> m_mirrors; // of the single url
+	std::string m_treeHash;
+	std::string m_metricsPath;
+	std::vector<std::string> m_filePaths;
+	std::string m_filePath;
+	bool m_overwrite = false;
+	int64_t m_connNum = 0;
+	int64_t m_parts = 3;
+	int64_t m_maxJobs = 3;
+	int64_t m_rateLimit = 0;
+	int64_t m_jobRateLimit = 0;
+	int64_t m_stragglerWindow = 8;
+	AppTaskParam::Engine m_engine = AppTaskParam::Engine::Threads;
+
+	AbortSignal m_abort;
+	std::vector<std::string> m_resumed;
+	size_t m_progressWidth = 0;
+
+#ifdef _WIN32
+	static AbortSignal* s_abort;
+#else
+	std::thread m_signalThread;
+#endif
+};
+
+#ifdef _WIN32
+AbortSignal* Cli::s_abort = nullptr;
+#endif
+
+END_NAMESPACE_MCD
+
+
+#ifdef _WIN32
+int wmain(int argc, wchar_t* argv[])
+{
+	std::vector<std::string> args;
+	for (int i = 1; i < argc; ++i)
+		args.push_back(mcd::u16to8(argv[i]));
+
+	return mcd::Cli().run(args);
+}
+#else
+int main(int argc, char* argv[])
+{
+	std::vector<std::string> args(argv + 1, argv + argc);
+	return mcd::Cli().run(args);
+}
+#endif
@@ -0,0 +1,491 @@
+#include "../mcd/engine/download.h"
+#include "../mcd_bench/range_server.h"
+#include <stdio.h>
+
+#ifdef _WIN32
+#pragma comment(lib, "winhttp")
+#pragma comment(lib, "shlwapi")
+#pragma comment(lib, "bcrypt")
+#else
+#include <dlfcn.h>
+#include <netdb.h>
+
+// hosts named "slow*" resolve to 127.0.0.1 only after a while, for a
+// request cancelled before it gets to connect; the resolver thread of
+// AddressCache calls this one instead of the one of the C library
+extern "C" int getaddrinfo(const char* node, const char* service,
+	const struct addrinfo* hints, struct addrinfo** res)
+{
+	typedef int (*Fn)(const char*, const char*,
+		const struct addrinfo*, struct addrinfo**);
+	static Fn real = (Fn)dlsym(RTLD_NEXT, "getaddrinfo");
+
+	if (node && strncmp(node, "slow", 4) == 0) {
+		mcd::sleep(1.5);
+		node = "127.0.0.1";
+	}
+
+	return real(node, service, hints, res);
+}
+#endif
+
+BEGIN_NAMESPACE_MCD
+
+// fails the test it is in, with where and what
+#define _expect(cond) \
+	if (!(cond)) { \
+		fprintf(stderr, "  %s(%d): %s\n", __FILE__, __LINE__, #cond); \
+		return InternalError::assertFailed(); \
+	}
+
+// HttpRequest over the transport of the platform, and the engines above
+// it, against a RangeServer on the loopback: the ways a body is framed,
+// ranges, redirects, reused connections, and cancels at each stage of
+// a connection. Each test runs on servers of its own.
+class Test
+{
+public:
+	typedef std::function<Result()> TestFn;
+
+	static constexpr double kCancelDelay = 0.2;
+	static constexpr double kMaxCancelTime = 1.0; // well below the timeout
+	static const int64_t kMaxBody = MB(4);
+
+	int run(const std::vector<std::string>& args)
+	{
+		if (args.size() > 1 || (args.size() && args[0][0] == '-')) {
+			fprintf(stderr, "usage: mcd_test [<name filter>]\n");
+			return 1;
+		}
+
+		std::string filter = args.size() ? args[0] : "";
+
+		addTests();
+		int failures = 0;
+		for (auto& i : m_tests) {
+			if (i.name.find(filter) == std::string::npos)
+				continue;
+
+			Result r = i.fn();
+			if (r.ok()) {
+				fprintf(stderr, "ok      %s\n", i.name.c_str());
+				continue;
+			}
+
+			++failures;
+			fprintf(stderr, "FAILED  %s: %s\n",
+				i.name.c_str(), resultString(r).c_str());
+		}
+
+		return failures ? 2 : 0;
+	}
+
+private:
+	struct Case
+	{
+		std::string name;
+		TestFn fn;
+	};
+
+	void addTests()
+	{
+		add("http1::redirectUrl", redirectUrl);
+		add("transport: content-length", contentLength);
+		add("transport: range", range);
+		add("transport: range past 2^41", largeRange);
+		add("transport: chunked", chunked);
+		add("transport: until close", untilClose);
+		add("transport: redirect", redirect);
+		add("transport: keep-alive", keepAlive);
+		add("transport: keep-alive closed by the server", keepAliveClosed);
+		add("engine: threads", std::bind(download,
+			AppTaskParam::Engine::Threads));
+#ifndef _WIN32
+		add("engine: reactor", std::bind(download,
+			AppTaskParam::Engine::Reactor));
+
+		// last, the slow lookup holds up the resolver for a while
+		add("transport: cancel during connect", cancelDuringConnect);
+		add("transport: cancel before connect", cancelBeforeConnect);
+#endif
+	}
+
+	void add(ConStrRef name, TestFn fn)
+	{
+		m_tests.push_back({ name, fn });
+	}
+
+	static RangeServer::Options serverOptions(int64_t fileSize)
+	{
+		RangeServer::Options options;
+		options.fileSize = fileSize;
+		return options;
+	}
+
+	static std::string urlOf(const RangeServer& server, ConStrRef path)
+	{
+		std::string url = server.url();
+		return url.substr(0, url.rfind('/')) + path;
+	}
+
+	static Result get(HttpGetRequest* http, ConStrRef url,
+		std::string* body, const RequestHeaders& headers = {})
+	{
+		body->clear();
+		_call(http->open(url, headers));
+
+		HttpResponseString response(body, kMaxBody);
+		return http->saveResponse(&response);
+	}
+
+	// the made up content of the server, from `first` on
+	static bool sameContent(ConStrRef body, int64_t first)
+	{
+		for (size_t i = 0; i < body.size(); ++i) {
+			if ((BYTE)body[i] != RangeServer::byteAt(first + i))
+				return false;
+		}
+
+		return true;
+	}
+
+	static double secondsSince(std::chrono::steady_clock::time_point start)
+	{
+		return std::chrono::duration<double>(
+			std::chrono::steady_clock::now() - start).count();
+	}
+
+	static Result redirectUrl()
+	{
+		StringParser::HttpUrl http("http://a.test/dir/file?x=1");
+		StringParser::HttpUrl https("https://a.test/dir/file");
+
+		auto next = http1::redirectUrl(http, "other");
+		_expect(next.host() == "a.test" && next.path() == "/dir/other");
+		_expect(http1::redirectUrl(http, "/root").path() == "/root");
+		_expect(http1::redirectUrl(http, "https://b.test/x").valid());
+		_expect(http1::redirectUrl(https, "https://b.test/x").valid());
+		_expect(http1::redirectUrl(https, "/x").overSSL());
+
+		// a downgrade is refused
+		_expect(!http1::redirectUrl(https, "http://b.test/x").valid());
+		return {};
+	}
+
+	static Result contentLength()
+	{
+		RangeServer server;
+		_call(server.start(serverOptions(MB(1) + 7)));
+
+		HttpGetRequest http;
+		_call(http.init());
+		std::string body;
+		_call(get(&http, server.url(), &body));
+
+		_expect(http.statusCode() == 200);
+		_expect(http.headers().contentLength().get() == MB(1) + 7);
+		_expect(body.size() == MB(1) + 7);
+		_expect(sameContent(body, 0));
+		return {};
+	}
+
+	static Result range()
+	{
+		RangeServer server;
+		_call(server.start(serverOptions(MB(1))));
+
+		HttpGetRequest http;
+		_call(http.init());
+		std::string body;
+		_call(get(&http, server.url(), &body, { "Range: bytes=1000-1999" }));
+
+		std::array<int64_t, 3> range;
+		_call(parseHttpRange(http.headers()
+			.firstValue("Content-Range"), &range));
+
+		_expect(http.statusCode() == 206);
+		_expect(range[0] == 1000 && range[1] == 1999 && range[2] == MB(1));
+		_expect(body.size() == 1000);
+		_expect(sameContent(body, 1000));
+		return {};
+	}
+
+	// no more than the last bytes of a file of 3TB are sent
+	static Result largeRange()
+	{
+		const int64_t size = GB64(3) * 1024;
+		const int64_t first = size - KB(64) - 3;
+
+		RangeServer server;
+		_call(server.start(serverOptions(size)));
+
+		HttpGetRequest http;
+		_call(http.init());
+		std::string body;
+		std::string header = "Range: bytes=" + std::to_string(first) + "-";
+		_call(get(&http, server.url(), &body, { header }));
+
+		std::array<int64_t, 3> range;
+		_call(parseHttpRange(http.headers()
+			.firstValue("Content-Range"), &range));
+
+		_expect(http.statusCode() == 206);
+		_expect(range[0] == first && range[1] == size - 1 && range[2] == size);
+		_expect(http.headers().contentLength().get() == size - first);
+		_expect((int64_t)body.size() == size - first);
+		_expect(sameContent(body, first));
+		return {};
+	}
+
+	static Result chunked()
+	{
+		RangeServer server;
+		_call(server.start(serverOptions(RangeServer::kChunk * 3 + 5)));
+
+		HttpGetRequest http;
+		_call(http.init());
+		std::string body;
+		_call(get(&http, urlOf(server, "/chunked.bin"), &body));
+
+		_expect(http.statusCode() == 200);
+		_expect(!http.headers().contentLength().didSet());
+		_expect(body.size() == RangeServer::kChunk * 3 + 5);
+		_expect(sameContent(body, 0));
+
+		// the connection is good for the next request after the last chunk
+		_call(get(&http, urlOf(server, "/chunked.bin"), &body));
+		_expect(body.size() == RangeServer::kChunk * 3 + 5);
+		_expect(server.connectionsAccepted() == 1);
+		return {};
+	}
+
+	static Result untilClose()
+	{
+		RangeServer server;
+		_call(server.start(serverOptions(MB(1) + 3)));
+
+		HttpGetRequest http;
+		_call(http.init());
+		std::string body;
+		_call(get(&http, urlOf(server, "/close.bin"), &body));
+
+		_expect(http.statusCode() == 200);
+		_expect(body.size() == MB(1) + 3);
+		_expect(sameContent(body, 0));
+
+		// and the next request needs a new connection
+		_call(get(&http, urlOf(server, "/close.bin"), &body));
+		_expect(body.size() == MB(1) + 3);
+		_expect(server.connectionsAccepted() == 2);
+		return {};
+	}
+
+	static Result redirect()
+	{
+		RangeServer server;
+		_call(server.start(serverOptions(KB(100))));
+
+		for (auto path : { "/moved.bin", "/moved-abs.bin" }) {
+			HttpGetRequest http;
+			_call(http.init());
+			std::string body;
+			_call(get(&http, urlOf(server, path), &body,
+				{ "Range: bytes=10-19" }));
+
+			_expect(http.statusCode() == 206);
+			_expect(body.size() == 10);
+			_expect(sameContent(body, 10));
+		}
+
+		return {};
+	}
+
+	static Result keepAlive()
+	{
+		RangeServer server;
+		_call(server.start(serverOptions(KB(100))));
+
+		HttpGetRequest http;
+		_call(http.init());
+		std::string body;
+		for (int i = 0; i < 3; ++i) {
+			std::string header = "Range: bytes=" + std::to_string(i * 10) + "-";
+			_call(get(&http, server.url(), &body, { header }));
+			_expect(http.statusCode() == 206);
+			_expect(sameContent(body, i * 10));
+		}
+
+		_expect(server.connectionsAccepted() == 1);
+		return {};
+	}
+
+	// the request sent on the connection the server has closed is
+	// sent again on a new one, without an error
+	static Result keepAliveClosed()
+	{
+		RangeServer::Options options = serverOptions(KB(100));
+		options.maxRequests = 1;
+
+		RangeServer server;
+		_call(server.start(options));
+
+		HttpGetRequest http;
+		_call(http.init());
+		std::string body;
+		for (int i = 0; i < 3; ++i) {
+			_call(get(&http, server.url(), &body, { "Range: bytes=5-" }));
+			_expect(http.statusCode() == 206);
+			_expect(body.size() == KB(100) - 5);
+
+			// the close is seen on the next send, not before
+			if (i == 0)
+				server.waitIdle(1.0);
+		}
+
+		_expect(server.connectionsAccepted() == 3);
+		return {};
+	}
+
+	// a download of the whole engine, from a server that closes the
+	// connections now and then
+	static Result download(AppTaskParam::Engine engine)
+	{
+		RangeServer::Options options = serverOptions(MB(8) + 11);
+		options.maxRequests = 4;
+
+		RangeServer server;
+		_call(server.start(options));
+
+		AbortSignal abort;
+		DownloadJournal::Validator validator;
+		_call(checkUrlSupportRange(&validator, server.url(), {}, &abort));
+		_expect(validator.size == options.fileSize);
+
+		std::string path = "mcd_test.bin";
+		removeFile(path);
+
+		AppTaskParam param;
+		param.url = server.url();
+		param.filePath = path;
+		param.validator = validator;
+		param.totalSize = validator.size;
+		param.granularity = taskGranularity(validator.size, 8 * 5);
+		param.connNum = 8;
+		param.engine = engine;
+
+		Result result;
+		{
+			AppDownloadContractor contractor;
+			contractor.onHeartbeat([]() {});
+			result = contractor.start(param);
+		}
+
+		std::string body;
+		if (result.ok()) {
+			std::ifstream file(nativePath(path), std::ios::binary);
+			body.assign(std::istreambuf_iterator<char>(file),
+				std::istreambuf_iterator<char>());
+		}
+
+		removeFile(path);
+		_call(std::move(result));
+		_expect((int64_t)body.size() == options.fileSize);
+		_expect(sameContent(body, 0));
+		_expect(!fileExists(DownloadJournal::pathFor(path)));
+		return {};
+	}
+
+#ifndef _WIN32
+	// a request cancelled from another thread while it waits
+	static Result cancelledOpen(ConStrRef url, double* seconds)
+	{
+		HttpConfig config;
+		config.setConnectTimeout(10);
+
+		HttpGetRequest http;
+		_call(http.init(config));
+
+		auto start = std::chrono::steady_clock::now();
+		std::thread canceller([&]() {
+			sleep(kCancelDelay);
+			http.abort();
+		});
+
+		Result r = http.open(url);
+		*seconds = secondsSince(start);
+		canceller.join();
+
+		_expect(r.failed());
+		return {};
+	}
+
+	// a listener with a backlog of one, filled up: the SYN of any
+	// further connection is dropped and its connect() waits
+	static Result cancelDuringConnect()
+	{
+		Guard::Fd listener(socket(AF_INET, SOCK_STREAM, 0));
+		_expect(listener);
+
+		sockaddr_in addr = {};
+		addr.sin_family = AF_INET;
+		addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		socklen_t len = sizeof(addr);
+		_expect(bind(listener.get(), (sockaddr*)&addr, sizeof(addr)) == 0
+			&& listen(listener.get(), 0) == 0
+			&& getsockname(listener.get(), (sockaddr*)&addr, &len) == 0);
+
+		std::vector<std::unique_ptr<Guard::Fd>> fillers;
+		for (int i = 0; i < 3; ++i) {
+			fillers.emplace_back(new Guard::Fd(
+				socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0)));
+			connect(fillers.back()->get(), (sockaddr*)&addr, sizeof(addr));
+		}
+
+		int port = ntohs(addr.sin_port);
+		double seconds = 0;
+		_call(cancelledOpen("http://127.0.0.1:" + std::to_string(port)
+			+ "/bench.bin", &seconds));
+
+		_expect(seconds < kMaxCancelTime);
+		return {};
+	}
+
+	// while the host is still being looked up
+	static Result cancelBeforeConnect()
+	{
+		RangeServer server;
+		_call(server.start(serverOptions(KB(1))));
+
+		std::string url = server.url();
+		url.replace(url.find("127.0.0.1"), 9, "slow.test");
+
+		double seconds = 0;
+		_call(cancelledOpen(url, &seconds));
+		_expect(seconds < kMaxCancelTime);
+		_expect(server.connectionsAccepted() == 0);
+		return {};
+	}
+#endif
+
+	std::vector<Case> m_tests;
+};
+
+END_NAMESPACE_MCD
+
+
+#ifdef _WIN32
+int wmain(int argc, wchar_t* argv[])
+{
+	std::vector<std::string> args;
+	for (int i = 1; i < argc; ++i)
+		args.push_back(mcd::u16to8(argv[i]));
+
+	return mcd::Test().run(args);
+}
+#else
+int main(int argc, char* argv[])
+{
+	std::vector<std::string> args(argv + 1, argv + argc);
+	return mcd::Test().run(args);
+}
+#endif